@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Decode an ADC capture of `main` (CAPTURE_FILE, src/capture.h) into the CSV of DEBUG_SENSORS.
+
+    python3 capture.py robot.cap > run.csv               # what `tune` reads
+    python3 capture.py robot.cap --time --from 60 --to 90  # seconds since the first sample
+"""
+
+import argparse
+import os
+import struct
+import sys
+from typing import BinaryIO, Iterator, List, Optional, Tuple
+
+CAPTURE_MAGIC = 0x50414352
+CAPTURE_BLOCK_MAGIC = 0x4B4C4243
+CAPTURE_INDEX_MAGIC = 0x58444952
+CAPTURE_VERSION = 1
+CHANNELS = 4
+
+FILE_HEADER = struct.Struct("<IHHIIq")
+BLOCK_HEADER = struct.Struct("<IHHQQ4H")
+INDEX_ENTRY = struct.Struct("<QQ")
+FOOTER = struct.Struct("<IIQ")
+
+Sample = Tuple[int, List[int]]
+
+
+def varint(data: bytes, pos: int) -> Tuple[int, int]:
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value, pos
+        shift += 7
+
+
+def unzigzag(v: int) -> int:
+    return (v >> 1) ^ -(v & 1)
+
+
+class CaptureReader:
+    def __init__(self, f: BinaryIO):
+        self.f = f
+        magic, version, channels, self.block_size, _, self.start_time = (
+            FILE_HEADER.unpack(f.read(FILE_HEADER.size))
+        )
+        if magic != CAPTURE_MAGIC or version != CAPTURE_VERSION or channels != CHANNELS:
+            raise ValueError(f"not a version {CAPTURE_VERSION} capture")
+        size = os.fstat(f.fileno()).st_size
+        self.first_times = self.read_index(size)
+        if self.first_times is None:
+            # Cut short, no index: every block header up to the first that is not one
+            self.first_times = []
+            for b in range(size // self.block_size - 1):
+                header = self.block_header(b)
+                if header is None:
+                    break
+                self.first_times.append(header[4])
+
+    def read_index(self, size: int) -> Optional[List[int]]:
+        if size < FOOTER.size:
+            return None
+        self.f.seek(size - FOOTER.size)
+        magic, blocks, offset = FOOTER.unpack(self.f.read(FOOTER.size))
+        if magic != CAPTURE_INDEX_MAGIC:
+            return None
+        self.f.seek(offset)
+        data = self.f.read(blocks * INDEX_ENTRY.size)
+        return [t for _, t in INDEX_ENTRY.iter_unpack(data)]
+
+    def block_header(self, b: int):
+        self.f.seek(self.block_size * (1 + b))
+        data = self.f.read(BLOCK_HEADER.size)
+        if len(data) < BLOCK_HEADER.size:
+            return None
+        header = BLOCK_HEADER.unpack(data)
+        return header if header[0] == CAPTURE_BLOCK_MAGIC else None
+
+    def block(self, b: int) -> Iterator[Sample]:
+        self.f.seek(self.block_size * (1 + b))
+        data = self.f.read(self.block_size)
+        _, count, size, _, time_us, *adc = BLOCK_HEADER.unpack_from(data)
+        payload = data[BLOCK_HEADER.size : BLOCK_HEADER.size + size]
+        yield time_us, list(adc)
+        pos = 0
+        step = 0
+        for _ in range(count - 1):
+            delta, pos = varint(payload, pos)
+            step += unzigzag(delta)
+            time_us += step
+            for c in range(CHANNELS):
+                delta, pos = varint(payload, pos)
+                adc[c] += unzigzag(delta)
+            yield time_us, list(adc)
+
+    def samples(self, start_us: int = 0) -> Iterator[Sample]:
+        """From the first sample at or after start_us"""
+        first = 0
+        for b, time_us in enumerate(self.first_times):
+            if time_us <= start_us:
+                first = b
+        for b in range(first, len(self.first_times)):
+            for sample in self.block(b):
+                if sample[0] >= start_us:
+                    yield sample
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument("capture")
+    parser.add_argument("--time", action="store_true", help="add a time_us column")
+    parser.add_argument("--from", dest="start", type=float, default=0, help="seconds")
+    parser.add_argument("--to", dest="end", type=float, help="seconds")
+    args = parser.parse_args()
+
+    with open(args.capture, "rb") as f:
+        reader = CaptureReader(f)
+        if not reader.first_times:
+            return
+        origin = reader.first_times[0]
+        end_us = None if args.end is None else origin + int(args.end * 1e6)
+        out = sys.stdout
+        out.write(("time_us, " if args.time else "") + "adc0, adc1, adc2, adc3\n")
+        for time_us, adc in reader.samples(origin + int(args.start * 1e6)):
+            if end_us is not None and time_us > end_us:
+                break
+            prefix = f"{time_us}, " if args.time else ""
+            out.write(prefix + ", ".join(str(v) for v in adc) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -15,6 +15,8 @@ import numpy as np
 from dijkstar import Graph, find_path
 from numpy.typing import NDArray
 
+import visibility
+
 logger = logging.getLogger(__file__)
 
 
@@ -379,6 +381,24 @@ def collides_with_rectangles(
     return False
 
 
+def collisions(
+    lines: Iterable[Tuple[Point, Point]],
+    collision_rects: Iterable[Rect],
+    *,
+    threshold=0.01,
+) -> List[bool]:
+    """collides_with_rectangles for many lines, in the visibility kernel when it is built"""
+    lines = list(lines)
+    collision_rects = list(collision_rects)
+    index = visibility.index(collision_rects, threshold=threshold)
+    if index is not None:
+        return list(index.collides(lines))
+    return [
+        collides_with_rectangles(line, collision_rects, threshold=threshold)
+        for line in lines
+    ]
+
+
 def connect_points(
     points: List[Point],
     collision_rects: Iterable[Rect],
@@ -386,19 +406,25 @@ def connect_points(
     graph: Graph,
     cost=dist,
 ):
-    n = len(points)
-    for i, vertex_1 in enumerate(points):
-        for j in range(i + 1, n):
-            vertex_2 = points[j]
-            if collides_with_rectangles(
-                line=(vertex_1, vertex_2), collision_rects=collision_rects
-            ):
-                continue
-            c = cost(vertex_1, vertex_2)
-            idx_1 = tuple(vertex_1)
-            idx_2 = tuple(vertex_2)
-            graph.add_edge(idx_1, idx_2, c)
-            graph.add_edge(idx_2, idx_1, c)
+    collision_rects = list(collision_rects)
+    index = visibility.index(collision_rects)
+    if index is not None:
+        visible = ((points[i], points[j]) for i, j in index.graph(points))
+    else:
+        visible = (
+            (vertex_1, points[j])
+            for i, vertex_1 in enumerate(points)
+            for j in range(i + 1, len(points))
+            if not collides_with_rectangles(
+                line=(vertex_1, points[j]), collision_rects=collision_rects
+            )
+        )
+    for vertex_1, vertex_2 in visible:
+        c = cost(vertex_1, vertex_2)
+        idx_1 = tuple(vertex_1)
+        idx_2 = tuple(vertex_2)
+        graph.add_edge(idx_1, idx_2, c)
+        graph.add_edge(idx_2, idx_1, c)
 
     return graph
 
@@ -415,8 +441,10 @@ def connect_point(
 ):
     # objects = [get_rect(collision) for collision in get_collision_points(map)]
     point_id = tuple(point)
-    for vertex in vertices:
-        if collides_with_rectangles(line=(vertex, point), collision_rects=rects):
+    vertices = list(vertices)
+    blocked = collisions(((vertex, point) for vertex in vertices), rects)
+    for vertex, collides in zip(vertices, blocked):
+        if collides:
             continue
         c = cost(point, vertex)
         idx = tuple(vertex)
@@ -9,15 +9,26 @@ from typing import Tuple
 import numpy as np
 from detection import Point, dist, draw_map, path_to_destination, setup_graph
 from management import execute_bash_command
+from path_cache import load as load_path_cache
 
 logger = logging.getLogger(__file__)
 
 
 def graph_loop(mapfile="map.txt", enlarging_safety=2):
-    rects, vertices, g, m = setup_graph(mapfile, enlarging_safety)
+    # planning/path_cache.py precomputes the paths, without it the graph is built here
+    cache = load_path_cache(mapfile, enlarging_safety)
+    if cache is not None:
+        rects, m = cache.rects, cache.m
+    else:
+        rects, vertices, g, m = setup_graph(mapfile, enlarging_safety)
 
     def get_next(init: Point, end: Point, dryrun=False):
-        path = path_to_destination(init, end, rects=rects, vertices=vertices, graph=g)
+        if cache is not None:
+            path = cache.path(init, end)
+        else:
+            path = path_to_destination(
+                init, end, rects=rects, vertices=vertices, graph=g
+            )
         if dryrun:
             draw_map(m, rects, lines=list(np.array(p) for p in path), point=end)
 
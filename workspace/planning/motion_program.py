@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""Compile a motion program listing into the binary `main program FILE` runs (src/program.h).
+
+One step per line, `#` starts a comment:
+
+    turn 90             # degrees, counter-clockwise positive
+    move 400 wait       # mm; wait: an obstacle stops it until the way is clear, as move_from_to does
+    move 500 speed 40   # speed 0 or none takes SPEED
+    clear 1500          # stop until nothing is closer than that many mm
+
+    python3 motion_program.py patrol.txt -o patrol.bin
+    python3 motion_program.py patrol.txt | ./main program -
+"""
+
+import argparse
+import struct
+import sys
+from typing import List, TextIO, Tuple
+
+PROGRAM_MAGIC = 0x47504D52
+PROGRAM_VERSION = 1
+PROGRAM_MAX_STEPS = 4096
+
+HEADER = struct.Struct("<IHH")
+STEP = struct.Struct("<BBhf")
+
+MOVE = 1
+TURN = 2
+WAIT_CLEAR = 3
+TYPES = {"move": MOVE, "turn": TURN, "clear": WAIT_CLEAR}
+PREEMPT_OBSTACLE_WAIT = 1
+
+
+def parse(lines: TextIO) -> List[Tuple[int, int, int, float]]:
+    steps = []
+    for number, line in enumerate(lines, 1):
+        words = line.split("#", 1)[0].split()
+        if not words:
+            continue
+        try:
+            kind = TYPES[words[0]]
+            param = float(words[1])
+            speed = 0
+            preempt = 0
+            rest = words[2:]
+            while rest:
+                if rest[0] == "wait" and kind == MOVE:
+                    preempt = PREEMPT_OBSTACLE_WAIT
+                    rest = rest[1:]
+                elif rest[0] == "speed":
+                    speed = int(rest[1])
+                    rest = rest[2:]
+                else:
+                    raise ValueError(f"unexpected {rest[0]}")
+        except (KeyError, IndexError, ValueError) as e:
+            raise SystemExit(f"line {number}: {line.strip()!r}: {e}")
+        steps.append((kind, preempt, speed, param))
+    if not 0 < len(steps) <= PROGRAM_MAX_STEPS:
+        raise SystemExit(f"{len(steps)} steps, 1 to {PROGRAM_MAX_STEPS} expected")
+    return steps
+
+
+def compile_program(steps: List[Tuple[int, int, int, float]]) -> bytes:
+    data = HEADER.pack(PROGRAM_MAGIC, PROGRAM_VERSION, len(steps))
+    return data + b"".join(STEP.pack(*step) for step in steps)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument("listing", type=argparse.FileType("r"))
+    parser.add_argument("-o", "--output", help="binary program, stdout by default")
+    args = parser.parse_args()
+
+    data = compile_program(parse(args.listing))
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(data)
+    else:
+        sys.stdout.buffer.write(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+"""All pairs shortest paths between the obstacle vertices of a map, computed once.
+
+setup_graph and find_path redo the whole visibility graph and a Dijkstra for every
+planner start and query. Running
+
+    python3 planning/path_cache.py map.txt --enlarge 2
+
+stores the distances and next hop tables between every pair of vertices. A query then
+only connects the start and the goal to the vertices they see and combines the cached
+distances. The file is keyed by a hash of the map contents and the enlargement, any
+change makes it miss and the planner goes back to the graph.
+
+Layout, little endian: header (HEADER), vertices as count x 2 float64, distances as
+count x count float32 (inf without a way) and next hops as count x count uint16
+(NO_HOP without a way).
+"""
+
+import argparse
+import hashlib
+import logging
+import struct
+from os import getenv, path
+from typing import List, Optional, Tuple, Union
+
+import numpy as np
+import visibility
+from detection import (
+    Point,
+    collisions,
+    dist,
+    get_collision_rects,
+    get_vertices,
+    read_map,
+    safety_enlarging,
+)
+from numpy.typing import NDArray
+
+logger = logging.getLogger(__file__)
+
+MAGIC = b"APSP"
+VERSION = 1
+# magic, version, enlargement, vertex count, key
+HEADER = struct.Struct("<4sHHI32s")
+NO_HOP = 0xFFFF
+MAX_VERTICES = NO_HOP
+
+
+def map_key(m: NDArray, enlarging_safety: int) -> bytes:
+    """sha256 of the map cells, not of the text, and the enlargement"""
+    h = hashlib.sha256()
+    h.update(struct.pack("<III", VERSION, *m.shape))
+    h.update(np.ascontiguousarray(m, dtype="<f8").tobytes())
+    h.update(struct.pack("<i", enlarging_safety))
+    return h.digest()
+
+
+def cache_file(mapfile: str, key: bytes) -> str:
+    """In PATH_CACHE when it is set, next to the map otherwise"""
+    folder = getenv("PATH_CACHE") or path.dirname(path.abspath(mapfile))
+    name = path.splitext(path.basename(mapfile))[0]
+    return path.join(folder, f"{name}-{key[:8].hex()}.apsp")
+
+
+def map_graph(m: NDArray, enlarging_safety: int):
+    """Obstacles and vertices as setup_graph has them"""
+    rects = list(safety_enlarging(get_collision_rects(m), enlarging_safety))
+    vertices = list(get_vertices(rects, d=1))
+    return rects, vertices
+
+
+def shortest_paths(costs: NDArray) -> NDArray:
+    """Floyd-Warshall in place of the edge costs, in the visibility kernel when it is built"""
+    next_hop = visibility.shortest_paths(costs)
+    if next_hop is not None:
+        return next_hop
+
+    n = len(costs)
+    np.fill_diagonal(costs, 0)
+    next_hop = np.where(np.isinf(costs), -1, np.arange(n)[None, :]).astype(np.int32)
+    for k in range(n):
+        via = costs[:, k, None] + costs[None, k, :]
+        better = via < costs
+        costs[better] = via[better]
+        next_hop = np.where(better, next_hop[:, k, None], next_hop)
+    return next_hop
+
+
+def precompute(mapfile: str, enlarging_safety: int, out: Optional[str] = None) -> str:
+    m = read_map(mapfile)
+    key = map_key(m, enlarging_safety)
+    rects, vertices = map_graph(m, enlarging_safety)
+    n = len(vertices)
+    if n > MAX_VERTICES:
+        raise ValueError(f"{n} vertices, the next hops only fit {MAX_VERTICES}")
+
+    points = np.array(vertices, dtype=np.float64).reshape(-1, 2)
+    costs = np.full((n, n), np.inf)
+    index = visibility.index(rects)
+    if index is not None:
+        pairs = index.graph(vertices)
+    else:
+        candidates = [(i, j) for i in range(n) for j in range(i + 1, n)]
+        blocked = collisions(((vertices[i], vertices[j]) for i, j in candidates), rects)
+        pairs = [pair for pair, b in zip(candidates, blocked) if not b]
+    pairs = np.array(pairs, dtype=np.intp).reshape(-1, 2)
+    i, j = pairs[:, 0], pairs[:, 1]
+    costs[i, j] = costs[j, i] = np.sqrt(((points[i] - points[j]) ** 2).sum(axis=1))
+
+    next_hop = shortest_paths(costs)
+
+    out = out or cache_file(mapfile, key)
+    with open(out, "wb") as f:
+        f.write(HEADER.pack(MAGIC, VERSION, enlarging_safety, n, key))
+        f.write(points.astype("<f8").tobytes())
+        f.write(costs.astype("<f4").tobytes())
+        f.write(np.where(next_hop < 0, NO_HOP, next_hop).astype("<u2").tobytes())
+    logger.info("%s: %d vertices, %d edges", out, n, len(pairs))
+    return out
+
+
+class PathCache:
+    def __init__(
+        self, filename: str, key: bytes, m: NDArray, rects, vertices: List[Point]
+    ):
+        """ValueError when the file is not for this map and enlargement"""
+        with open(filename, "rb") as f:
+            magic, version, _, n, file_key = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC or version != VERSION or file_key != key:
+            raise ValueError(f"{filename} is not a version {VERSION} cache of this map")
+
+        offset = HEADER.size
+        points = np.memmap(filename, "<f8", "r", offset, (n, 2))
+        offset += points.nbytes
+        self.costs = np.memmap(filename, "<f4", "r", offset, (n, n))
+        offset += self.costs.nbytes
+        self.next_hop = np.memmap(filename, "<u2", "r", offset, (n, n))
+        if not np.array_equal(points, np.array(vertices).reshape(-1, 2)):
+            raise ValueError(f"{filename} has other vertices than the map")
+
+        self.m = m
+        self.rects = rects
+        self.vertices = vertices
+
+    def visible(self, point: Point) -> NDArray:
+        """Indices of the vertices point sees, as connect_point"""
+        blocked = collisions(((vertex, point) for vertex in self.vertices), self.rects)
+        return np.flatnonzero(~np.array(blocked, dtype=bool))
+
+    def hops(self, u: int, v: int) -> List[Tuple]:
+        nodes = [tuple(self.vertices[u])]
+        while u != v:
+            u = int(self.next_hop[u, v])
+            nodes.append(tuple(self.vertices[u]))
+        return nodes
+
+    def path(
+        self, init: Point, end: Point
+    ) -> List[Tuple[Union[float, int], Union[float, int]]]:
+        """Same as path_to_destination, KeyError when there is no way"""
+        best = np.inf
+        if not collisions([(end, init)], self.rects)[0]:
+            best = dist(init, end)
+        hops: List[Tuple] = []
+
+        starts = self.visible(init)
+        ends = self.visible(end)
+        if len(starts) and len(ends):
+            points = np.array(self.vertices, dtype=np.float64).reshape(-1, 2)
+            to_start = np.sqrt(((points[starts] - init) ** 2).sum(axis=1))
+            from_end = np.sqrt(((points[ends] - end) ** 2).sum(axis=1))
+            total = (
+                to_start[:, None]
+                + self.costs[np.ix_(starts, ends)].astype(np.float64)
+                + from_end[None, :]
+            )
+            u, v = np.unravel_index(np.argmin(total), total.shape)
+            if total[u, v] < best:
+                best = total[u, v]
+                hops = self.hops(int(starts[u]), int(ends[v]))
+
+        if np.isinf(best):
+            raise KeyError(f"No way from {init} to {end}")
+        path = [tuple(init), *hops, tuple(end)]
+        logger.info("Cached path %s (%.2f)\n\t go to %s", path, best, path[1])
+        return path
+
+
+def load(mapfile: str, enlarging_safety: int) -> Optional[PathCache]:
+    """None when there is no cache for this map and enlargement"""
+    m = read_map(mapfile)
+    key = map_key(m, enlarging_safety)
+    filename = cache_file(mapfile, key)
+    if not path.exists(filename):
+        logger.debug("No path cache %s", filename)
+        return None
+    rects, vertices = map_graph(m, enlarging_safety)
+    try:
+        return PathCache(filename, key, m, rects, vertices)
+    except ValueError as e:
+        logger.warning("Ignoring path cache: %s", e)
+        return None
+
+
+def main():
+    logging.basicConfig(level=logging.INFO, format="%(message)s")
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("mapfile", nargs="?", default="map.txt")
+    parser.add_argument(
+        "--enlarge",
+        type=int,
+        default=2,
+        help="Safety enlargement in map units, as main.py gets from --enlarge / SCALE_MAP_MM",
+    )
+    parser.add_argument("--out", help="Where to write it, instead of cache_file")
+    args = parser.parse_args()
+    precompute(args.mapfile, args.enlarge, args.out)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Read the robot state `main` publishes in shared memory (src/state.h).
+
+The writer never waits for us: the sequence number is odd while it is updating,
+so we copy the state and try again if the sequence moved in between.
+
+    python3 robot_state.py            # print the state every 100 ms
+    python3 robot_state.py --once
+"""
+
+import argparse
+import mmap
+import struct
+import time
+from dataclasses import dataclass, fields
+from typing import Optional
+
+SEGMENT_PATH = "/dev/shm/robot-state"  # STATE_SEGMENT_NAME
+STATE_MAGIC = 0x52424F54
+STATE_VERSION = 1
+READ_TRIES = 1000
+
+# StateSegment and RobotState, same order and widths, no padding on either side
+HEADER = struct.Struct("=IIII")
+STATE = struct.Struct("=IIddddiiddddiiiiIiII")
+
+OBSTACLE_INTERRUPT = 1
+OBSTACLE_L = 2
+OBSTACLE_R = 4
+
+
+@dataclass
+class RobotState:
+    time_ms: int
+    samples: int
+    x: float
+    y: float
+    theta: float
+    position_sigma_mm: float
+    odometer_l: int
+    odometer_r: int
+    slots_l: float
+    slots_r: float
+    velocity_l: float
+    velocity_r: float
+    command_l: int
+    command_r: int
+    proximity_l: int
+    proximity_r: int
+    obstacles: int
+    sensor_period_ms: int
+    loop_us: int
+    running: int
+
+
+class StateReader:
+    def __init__(self, path: str = SEGMENT_PATH):
+        with open(path, "rb") as f:
+            self.memory = mmap.mmap(
+                f.fileno(), HEADER.size + STATE.size, access=mmap.ACCESS_READ
+            )
+        magic, version, _, size = HEADER.unpack_from(self.memory, 0)
+        if magic != STATE_MAGIC or version != STATE_VERSION or size != STATE.size:
+            self.memory.close()
+            raise ValueError(
+                f"{path} is not a version {STATE_VERSION} robot state segment"
+            )
+
+    def sequence(self) -> int:
+        return struct.unpack_from("=I", self.memory, 8)[0]
+
+    def read(self) -> Optional[RobotState]:
+        """None when the writer kept updating for READ_TRIES attempts"""
+        for _ in range(READ_TRIES):
+            before = self.sequence()
+            if before & 1:
+                continue
+            values = STATE.unpack_from(self.memory, HEADER.size)
+            if self.sequence() == before:
+                return RobotState(*values)
+        return None
+
+    def close(self):
+        self.memory.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--path", default=SEGMENT_PATH)
+    parser.add_argument("--interval", type=float, default=0.1, help="seconds")
+    parser.add_argument("--once", action="store_true")
+    args = parser.parse_args()
+
+    reader = StateReader(args.path)
+    names = [f.name for f in fields(RobotState)]
+    print(", ".join(names))
+    try:
+        while True:
+            state = reader.read()
+            if state is not None:
+                print(", ".join(str(getattr(state, name)) for name in names))
+            if args.once or (state is not None and not state.running):
+                break
+            time.sleep(args.interval)
+    finally:
+        reader.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""Run many missions against the simulator build (`make sim`) in parallel.
+
+Reports, for every mission, how far the robot really ended from the target
+and how far it believes it is, so changes can be compared before touching the robot.
+"""
+
+import argparse
+import logging
+import random
+import re
+import subprocess
+from concurrent.futures import ThreadPoolExecutor
+from dataclasses import dataclass
+from math import hypot
+from os import cpu_count, environ
+from statistics import mean, median
+from typing import List, Optional, Tuple
+
+logger = logging.getLogger(__file__)
+
+SCALE_MAP_MM = 100  # map scale: 1 map unit = X mm
+
+SIM_EXPIRED_EXIT_CODE = 124  # sim/sim.h, the firmware ran past SIM_LIMIT_MS of virtual time
+
+SIM_PATTERN = re.compile(
+    r"\[SIM\] t=(\d+) ms; true \(x, y, theta\) (-?\d+\.\d+), (-?\d+\.\d+), (-?\d+\.\d+); collisions (\d+)"
+)
+P_OUT_PATTERN = re.compile(
+    r"p_out: \(x, y, theta\) (-?\d+\.\d+), (-?\d+\.\d+), (-?\d+\.\d+)"
+)
+
+
+@dataclass
+class Mission:
+    init: Tuple[int, int, int]
+    end: Tuple[int, int]
+    seed: int
+
+
+@dataclass
+class MissionResult:
+    mission: Mission
+    returncode: int
+    time_ms: int = 0
+    true_error_mm: float = float("nan")
+    believed_error_mm: float = float("nan")
+    collisions: int = 0
+
+
+def free_cells(mapfile: str) -> List[Tuple[int, int]]:
+    with open(mapfile) as f:
+        rows = [line.split() for line in f if line.strip()]
+    h = len(rows)
+    # Rows are read top to bottom, y goes up
+    return [
+        (x, h - 1 - r)
+        for r, row in enumerate(rows)
+        for x, value in enumerate(row)
+        if value == "0"
+    ]
+
+
+def random_missions(mapfile: str, n: int, seed: int) -> List[Mission]:
+    rng = random.Random(seed)
+    cells = free_cells(mapfile)
+    missions = []
+    for i in range(n):
+        (x0, y0), (x1, y1) = rng.sample(cells, 2)
+        theta = rng.choice((0, 90, 180, -90))
+        missions.append(
+            Mission(
+                init=(x0 * SCALE_MAP_MM, y0 * SCALE_MAP_MM, theta),
+                end=(x1 * SCALE_MAP_MM, y1 * SCALE_MAP_MM),
+                seed=seed + i + 1,
+            )
+        )
+    return missions
+
+
+def run_mission(
+    exe: str, mapfile: str, mission: Mission, speed: int, timeout: float
+) -> MissionResult:
+    x, y, theta = mission.init
+    env = dict(
+        environ,
+        X_INIT=str(x),
+        Y_INIT=str(y),
+        THETA_INIT=str(theta),
+        SPEED=str(speed),
+        SIM_SEED=str(mission.seed),
+        SIM_MAP=mapfile,
+    )
+    cmd = [exe, "movereckless", str(mission.end[0]), str(mission.end[1])]
+    try:
+        process = subprocess.run(
+            cmd, env=env, capture_output=True, text=True, timeout=timeout
+        )
+    except subprocess.TimeoutExpired:
+        logger.warning("%s took more than %.0f s", mission, timeout)
+        return MissionResult(mission=mission, returncode=-1)
+    result = MissionResult(mission=mission, returncode=process.returncode)
+    if process.returncode == SIM_EXPIRED_EXIT_CODE:
+        logger.warning("%s never finished", mission)
+
+    sim: Optional[re.Match] = None
+    for sim in SIM_PATTERN.finditer(process.stderr):
+        pass
+    believed = P_OUT_PATTERN.findall(process.stderr)
+    ex, ey = mission.end
+    if sim is not None:
+        result.time_ms = int(sim.group(1))
+        result.true_error_mm = hypot(float(sim.group(2)) - ex, float(sim.group(3)) - ey)
+        result.collisions = int(sim.group(5))
+    if believed:
+        bx, by, _ = believed[-1]
+        result.believed_error_mm = hypot(float(bx) - ex, float(by) - ey)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--exe", default="./main-sim", help="Simulator executable.")
+    parser.add_argument("--map-file", dest="mapfile", default="map.txt")
+    parser.add_argument("--missions", type=int, default=100)
+    parser.add_argument("--speed", type=int, default=30)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--jobs", type=int, default=cpu_count())
+    parser.add_argument("--timeout", type=float, default=60, help="Seconds per mission.")
+    args = parser.parse_args()
+
+    level = logging.DEBUG if environ.get("DEBUG") else logging.INFO
+    logging.basicConfig(level=level, format="%(message)s")
+
+    missions = random_missions(args.mapfile, args.missions, args.seed)
+    with ThreadPoolExecutor(max_workers=args.jobs) as pool:
+        results = list(
+            pool.map(
+                lambda m: run_mission(
+                    args.exe, args.mapfile, m, args.speed, args.timeout
+                ),
+                missions,
+            )
+        )
+
+    for r in results:
+        logger.debug(r)
+    ok = [r for r in results if r.returncode == 0 and r.true_error_mm == r.true_error_mm]
+    if not ok:
+        logger.error("No mission finished")
+        return
+    true_errors = [r.true_error_mm for r in ok]
+    logger.info("missions %d, finished %d", len(results), len(ok))
+    logger.info(
+        "true error mm: mean %.1f, median %.1f, max %.1f",
+        mean(true_errors),
+        median(true_errors),
+        max(true_errors),
+    )
+    logger.info(
+        "believed error mm: mean %.1f",
+        mean(r.believed_error_mm for r in ok if r.believed_error_mm == r.believed_error_mm),
+    )
+    logger.info("collisions %d", sum(r.collisions for r in ok))
+    logger.info("virtual time per mission ms: mean %.0f", mean(r.time_ms for r in ok))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,13 +1,28 @@
+import random
+import shutil
+
+import path_cache
+import pytest
+import visibility
 from detection import (
     List,
     NDArray,
     Rect,
     collides_with_rectangles,
+    dist,
     draw_map,
     get_collision_rects,
+    get_vertices,
     line_detector,
     np,
+    path_to_destination,
     read_file_to_array,
+    safety_enlarging,
+    setup_graph,
+)
+
+needs_kernel = pytest.mark.skipif(
+    visibility.library() is None, reason="make visibility to build the kernel"
 )
 
 
@@ -45,6 +60,128 @@ def test_collide():
     assert line_detector(*np_points) is None, "should not collide"
 
 
+def random_rects(rng: random.Random, count: int) -> List[Rect]:
+    rects = [
+        Rect(
+            np.array([rng.randint(0, 60), rng.randint(0, 60)]),
+            h=rng.randint(1, 8),
+            w=rng.randint(1, 8),
+        )
+        for _ in range(count)
+    ]
+    return list(safety_enlarging(rects, rng.randint(0, 2)))
+
+
+def random_segments(rng: random.Random, rects: List[Rect], count: int):
+    corners = [p for rect in rects for p in rect.points()]
+    corners += list(get_vertices(rects, d=1))
+
+    def point():
+        return np.array([rng.uniform(-5, 75), rng.uniform(-5, 75)])
+
+    for _ in range(count):
+        kind = rng.randrange(4)
+        if kind == 0:
+            yield point(), point()
+        elif kind == 1:
+            # Corner to corner, through the ends of the sides
+            yield rng.choice(corners), rng.choice(corners)
+        elif kind == 2:
+            yield rng.choice(corners), point()
+        else:
+            # Along a side
+            p1, p2 = rng.choice(list(rng.choice(rects).segments()))
+            yield p1, p2
+
+
+@needs_kernel
+@pytest.mark.parametrize("threshold", [0.01, 1, -2])
+def test_kernel_collides(threshold):
+    rng = random.Random(49)
+    for _ in range(5):
+        rects = random_rects(rng, rng.randint(1, 30))
+        segments = list(random_segments(rng, rects, 600))
+        native = visibility.index(rects, threshold=threshold).collides(segments)
+        expected = [
+            collides_with_rectangles(line, rects, threshold=threshold)
+            for line in segments
+        ]
+        assert list(native) == expected
+
+
+@needs_kernel
+@pytest.mark.parametrize("threshold", [0.01, 1, -2])
+def test_kernel_graph(threshold):
+    rng = random.Random(50)
+    rects = random_rects(rng, 15)
+    points = list(get_vertices(rects, d=1))
+    points += [np.array([rng.uniform(0, 70), rng.uniform(0, 70)]) for _ in range(20)]
+    index = visibility.index(rects, threshold=threshold)
+    native = [tuple(pair) for pair in index.graph(points)]
+    expected = [
+        (i, j)
+        for i in range(len(points))
+        for j in range(i + 1, len(points))
+        if not collides_with_rectangles(
+            (points[i], points[j]), rects, threshold=threshold
+        )
+    ]
+    assert native == expected
+
+
+def path_length(path) -> float:
+    return sum(dist(np.array(p1), np.array(p2)) for p1, p2 in zip(path, path[1:]))
+
+
+def test_path_cache(tmp_path):
+    mapfile = str(tmp_path / "map.txt")
+    shutil.copy("map.txt", mapfile)
+    path_cache.precompute(mapfile, 2)
+    cache = path_cache.load(mapfile, 2)
+    assert cache is not None
+
+    rng = random.Random(50)
+    width, height = cache.m.shape
+    for _ in range(20):
+        init, end = (
+            np.array([rng.uniform(0, width - 1), rng.uniform(0, height - 1)])
+            for _ in range(2)
+        )
+        rects, vertices, g, _ = setup_graph(mapfile, 2)
+        try:
+            expected = path_to_destination(
+                init, end, rects=rects, vertices=vertices, graph=g
+            )
+        except Exception:
+            with pytest.raises(KeyError):
+                cache.path(init, end)
+            continue
+        cached = cache.path(init, end)
+        assert cached[0] == tuple(init) and cached[-1] == tuple(end)
+        assert path_length(cached) == pytest.approx(path_length(expected), rel=1e-6)
+
+    assert path_cache.load(mapfile, 3) is None
+    with open(mapfile, "a") as f:
+        f.write(" ".join(["0"] * cache.m.shape[0]) + "\n")
+    assert path_cache.load(mapfile, 2) is None
+
+
+@needs_kernel
+def test_shortest_paths_fallback(monkeypatch):
+    rng = np.random.default_rng(50)
+    n = 40
+    costs = np.where(rng.random((n, n)) < 0.15, rng.random((n, n)), np.inf)
+    costs = np.minimum(costs, costs.T)
+
+    native = costs.copy()
+    native_next = path_cache.shortest_paths(native)
+    monkeypatch.setattr(visibility, "shortest_paths", lambda _: None)
+    fallback = costs.copy()
+    fallback_next = path_cache.shortest_paths(fallback)
+    assert np.array_equal(native, fallback)
+    assert np.array_equal(native_next, fallback_next)
+
+
 if __name__ == "__main__":
     test_collide()
     test_rects()
@@ -0,0 +1,393 @@
+#include "visibility.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+    double x;
+    double y;
+} Vec;
+
+typedef struct {
+    Vec bl;
+    double w;
+    double h;
+} VisRect;
+
+struct VisibilityIndex {
+    VisRect* rects;
+    int count;
+    double threshold;
+    // Grid over the sides of the rectangles, as far as line_detector reaches past their corners
+    double x0;
+    double y0;
+    double x1;
+    double y1;
+    double cell_w;
+    double cell_h;
+    int cols;
+    int rows;
+    int* cell_start; // cols * rows + 1, rectangles of cell c are cell_rects[cell_start[c]..cell_start[c + 1]]
+    int* cell_rects;
+};
+
+/**
+ * Rectangles already tested by the current query, so one in several cells is tested once
+ */
+typedef struct {
+    uint32_t* marks;
+    uint32_t query;
+} Visited;
+
+static Vec sub(Vec a, Vec b)
+{
+    return (Vec) { a.x - b.x, a.y - b.y };
+}
+
+static double cross(Vec a, Vec b)
+{
+    return a.x * b.y - a.y * b.x;
+}
+
+static double dist(Vec a, Vec b)
+{
+    Vec d = sub(b, a);
+    return sqrt(d.x * d.x + d.y * d.y);
+}
+
+/**
+ * Rect.has_inside
+ */
+static bool has_inside(const VisRect* r, Vec p, double threshold)
+{
+    return r->bl.x + threshold <= p.x && p.x <= r->bl.x + r->w - threshold
+        && r->bl.y + threshold <= p.y && p.y <= r->bl.y + r->h - threshold;
+}
+
+/**
+ * line_detector, false when they do not cross
+ */
+static bool line_detector(Vec a1, Vec a2, Vec b1, Vec b2, Vec* p)
+{
+    Vec v_a = sub(a2, a1);
+    Vec v_b = sub(b2, b1);
+    Vec v_ab = sub(b1, a1);
+    double va_cross_vb = cross(v_a, v_b);
+    if (va_cross_vb == 0) {
+        return false;
+    }
+
+    double t = -cross(v_a, v_ab) / va_cross_vb;
+    if (t < -VISIBILITY_EPSILON || t > 1 + VISIBILITY_EPSILON) {
+        return false;
+    }
+    double r = -cross(v_b, v_ab) / va_cross_vb;
+    if (r < -VISIBILITY_EPSILON || r > 1 + VISIBILITY_EPSILON) {
+        return false;
+    }
+
+    p->x = b1.x + t * v_b.x;
+    p->y = b1.y + t * v_b.y;
+    return true;
+}
+
+/**
+ * collides_with_rectangles for one rectangle
+ */
+static bool rect_blocks(const VisRect* r, Vec v1, Vec v2, double threshold)
+{
+    if (has_inside(r, v1, threshold) || has_inside(r, v2, threshold)) {
+        return true;
+    }
+    Vec middle = { (v1.x + v2.x) / 2, (v1.y + v2.y) / 2 };
+    if (has_inside(r, middle, threshold)) {
+        return true;
+    }
+
+    Vec bl = r->bl;
+    Vec br = { r->bl.x + r->w, r->bl.y };
+    Vec tr = { r->bl.x + r->w, r->bl.y + r->h };
+    Vec tl = { r->bl.x, r->bl.y + r->h };
+    Vec sides[5] = { bl, br, tr, tl, bl };
+    for (int i = 0; i < 4; i++) {
+        Vec p;
+        // Allow the corners to be added
+        if (line_detector(v1, v2, sides[i], sides[i + 1], &p) && dist(p, v1) > threshold && dist(p, v2) > threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Everything of the rectangle a query can find: the ends of its sides, a threshold out when it is negative
+ */
+static void reach(const VisRect* r, double threshold, double* x0, double* y0, double* x1, double* y1)
+{
+    double w = fabs(r->w);
+    double h = fabs(r->h);
+    double margin = threshold < 0 ? -threshold : 0;
+    *x0 = fmin(r->bl.x, r->bl.x + r->w) - VISIBILITY_EPSILON * w - margin;
+    *x1 = fmax(r->bl.x, r->bl.x + r->w) + VISIBILITY_EPSILON * w + margin;
+    *y0 = fmin(r->bl.y, r->bl.y + r->h) - VISIBILITY_EPSILON * h - margin;
+    *y1 = fmax(r->bl.y, r->bl.y + r->h) + VISIBILITY_EPSILON * h + margin;
+}
+
+static int cell_index(double v, double origin, double size, int n)
+{
+    double i = floor((v - origin) / size);
+    if (i < 0) {
+        return 0;
+    }
+    if (i >= n) {
+        return n - 1;
+    }
+    return (int)i;
+}
+
+VisibilityIndex* visibility_index(const double* rects, int count, double threshold)
+{
+    VisibilityIndex* index = calloc(1, sizeof(VisibilityIndex));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->count = count > 0 ? count : 0;
+    index->threshold = threshold;
+    index->rects = malloc(sizeof(VisRect) * (size_t)(index->count + 1));
+    if (index->rects == NULL) {
+        visibility_free(index);
+        return NULL;
+    }
+
+    index->x0 = index->y0 = INFINITY;
+    index->x1 = index->y1 = -INFINITY;
+    for (int i = 0; i < index->count; i++) {
+        VisRect* r = &index->rects[i];
+        r->bl.x = rects[4 * i];
+        r->bl.y = rects[4 * i + 1];
+        r->w = rects[4 * i + 2];
+        r->h = rects[4 * i + 3];
+        double x0, y0, x1, y1;
+        reach(r, threshold, &x0, &y0, &x1, &y1);
+        index->x0 = fmin(index->x0, x0);
+        index->y0 = fmin(index->y0, y0);
+        index->x1 = fmax(index->x1, x1);
+        index->y1 = fmax(index->y1, y1);
+    }
+
+    if (index->count == 0) {
+        index->cols = index->rows = 0;
+        return index;
+    }
+
+    double width = index->x1 - index->x0;
+    double height = index->y1 - index->y0;
+    double cells = fmin((double)index->count * VISIBILITY_CELLS_PER_RECT, VISIBILITY_MAX_CELLS);
+    if (width > 0 && height > 0) {
+        index->cols = (int)ceil(sqrt(cells * width / height));
+        index->rows = (int)ceil(cells / index->cols);
+    } else {
+        // All of them on a line
+        index->cols = width > 0 ? (int)cells : 1;
+        index->rows = height > 0 ? (int)cells : 1;
+    }
+    index->cell_w = width > 0 ? width / index->cols : 1;
+    index->cell_h = height > 0 ? height / index->rows : 1;
+
+    int n = index->cols * index->rows;
+    index->cell_start = calloc((size_t)n + 1, sizeof(int));
+    if (index->cell_start == NULL) {
+        visibility_free(index);
+        return NULL;
+    }
+    // Count per cell, then lay them out in place
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < index->count; i++) {
+            double x0, y0, x1, y1;
+            reach(&index->rects[i], threshold, &x0, &y0, &x1, &y1);
+            int c0 = cell_index(x0, index->x0, index->cell_w, index->cols);
+            int c1 = cell_index(x1, index->x0, index->cell_w, index->cols);
+            int r0 = cell_index(y0, index->y0, index->cell_h, index->rows);
+            int r1 = cell_index(y1, index->y0, index->cell_h, index->rows);
+            for (int row = r0; row <= r1; row++) {
+                for (int col = c0; col <= c1; col++) {
+                    int cell = row * index->cols + col;
+                    if (pass == 0) {
+                        index->cell_start[cell + 1]++;
+                    } else {
+                        index->cell_rects[index->cell_start[cell]++] = i;
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int cell = 0; cell < n; cell++) {
+                index->cell_start[cell + 1] += index->cell_start[cell];
+            }
+            index->cell_rects = malloc(sizeof(int) * (size_t)(index->cell_start[n] + 1));
+            if (index->cell_rects == NULL) {
+                visibility_free(index);
+                return NULL;
+            }
+        }
+    }
+    // The fill moved every start to the next cell
+    for (int cell = n; cell > 0; cell--) {
+        index->cell_start[cell] = index->cell_start[cell - 1];
+    }
+    index->cell_start[0] = 0;
+    return index;
+}
+
+void visibility_free(VisibilityIndex* index)
+{
+    if (index == NULL) {
+        return;
+    }
+    free(index->rects);
+    free(index->cell_start);
+    free(index->cell_rects);
+    free(index);
+}
+
+static bool visited(Visited* v, int rect)
+{
+    if (v->marks[rect] == v->query) {
+        return true;
+    }
+    v->marks[rect] = v->query;
+    return false;
+}
+
+static bool test_cell(const VisibilityIndex* index, Visited* v, int cell, Vec v1, Vec v2)
+{
+    for (int k = index->cell_start[cell]; k < index->cell_start[cell + 1]; k++) {
+        int i = index->cell_rects[k];
+        if (!visited(v, i) && rect_blocks(&index->rects[i], v1, v2, index->threshold)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Walks the cells under the segment, as far as line_detector reaches past its ends, row by row
+ */
+static bool segment_blocked(const VisibilityIndex* index, Visited* v, Vec v1, Vec v2)
+{
+    if (index->count == 0) {
+        return false;
+    }
+    if (++v->query == 0) {
+        for (int i = 0; i < index->count; i++) {
+            v->marks[i] = 0;
+        }
+        v->query = 1;
+    }
+
+    Vec d = sub(v2, v1);
+    Vec e1 = { v1.x - VISIBILITY_EPSILON * d.x, v1.y - VISIBILITY_EPSILON * d.y };
+    Vec e2 = { v2.x + VISIBILITY_EPSILON * d.x, v2.y + VISIBILITY_EPSILON * d.y };
+    double xmin = fmin(e1.x, e2.x);
+    double xmax = fmax(e1.x, e2.x);
+    double ymin = fmin(e1.y, e2.y);
+    double ymax = fmax(e1.y, e2.y);
+    if (xmax < index->x0 || xmin > index->x1 || ymax < index->y0 || ymin > index->y1) {
+        return false;
+    }
+    // Rounding of the row crossings, a cell too many is only slower
+    double slack = index->cell_w * 1e-6;
+
+    int r0 = cell_index(ymin, index->y0, index->cell_h, index->rows);
+    int r1 = cell_index(ymax, index->y0, index->cell_h, index->rows);
+    for (int row = r0; row <= r1; row++) {
+        double lo = xmin;
+        double hi = xmax;
+        if (d.y != 0 && r0 != r1) {
+            double band0 = fmax(ymin, index->y0 + row * index->cell_h);
+            double band1 = fmin(ymax, index->y0 + (row + 1) * index->cell_h);
+            double xa = e1.x + (band0 - e1.y) * d.x / d.y;
+            double xb = e1.x + (band1 - e1.y) * d.x / d.y;
+            lo = fmax(xmin, fmin(xa, xb) - slack);
+            hi = fmin(xmax, fmax(xa, xb) + slack);
+        }
+        int c0 = cell_index(lo, index->x0, index->cell_w, index->cols);
+        int c1 = cell_index(hi, index->x0, index->cell_w, index->cols);
+        for (int col = c0; col <= c1; col++) {
+            if (test_cell(index, v, row * index->cols + col, v1, v2)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+int visibility_collides(const VisibilityIndex* index, const double* segments, int count, uint8_t* result)
+{
+    Visited v = { calloc((size_t)index->count + 1, sizeof(uint32_t)), 0 };
+    if (v.marks == NULL) {
+        return -1;
+    }
+    int blocked = 0;
+    for (int i = 0; i < count; i++) {
+        const double* s = &segments[4 * i];
+        result[i] = segment_blocked(index, &v, (Vec) { s[0], s[1] }, (Vec) { s[2], s[3] });
+        blocked += result[i];
+    }
+    free(v.marks);
+    return blocked;
+}
+
+long visibility_graph(const VisibilityIndex* index, const double* points, int count, int32_t* pairs, long capacity)
+{
+    Visited v = { calloc((size_t)index->count + 1, sizeof(uint32_t)), 0 };
+    if (v.marks == NULL) {
+        return -1;
+    }
+    long found = 0;
+    for (int i = 0; i < count; i++) {
+        Vec v1 = { points[2 * i], points[2 * i + 1] };
+        for (int j = i + 1; j < count; j++) {
+            Vec v2 = { points[2 * j], points[2 * j + 1] };
+            if (segment_blocked(index, &v, v1, v2)) {
+                continue;
+            }
+            if (found < capacity) {
+                pairs[2 * found] = i;
+                pairs[2 * found + 1] = j;
+            }
+            found++;
+        }
+    }
+    free(v.marks);
+    return found;
+}
+
+void visibility_shortest_paths(double* dist, int32_t* next, int count)
+{
+    size_t n = count > 0 ? (size_t)count : 0;
+    for (size_t i = 0; i < n; i++) {
+        dist[i * n + i] = 0;
+        for (size_t j = 0; j < n; j++) {
+            next[i * n + j] = isinf(dist[i * n + j]) ? -1 : (int32_t)j;
+        }
+    }
+    // Row and column k do not change while going through k, so they can be updated in place
+    for (size_t k = 0; k < n; k++) {
+        const double* via = &dist[k * n];
+        for (size_t i = 0; i < n; i++) {
+            double* row = &dist[i * n];
+            double to_k = row[k];
+            if (isinf(to_k)) {
+                continue;
+            }
+            int32_t first = next[i * n + k];
+            for (size_t j = 0; j < n; j++) {
+                if (to_k + via[j] < row[j]) {
+                    row[j] = to_k + via[j];
+                    next[i * n + j] = first;
+                }
+            }
+        }
+    }
+}
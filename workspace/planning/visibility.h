@@ -0,0 +1,48 @@
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+/**
+ * Visibility graph kernel of the planner, loaded by planning/visibility.py (`make visibility`).
+ *
+ * Same answers as collides_with_rectangles in detection.py, to the bit: a segment is blocked by a
+ * rectangle when an end or its middle is inside it (threshold in from the edges), or when it crosses
+ * one of its sides (line_detector, VISIBILITY_EPSILON past the ends of both) away from its own ends.
+ * Rectangles are kept in a uniform grid over their sides, so a query only tests the ones whose cells
+ * the segment goes through instead of all of them.
+ */
+
+#include <stdint.h>
+
+// Same margin as line_detector, as a fraction of each segment
+#define VISIBILITY_EPSILON 0.1
+// Grid cells per rectangle, the grid is about square
+#define VISIBILITY_CELLS_PER_RECT 1
+#define VISIBILITY_MAX_CELLS (1 << 20)
+
+typedef struct VisibilityIndex VisibilityIndex;
+
+/**
+ * rects is count times (x, y, w, h), bottom left corner first as Rect. NULL when out of memory
+ */
+extern VisibilityIndex* visibility_index(const double* rects, int count, double threshold);
+extern void visibility_free(VisibilityIndex* index);
+
+/**
+ * segments is count times (x1, y1, x2, y2), result[i] is 1 when the segment is blocked.
+ * Returns how many are
+ */
+extern int visibility_collides(const VisibilityIndex* index, const double* segments, int count, uint8_t* result);
+
+/**
+ * Pairs (i, j), i < j, of points that see each other, in the order connect_points adds them.
+ * Writes up to capacity pairs and returns how many there are, negative when out of memory
+ */
+extern long visibility_graph(const VisibilityIndex* index, const double* points, int count, int32_t* pairs, long capacity);
+
+/**
+ * All pairs shortest paths over the graph, Floyd-Warshall in place. dist is count x count edge costs,
+ * INFINITY where there is none, next[i * count + j] is set to the vertex after i on the way to j, -1 when there is no way
+ */
+extern void visibility_shortest_paths(double* dist, int32_t* next, int count);
+
+#endif
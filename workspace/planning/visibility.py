@@ -0,0 +1,129 @@
+"""Visibility graph kernel in C (planning/visibility.c), built with `make visibility`.
+
+detection.py uses it when the library is there and falls back to its python loops
+otherwise, the answers are the same. VISIBILITY_LIB points to another build,
+VISIBILITY_LIB=none keeps to python.
+"""
+
+import ctypes
+import logging
+from os import getenv, path
+from typing import Iterable, List, Optional, Sequence, Tuple
+
+import numpy as np
+
+logger = logging.getLogger(__file__)
+
+LIBRARY = path.join(path.dirname(path.abspath(__file__)), "libvisibility.so")
+
+_lib = None
+_loaded = False
+
+_doubles = np.ctypeslib.ndpointer(dtype=np.float64, flags="C_CONTIGUOUS")
+
+
+def library():
+    """The loaded kernel, None when it is not built"""
+    global _lib, _loaded
+    if _loaded:
+        return _lib
+    _loaded = True
+    name = getenv("VISIBILITY_LIB", LIBRARY)
+    if name == "none":
+        return None
+    try:
+        lib = ctypes.CDLL(name)
+    except OSError as e:
+        logger.debug("No visibility kernel (%s), planning in python", e)
+        return None
+
+    lib.visibility_index.argtypes = [_doubles, ctypes.c_int, ctypes.c_double]
+    lib.visibility_index.restype = ctypes.c_void_p
+    lib.visibility_free.argtypes = [ctypes.c_void_p]
+    lib.visibility_free.restype = None
+    lib.visibility_collides.argtypes = [
+        ctypes.c_void_p,
+        _doubles,
+        ctypes.c_int,
+        np.ctypeslib.ndpointer(dtype=np.uint8, flags="C_CONTIGUOUS"),
+    ]
+    lib.visibility_collides.restype = ctypes.c_int
+    lib.visibility_graph.argtypes = [
+        ctypes.c_void_p,
+        _doubles,
+        ctypes.c_int,
+        np.ctypeslib.ndpointer(dtype=np.int32, flags="C_CONTIGUOUS"),
+        ctypes.c_long,
+    ]
+    lib.visibility_graph.restype = ctypes.c_long
+    lib.visibility_shortest_paths.argtypes = [
+        _doubles,
+        np.ctypeslib.ndpointer(dtype=np.int32, flags="C_CONTIGUOUS"),
+        ctypes.c_int,
+    ]
+    lib.visibility_shortest_paths.restype = None
+    _lib = lib
+    return _lib
+
+
+class VisibilityIndex:
+    """Rectangles (anything with bl, w and h, as detection.Rect) in a grid for bulk queries"""
+
+    def __init__(self, lib, rects: Sequence, threshold: float):
+        self._lib = lib
+        boxes = np.array(
+            [(r.bl[0], r.bl[1], r.w, r.h) for r in rects], dtype=np.float64
+        ).reshape(-1, 4)
+        self._index = lib.visibility_index(boxes, len(boxes), threshold)
+        if not self._index:
+            raise MemoryError("visibility_index")
+
+    def __del__(self):
+        index = getattr(self, "_index", None)
+        if index:
+            self._lib.visibility_free(index)
+            self._index = None
+
+    def collides(self, segments: Iterable[Tuple]) -> np.ndarray:
+        """Bool per (p1, p2) segment, True when a rectangle blocks it"""
+        lines = np.array([(*p1, *p2) for p1, p2 in segments], dtype=np.float64)
+        lines = lines.reshape(-1, 4)
+        result = np.zeros(len(lines), dtype=np.uint8)
+        if self._lib.visibility_collides(self._index, lines, len(lines), result) < 0:
+            raise MemoryError("visibility_collides")
+        return result.astype(bool)
+
+    def graph(self, points: List) -> np.ndarray:
+        """(i, j) pairs, i < j, of the points that see each other"""
+        coords = np.array(points, dtype=np.float64).reshape(-1, 2)
+        capacity = 8 * len(coords)
+        while True:
+            pairs = np.zeros((capacity, 2), dtype=np.int32)
+            found = self._lib.visibility_graph(
+                self._index, coords, len(coords), pairs, capacity
+            )
+            if found < 0:
+                raise MemoryError("visibility_graph")
+            if found <= capacity:
+                return pairs[:found]
+            capacity = found
+
+
+def index(rects: Sequence, *, threshold=0.01) -> Optional[VisibilityIndex]:
+    """None without the kernel"""
+    lib = library()
+    if lib is None:
+        return None
+    return VisibilityIndex(lib, rects, threshold)
+
+
+def shortest_paths(dist: np.ndarray) -> Optional[np.ndarray]:
+    """All pairs shortest paths in place of the n x n edge costs (inf without an edge),
+    returns the next hop table (-1 without a way), None without the kernel"""
+    lib = library()
+    if lib is None:
+        return None
+    n = len(dist)
+    next_hop = np.zeros((n, n), dtype=np.int32)
+    lib.visibility_shortest_paths(dist, next_hop, n)
+    return next_hop
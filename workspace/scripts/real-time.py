@@ -17,16 +17,23 @@ For example
 
 ssh -t pi@192.168.1.1 "DEBUG_SENSORS=1 sudo -E /home/pi/alex/Notes_Master_UCM_Tech_Fotonica/Robots/programming/pi/workspace" | python real-time.py
 
+Binary telemetry over UDP (src/telemetry.h), no printf on the robot and no ssh in between
+
+python real-time.py --udp 5005
+ssh pi@192.168.1.1 "TELEMETRY_HOST=<this machine> TELEMETRY_BATCH_MS=50 sudo -E ./main ..."
+
 """
 
 import argparse
 import random
+import socket
+import struct
 import sys
 from collections import namedtuple
 from dataclasses import dataclass, field
 from itertools import islice
 from time import time
-from typing import Iterable, List, Tuple
+from typing import Iterable, List, Optional, Tuple
 
 import matplotlib.pyplot as plt
 from iterators import TimeoutIterator
@@ -35,6 +42,12 @@ from matplotlib.animation import FuncAnimation
 DataType = List[float]
 LineData = namedtuple("LineData", ["x", "y"])
 
+# TelemetryHeader and TelemetrySample in src/telemetry.h
+TELEMETRY_MAGIC = 0x544C4D52
+TELEMETRY_VERSION = 1
+TELEMETRY_HEADER = struct.Struct("<IHHII")
+TELEMETRY_SAMPLE = struct.Struct("<I4Hii3f")
+
 
 @dataclass
 class Options:
@@ -47,13 +60,17 @@ class Options:
     data_iterator: Iterable[DataType] = field(init=False)
     min: int
     max: int
+    udp: Optional[int] = None
 
     def __post_init__(self):
-        if self.test:
-            input_iter = Options.fake_input(self.nargs)
+        if self.udp is not None:
+            self.data_iterator = Options.udp_input(self.udp)
         else:
-            input_iter = sys.stdin
-        self.data_iterator = Options.extract_data(input_iter)
+            if self.test:
+                input_iter = Options.fake_input(self.nargs)
+            else:
+                input_iter = sys.stdin
+            self.data_iterator = Options.extract_data(input_iter)
         self.interval = int(1 / self.framerate * 1000)
 
     @staticmethod
@@ -64,6 +81,35 @@ class Options:
                 for i in range(nargs)
             )
 
+    @staticmethod
+    def udp_input(port: int):
+        """ADC readings of every sample in the telemetry datagrams, gaps in the sequence are reported"""
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind(("", port))
+        expected = None
+        lost = 0
+        while True:
+            datagram, _ = sock.recvfrom(65535)
+            if len(datagram) < TELEMETRY_HEADER.size:
+                continue
+            magic, version, count, sequence, dropped = TELEMETRY_HEADER.unpack_from(
+                datagram
+            )
+            if magic != TELEMETRY_MAGIC or version != TELEMETRY_VERSION:
+                continue
+            if expected is not None and sequence != expected:
+                lost += sequence - expected
+                print(
+                    f"lost {sequence - expected} datagrams ({lost} in total, {dropped} samples dropped on the robot)",
+                    file=sys.stderr,
+                )
+            expected = sequence + 1
+            for i in range(count):
+                sample = TELEMETRY_SAMPLE.unpack_from(
+                    datagram, TELEMETRY_HEADER.size + i * TELEMETRY_SAMPLE.size
+                )
+                yield list(sample[1:5])
+
     @staticmethod
     def parse_args():
         parser = argparse.ArgumentParser()
@@ -110,6 +156,12 @@ class Options:
             default=1023,
             help="Maximum input value",
         )
+        parser.add_argument(
+            "--udp",
+            type=int,
+            default=None,
+            help="Port to receive binary telemetry on, instead of CSV lines on stdin",
+        )
         args = parser.parse_args()
         return Options(
             test=args.test,
@@ -119,6 +171,7 @@ class Options:
             max=args.max,
             framerate=args.framerate,
             batching=args.batching,
+            udp=args.udp,
         )
 
     @staticmethod
@@ -0,0 +1,582 @@
+/**
+ * Virtual clock: every thread takes part in it (see the thrd_create / thrd_join / cnd_wait wrappers)
+ * and only one of them runs at a time. When it calls delay() the clock jumps straight to
+ * the earliest wake up and the physics are stepped up to it, so a mission runs as fast as
+ * the CPU allows. Computing takes no virtual time and the order is fixed, so a run only
+ * depends on SIM_SEED.
+ */
+#include "sim.h"
+#include "occupancy.h"
+#include "sensors.h"
+#include "wiringPi.h"
+#include "wiringPiSPI.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+
+once_flag sim_once = ONCE_FLAG_INIT;
+mtx_t sim_lock;
+cnd_t sim_tick;
+uint64_t sim_now_us = SIM_START_US;
+// Slot of the only thread on the clock allowed to run, -1 while choosing the next one
+int sim_running = -1;
+uint64_t sim_wake_us[SIM_MAX_THREADS];
+bool sim_is_waiting[SIM_MAX_THREADS];
+bool sim_in_clock[SIM_MAX_THREADS];
+// Condition a thread is blocked on, it can run again at the time it is signalled
+cnd_t* sim_waiting_on[SIM_MAX_THREADS];
+_Thread_local int sim_slot = -1;
+tss_t sim_leave_key;
+unsigned int sim_limit_ms = SIM_LIMIT_MS;
+
+void sim_leave_clock(void* slot);
+// cnd_wait and cnd_broadcast are wrapped for the firmware, the clock itself uses the real ones
+int __real_cnd_wait(cnd_t* cond, mtx_t* mtx);
+int __real_cnd_broadcast(cnd_t* cond);
+
+SimRobot robot;
+OccupancyGrid sim_map;
+bool sim_has_map = false;
+unsigned int sim_seed = 88172645u;
+// Sunlight on the IR receivers, raises every reading and makes it noisier
+int sim_ir_ambient = 0;
+// Virtual ms after which a wheel is blocked, 0 never
+int sim_stall_l_ms = 0;
+int sim_stall_r_ms = 0;
+int pwm_divisor = 192;
+
+double sim_uniform(void)
+{
+    sim_seed ^= sim_seed << 13;
+    sim_seed ^= sim_seed >> 17;
+    sim_seed ^= sim_seed << 5;
+    return (double)(sim_seed >> 8) / 16777216.0;
+}
+
+double sim_gaussian(double sigma)
+{
+    double u1 = sim_uniform() + 1e-9;
+    double u2 = sim_uniform();
+    return sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * PI * u2);
+}
+
+int sim_env(const char* name, int default_value)
+{
+    const char* value = getenv(name);
+    return value ? atoi(value) : default_value;
+}
+
+void sim_report(void)
+{
+    mtx_lock(&sim_lock);
+    fprintf(stderr, "[SIM] t=%llu ms; true (x, y, theta) %f, %f, %f; collisions %d; slots (l, r) %f, %f\n",
+        (unsigned long long)(sim_now_us / 1000), robot.x, robot.y, robot.theta * 180.0 / PI, robot.collisions,
+        robot.wheel_rev_l * SIM_SLOTS, robot.wheel_rev_r * SIM_SLOTS);
+    mtx_unlock(&sim_lock);
+}
+
+/**
+ * Light through the disc, smoothed square wave with a rising and a falling edge every period
+ */
+double encoder_level(double wheel_rev)
+{
+    return 0.5 + 0.5 * tanh(3.0 * sin(2.0 * PI * SIM_ENCODER_PERIODS * wheel_rev));
+}
+
+void sim_start(void)
+{
+    mtx_init(&sim_lock, mtx_plain);
+    cnd_init(&sim_tick);
+    tss_create(&sim_leave_key, sim_leave_clock);
+    robot.x = sim_env("X_INIT", 0);
+    robot.y = sim_env("Y_INIT", 0);
+    robot.theta = sim_env("THETA_INIT", 0) * PI / 180.0;
+    robot.encoder_level_l = encoder_level(0);
+    robot.encoder_level_r = encoder_level(0);
+    sim_seed = (unsigned int)sim_env("SIM_SEED", (int)sim_seed);
+    sim_limit_ms = (unsigned int)sim_env("SIM_LIMIT_MS", SIM_LIMIT_MS);
+    sim_ir_ambient = sim_env("SIM_IR_AMBIENT", 0);
+    sim_stall_l_ms = sim_env("SIM_STALL_L_MS", 0);
+    sim_stall_r_ms = sim_env("SIM_STALL_R_MS", 0);
+    if (sim_seed == 0) {
+        sim_seed = 1;
+    }
+    const char* mapfile = getenv("SIM_MAP");
+    if (mapfile == NULL) {
+        mapfile = "map.txt";
+    }
+    sim_has_map = occupancy_load(&sim_map, mapfile) == 0;
+    if (!sim_has_map) {
+        fprintf(stderr, "[SIM] No map at %s, the world is empty\n", mapfile);
+    }
+    atexit(sim_report);
+}
+
+void sim_ensure_started(void)
+{
+    call_once(&sim_once, sim_start);
+}
+
+bool sim_occupied(double x, double y)
+{
+    return sim_has_map && occupancy_is_occupied(&sim_map, (int)round(x / OCCUPANCY_CELL_MM), (int)round(y / OCCUPANCY_CELL_MM));
+}
+
+/**
+ * Counter-clockwise revolutions per second for a pulse width
+ */
+double servo_rps(int pulse_us, double gain)
+{
+    if (pulse_us == 0) {
+        return 0;
+    }
+    double offset = pulse_us - SIM_SERVO_ZERO_US;
+    if (fabs(offset) <= SIM_SERVO_DEADBAND_US) {
+        return 0;
+    }
+    double effective = offset - copysign(SIM_SERVO_DEADBAND_US, offset);
+    double rps = SIM_SERVO_MAX_RPS * tanh(effective / SIM_SERVO_KNEE_US) * gain;
+    return offset > 0 ? rps : rps * SIM_SERVO_REVERSE_GAIN;
+}
+
+bool sim_is_stalled(int stall_ms)
+{
+    return (stall_ms > 0) && (sim_now_us >= SIM_START_US + (uint64_t)stall_ms * 1000);
+}
+
+void sim_step(double dt_s)
+{
+    // Left servo counter-clockwise is forward, the right one is mounted the other way round
+    double rev_l = servo_rps(robot.pulse_us_l, SIM_SERVO_GAIN_L) * dt_s;
+    double rev_r = -servo_rps(robot.pulse_us_r, SIM_SERVO_GAIN_R) * dt_s;
+    if (sim_is_stalled(sim_stall_l_ms)) {
+        rev_l = 0;
+    }
+    if (sim_is_stalled(sim_stall_r_ms)) {
+        rev_r = 0;
+    }
+    robot.wheel_rev_l += rev_l;
+    robot.wheel_rev_r += rev_r;
+    double lag = fmin(1.0, dt_s * 1000.0 / SIM_ENCODER_LAG_MS);
+    robot.encoder_level_l += (encoder_level(robot.wheel_rev_l) - robot.encoder_level_l) * lag;
+    robot.encoder_level_r += (encoder_level(robot.wheel_rev_r) - robot.encoder_level_r) * lag;
+
+    double d_l = rev_l * SIM_WHEEL_DIAMETER_MM * PI;
+    double d_r = rev_r * SIM_WHEEL_DIAMETER_MM * PI;
+    double d = (d_l + d_r) / 2.0;
+    double dtheta = (d_r - d_l) / SIM_WHEEL_BASE_MM;
+    double x = robot.x + d * cos(robot.theta + dtheta / 2.0);
+    double y = robot.y + d * sin(robot.theta + dtheta / 2.0);
+
+    if (sim_occupied(x, y)) {
+        // Bumped, the wheels keep turning but we do not move
+        if (!robot.colliding) {
+            robot.collisions++;
+        }
+        robot.colliding = true;
+    } else {
+        robot.colliding = false;
+        robot.x = x;
+        robot.y = y;
+    }
+    robot.theta += dtheta;
+}
+
+void sim_advance_to(uint64_t t_us)
+{
+    while (sim_now_us < t_us) {
+        uint64_t step = t_us - sim_now_us < SIM_STEP_US ? t_us - sim_now_us : SIM_STEP_US;
+        sim_step((double)step / 1e6);
+        sim_now_us += step;
+    }
+}
+
+/**
+ * Hands the clock to the waiting thread that wakes up first (lowest slot on a tie),
+ * moving the physics up to that time. Blocked threads (UINT64_MAX) are skipped.
+ */
+void sim_schedule(void)
+{
+    if (sim_running >= 0) {
+        return;
+    }
+    int next = -1;
+    for (int i = 0; i < SIM_MAX_THREADS; i++) {
+        if (sim_in_clock[i] && sim_is_waiting[i] && (sim_wake_us[i] != UINT64_MAX)
+            && ((next < 0) || (sim_wake_us[i] < sim_wake_us[next]))) {
+            next = i;
+        }
+    }
+    if (next < 0) {
+        return;
+    }
+    sim_advance_to(sim_wake_us[next]);
+    sim_running = next;
+    __real_cnd_broadcast(&sim_tick);
+}
+
+/**
+ * Gives the clock away and waits until it is our turn again at wake_us
+ */
+void sim_wait_turn(uint64_t wake_us)
+{
+    sim_wake_us[sim_slot] = wake_us;
+    sim_is_waiting[sim_slot] = true;
+    if (sim_running == sim_slot) {
+        sim_running = -1;
+    }
+    sim_schedule();
+    while (sim_running != sim_slot) {
+        __real_cnd_wait(&sim_tick, &sim_lock);
+    }
+    sim_is_waiting[sim_slot] = false;
+}
+
+/**
+ * Called with sim_lock held. A new thread waits for its turn before touching the robot
+ */
+void sim_join_clock(void)
+{
+    if (sim_slot >= 0) {
+        return;
+    }
+    for (int i = 0; i < SIM_MAX_THREADS; i++) {
+        if (!sim_in_clock[i]) {
+            sim_in_clock[i] = true;
+            sim_slot = i;
+            // Any non NULL value, so the destructor runs when the thread ends
+            tss_set(sim_leave_key, &sim_in_clock[i]);
+            sim_wait_turn(sim_now_us);
+            return;
+        }
+    }
+    fprintf(stderr, "[SIM] Too many threads using the robot\n");
+    exit(-1);
+}
+
+void sim_enter(void)
+{
+    sim_ensure_started();
+    mtx_lock(&sim_lock);
+    sim_join_clock();
+}
+
+/**
+ * Thread exit: gives the clock to the next one
+ */
+void sim_leave_clock(void* slot)
+{
+    (void)slot;
+    mtx_lock(&sim_lock);
+    sim_in_clock[sim_slot] = false;
+    sim_is_waiting[sim_slot] = false;
+    sim_waiting_on[sim_slot] = NULL;
+    if (sim_running == sim_slot) {
+        sim_running = -1;
+    }
+    sim_slot = -1;
+    sim_schedule();
+    mtx_unlock(&sim_lock);
+}
+
+bool sim_expired(void)
+{
+    return sim_now_us - SIM_START_US >= sim_limit_ms * 1000ULL;
+}
+
+void sim_sleep_us(uint64_t us)
+{
+    sim_enter();
+    sim_wait_turn(sim_now_us + us);
+    bool expired = sim_expired();
+    mtx_unlock(&sim_lock);
+    if (expired) {
+        fprintf(stderr, "[SIM] Time limit of %u ms reached\n", sim_limit_ms);
+        exit(SIM_EXPIRED_EXIT_CODE);
+    }
+}
+
+typedef struct {
+    thrd_start_t func;
+    void* arg;
+    int slot;
+} SimThreadStart;
+
+int __real_thrd_create(thrd_t* thr, thrd_start_t func, void* arg);
+int __real_thrd_join(thrd_t thr, int* res);
+
+int sim_thread_start(void* arg)
+{
+    SimThreadStart start = *(SimThreadStart*)arg;
+    free(arg);
+    mtx_lock(&sim_lock);
+    sim_slot = start.slot;
+    tss_set(sim_leave_key, &sim_in_clock[sim_slot]);
+    while (sim_running != sim_slot) {
+        __real_cnd_wait(&sim_tick, &sim_lock);
+    }
+    sim_is_waiting[sim_slot] = false;
+    mtx_unlock(&sim_lock);
+    return start.func(start.arg);
+}
+
+/**
+ * Linked with --wrap=thrd_create: the new thread gets its place on the clock right away,
+ * after the ones already waiting at this time, instead of whenever the OS starts it
+ */
+int __wrap_thrd_create(thrd_t* thr, thrd_start_t func, void* arg)
+{
+    if (sim_slot < 0) {
+        // Not started by the firmware (e.g. the tune tool), nothing to do with the robot
+        return __real_thrd_create(thr, func, arg);
+    }
+    SimThreadStart* start = malloc(sizeof(SimThreadStart));
+    if (start == NULL) {
+        return thrd_nomem;
+    }
+    start->func = func;
+    start->arg = arg;
+    start->slot = -1;
+    sim_ensure_started();
+    mtx_lock(&sim_lock);
+    for (int i = 0; (i < SIM_MAX_THREADS) && (start->slot < 0); i++) {
+        if (!sim_in_clock[i]) {
+            sim_in_clock[i] = true;
+            sim_is_waiting[i] = true;
+            sim_wake_us[i] = sim_now_us;
+            start->slot = i;
+        }
+    }
+    mtx_unlock(&sim_lock);
+    if (start->slot < 0) {
+        fprintf(stderr, "[SIM] Too many threads using the robot\n");
+        exit(-1);
+    }
+    return __real_thrd_create(thr, sim_thread_start, start);
+}
+
+/**
+ * Linked with --wrap=thrd_join: the clock goes to the other threads until the joined one ends
+ */
+int __wrap_thrd_join(thrd_t thr, int* res)
+{
+    bool gives_clock = sim_slot >= 0;
+    if (gives_clock) {
+        mtx_lock(&sim_lock);
+        sim_wake_us[sim_slot] = UINT64_MAX;
+        sim_is_waiting[sim_slot] = true;
+        sim_running = -1;
+        sim_schedule();
+        mtx_unlock(&sim_lock);
+    }
+
+    int result = __real_thrd_join(thr, res);
+
+    if (gives_clock) {
+        mtx_lock(&sim_lock);
+        sim_wait_turn(sim_now_us);
+        mtx_unlock(&sim_lock);
+    }
+    return result;
+}
+
+/**
+ * Linked with --wrap=cnd_wait: the clock goes to the other threads while blocked, like thrd_join.
+ * We run again at the virtual time we were signalled, so the order stays fixed
+ */
+int __wrap_cnd_wait(cnd_t* cond, mtx_t* mtx)
+{
+    if (sim_slot < 0) {
+        return __real_cnd_wait(cond, mtx);
+    }
+    mtx_lock(&sim_lock);
+    sim_wake_us[sim_slot] = UINT64_MAX;
+    sim_is_waiting[sim_slot] = true;
+    sim_waiting_on[sim_slot] = cond;
+    if (sim_running == sim_slot) {
+        sim_running = -1;
+    }
+    sim_schedule();
+    mtx_unlock(&sim_lock);
+
+    int result = __real_cnd_wait(cond, mtx);
+
+    // The thread that has the clock may want mtx, we only take it back once it is our turn
+    mtx_unlock(mtx);
+    mtx_lock(&sim_lock);
+    sim_waiting_on[sim_slot] = NULL;
+    sim_wait_turn(sim_wake_us[sim_slot] == UINT64_MAX ? sim_now_us : sim_wake_us[sim_slot]);
+    mtx_unlock(&sim_lock);
+    mtx_lock(mtx);
+    return result;
+}
+
+/**
+ * Linked with --wrap=cnd_broadcast: the threads blocked on cond can run from now
+ */
+int __wrap_cnd_broadcast(cnd_t* cond)
+{
+    sim_ensure_started();
+    mtx_lock(&sim_lock);
+    for (int i = 0; i < SIM_MAX_THREADS; i++) {
+        if (sim_in_clock[i] && (sim_waiting_on[i] == cond)) {
+            sim_wake_us[i] = sim_now_us;
+            sim_waiting_on[i] = NULL;
+        }
+    }
+    mtx_unlock(&sim_lock);
+    return __real_cnd_broadcast(cond);
+}
+
+/**
+ * Linked with --wrap=cnd_signal: wakes them all, the clock decides who goes first (waiters check anyway)
+ */
+int __wrap_cnd_signal(cnd_t* cond)
+{
+    return __wrap_cnd_broadcast(cond);
+}
+
+void sim_robot(SimRobot* result)
+{
+    sim_enter();
+    *result = robot;
+    mtx_unlock(&sim_lock);
+}
+
+int encoder_reading(double level, int min, int max)
+{
+    double ambient = SIM_AMBIENT_DRIFT * sin(2.0 * PI * (double)sim_now_us / (SIM_AMBIENT_PERIOD_S * 1e6));
+    return (int)round(min + (max - min) * level + ambient + sim_gaussian(SIM_ENCODER_NOISE));
+}
+
+int ir_reading(MotionSensor pin)
+{
+    double side = (pin == MOTION_SENSOR_L) ? IR_SENSOR_SIDE_MM : -IR_SENSOR_SIDE_MM;
+    double c = cos(robot.theta);
+    double s = sin(robot.theta);
+    double ox = robot.x + IR_SENSOR_FORWARD_MM * c - side * s;
+    double oy = robot.y + IR_SENSOR_FORWARD_MM * s + side * c;
+    double ambient = sim_ir_ambient * (1.0 + sim_gaussian(SIM_IR_AMBIENT_NOISE));
+    for (double d = 0; d < SIM_IR_RANGE_MM; d += SIM_IR_RAY_STEP_MM) {
+        if (sim_occupied(ox + d * c, oy + d * s)) {
+            return (int)round(distance_to_reading(pin, d) + ambient + sim_gaussian(SIM_IR_NOISE));
+        }
+    }
+    // Nothing in front, noise below the ignore level in the dark
+    return (int)(100 + 90 * sim_uniform() + ambient);
+}
+
+int analogRead(int pin)
+{
+    sim_enter();
+    int value = 0;
+    switch (pin - SIM_ADC_BASE) {
+    case 0:
+        value = ir_reading(MOTION_SENSOR_L);
+        break;
+    case 1:
+        value = ir_reading(MOTION_SENSOR_R);
+        break;
+    case 2:
+        value = encoder_reading(robot.encoder_level_l, SIM_ENCODER_L_MIN, SIM_ENCODER_L_MAX);
+        break;
+    case 3:
+        value = encoder_reading(robot.encoder_level_r, SIM_ENCODER_R_MIN, SIM_ENCODER_R_MAX);
+        break;
+    default:
+        break;
+    }
+    mtx_unlock(&sim_lock);
+    // 10 bit ADC
+    if (value < 0) {
+        return 0;
+    }
+    return value > 1023 ? 1023 : value;
+}
+
+void pwmWrite(int pin, int value)
+{
+    sim_enter();
+    int pulse_us = (int)round(value * pwm_divisor * 1e6 / SIM_PWM_BASE_HZ);
+    if (pin == MOTOR_L) {
+        robot.pulse_us_l = pulse_us;
+    } else if (pin == MOTOR_R) {
+        robot.pulse_us_r = pulse_us;
+    }
+    mtx_unlock(&sim_lock);
+}
+
+void pwmSetClock(int divisor)
+{
+    pwm_divisor = divisor;
+}
+
+unsigned int millis(void)
+{
+    sim_enter();
+    uint64_t now = sim_now_us;
+    mtx_unlock(&sim_lock);
+    return (unsigned int)(now / 1000);
+}
+
+unsigned int micros(void)
+{
+    sim_enter();
+    uint64_t now = sim_now_us;
+    mtx_unlock(&sim_lock);
+    return (unsigned int)now;
+}
+
+void delay(unsigned int howLong)
+{
+    sim_sleep_us((uint64_t)howLong * 1000);
+}
+
+void delayMicroseconds(unsigned int howLong)
+{
+    sim_sleep_us(howLong);
+}
+
+int wiringPiSetup(void)
+{
+    // The main thread owns the clock from the start, time does not run while it is busy
+    sim_enter();
+    mtx_unlock(&sim_lock);
+    return 0;
+}
+
+int wiringPiSPISetup(int channel, int speed)
+{
+    (void)channel;
+    (void)speed;
+    return 0;
+}
+
+int mcp3004Setup(int pinBase, int spiChannel)
+{
+    (void)spiChannel;
+    return pinBase == SIM_ADC_BASE ? TRUE : FALSE;
+}
+
+int wpiPinToGpio(int wpiPin)
+{
+    return wpiPin;
+}
+
+void pinMode(int pin, int mode)
+{
+    (void)pin;
+    (void)mode;
+}
+
+void pwmSetMode(int mode)
+{
+    (void)mode;
+}
+
+void pwmSetRange(unsigned int range)
+{
+    (void)range;
+}
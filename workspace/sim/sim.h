@@ -0,0 +1,74 @@
+#ifndef SIM_H
+#define SIM_H
+/**
+ * Differential drive robot simulated behind the wiringPi API.
+ *
+ * Servos turn pulse widths into wheel speed (with deadband and asymmetry),
+ * the encoder discs are simulated as the analog waveform the MCP3004 would read,
+ * and the IR sensors ray-cast against the map.
+ */
+
+#include <stdbool.h>
+
+// Where the clock starts, wiringPi millis() is never 0 either
+#define SIM_START_US 1000000ULL
+#define SIM_STEP_US 1000ULL
+// Firmware that never finishes (e.g. odometry going round in circles) is stopped after this virtual time
+#define SIM_LIMIT_MS 600000
+#define SIM_EXPIRED_EXIT_CODE 124
+#define SIM_MAX_THREADS 8
+
+#define SIM_PWM_BASE_HZ 19200000.0
+
+// Continuous servo: 1500us stopped, saturating response
+#define SIM_SERVO_ZERO_US 1500
+#define SIM_SERVO_DEADBAND_US 10.0
+#define SIM_SERVO_KNEE_US 75.0
+#define SIM_SERVO_MAX_RPS 1.0
+// Servos are never the same, and they are slower backwards
+#define SIM_SERVO_GAIN_L 1.0
+#define SIM_SERVO_GAIN_R 0.97
+#define SIM_SERVO_REVERSE_GAIN 0.95
+
+// The firmware counts every edge, 20 per lap (countsPerLap), so 10 light/dark periods per lap
+#define SIM_SLOTS 20
+#define SIM_ENCODER_PERIODS (SIM_SLOTS / 2)
+#define SIM_WHEEL_DIAMETER_MM 66.0
+#define SIM_WHEEL_BASE_MM 115.0
+// Encoder ADC swing, from the measurements in sensors.c
+#define SIM_ENCODER_L_MIN 161
+#define SIM_ENCODER_L_MAX 695
+#define SIM_ENCODER_R_MIN 50
+#define SIM_ENCODER_R_MAX 550
+#define SIM_ENCODER_NOISE 10.0
+// The phototransistor is slow, the swing shrinks as the slots go faster
+#define SIM_ENCODER_LAG_MS 20.0
+// Ambient light moves the whole waveform up and down, slowly
+#define SIM_AMBIENT_DRIFT 80.0
+#define SIM_AMBIENT_PERIOD_S 30.0
+
+#define SIM_IR_NOISE 10.0
+// Relative spread of SIM_IR_AMBIENT from sample to sample
+#define SIM_IR_AMBIENT_NOISE 0.25
+#define SIM_IR_RAY_STEP_MM 10.0
+#define SIM_IR_RANGE_MM 600.0
+
+#define SIM_ADC_BASE 100
+
+typedef struct {
+    double x; // mm
+    double y; // mm
+    double theta; // radians
+    double wheel_rev_l; // forward positive
+    double wheel_rev_r;
+    double encoder_level_l; // 0 dark .. 1 light, after the sensor lag
+    double encoder_level_r;
+    int pulse_us_l;
+    int pulse_us_r;
+    int collisions;
+    bool colliding;
+} SimRobot;
+
+extern void sim_robot(SimRobot* result);
+
+#endif
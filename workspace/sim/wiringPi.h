@@ -0,0 +1,36 @@
+#ifndef SIM_WIRING_PI_H
+#define SIM_WIRING_PI_H
+/**
+ * Simulated wiringPi, only what the firmware uses.
+ * Time is virtual: delay() advances the simulation instead of sleeping, see sim.c
+ */
+
+#define INPUT 0
+#define OUTPUT 1
+#define PWM_OUTPUT 2
+#define PWM_MODE_MS 0
+#define PWM_MODE_BAL 1
+
+#ifndef TRUE
+#define TRUE (1 == 1)
+#define FALSE (!TRUE)
+#endif
+
+extern int wiringPiSetup(void);
+extern void pinMode(int pin, int mode);
+extern int wpiPinToGpio(int wpiPin);
+
+extern void pwmWrite(int pin, int value);
+extern void pwmSetMode(int mode);
+extern void pwmSetRange(unsigned int range);
+extern void pwmSetClock(int divisor);
+
+extern int analogRead(int pin);
+extern int mcp3004Setup(int pinBase, int spiChannel);
+
+extern unsigned int millis(void);
+extern unsigned int micros(void);
+extern void delay(unsigned int howLong);
+extern void delayMicroseconds(unsigned int howLong);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIM_WIRING_PI_SPI_H
+#define SIM_WIRING_PI_SPI_H
+
+extern int wiringPiSPISetup(int channel, int speed);
+
+#endif
@@ -0,0 +1,73 @@
+#include "avoidance.h"
+#include <math.h>
+
+double clamp_unit(double value)
+{
+    if (value > 1.0) {
+        return 1.0;
+    }
+    if (value < -1.0) {
+        return -1.0;
+    }
+    return value;
+}
+
+void avoidance_reset(AvoidanceState* s)
+{
+    s->side = AVOID_NONE;
+    s->last_side = AVOID_NONE;
+    s->clear_ticks = 0;
+}
+
+AvoidSide pick_side(AvoidanceState* s, double nearness_l, double nearness_r, double goal_error_deg)
+{
+    double diff = nearness_r - nearness_l;
+    if (fabs(diff) > AVOID_SIDE_MARGIN) {
+        // Obstacle more to the right, we go around it through the left
+        return diff > 0 ? AVOID_LEFT : AVOID_RIGHT;
+    }
+    // Head on, keep going around the way we did before, otherwise the side of the goal
+    if (s->last_side != AVOID_NONE) {
+        return s->last_side;
+    }
+    return goal_error_deg >= 0 ? AVOID_LEFT : AVOID_RIGHT;
+}
+
+WheelCommand avoidance_step(AvoidanceState* s, double nearness_l, double nearness_r, double goal_error_deg, int speed)
+{
+    double near = fmax(nearness_l, nearness_r);
+
+    if (near > AVOID_ENGAGE) {
+        s->clear_ticks = 0;
+        if (s->side == AVOID_NONE) {
+            s->side = pick_side(s, nearness_l, nearness_r, goal_error_deg);
+            s->last_side = s->side;
+        }
+    } else if (s->side != AVOID_NONE) {
+        s->clear_ticks++;
+        if (s->clear_ticks > AVOID_CLEAR_TICKS) {
+            s->side = AVOID_NONE;
+        }
+    }
+
+    // turn > 0 is counter-clockwise (left)
+    double goal_turn = clamp_unit(goal_error_deg / AVOID_GOAL_FULL_TURN);
+    double forward;
+    double turn;
+    if (s->side == AVOID_NONE) {
+        forward = 1.0 - 0.5 * fabs(goal_turn);
+        turn = goal_turn;
+    } else {
+        // While committed do not let the goal pull us back into the obstacle
+        if (goal_turn * s->side < 0) {
+            goal_turn *= 0.2;
+        }
+        forward = 1.0 - near;
+        turn = clamp_unit(s->side * near + (1.0 - near) * goal_turn);
+    }
+
+    WheelCommand command;
+    command.speed_l = (int)round(speed * clamp_unit(forward - turn));
+    command.speed_r = (int)round(speed * clamp_unit(forward + turn));
+    return command;
+}
@@ -0,0 +1,47 @@
+#ifndef AVOIDANCE_H
+#define AVOIDANCE_H
+
+/**
+ * Reactive obstacle avoidance.
+ *
+ * Each control tick we get how near the obstacle is on each IR channel and
+ * the heading error towards the goal, and we return the speed of each wheel.
+ * Like Bug2 we commit to one side of the obstacle until it has been cleared,
+ * so the robot does not zig-zag in front of it.
+ */
+
+// Nearness (0-1) above which we start steering away
+#define AVOID_ENGAGE 0.25
+// Difference in nearness between channels needed to trust the readings to pick a side
+#define AVOID_SIDE_MARGIN 0.1
+// Control ticks without obstacle before we head straight to the goal again
+#define AVOID_CLEAR_TICKS 10
+// Heading error (degrees) at which we turn with full differential
+#define AVOID_GOAL_FULL_TURN 60.0
+
+typedef enum {
+    AVOID_NONE = 0,
+    AVOID_LEFT = 1,
+    AVOID_RIGHT = -1,
+} AvoidSide;
+
+typedef struct {
+    AvoidSide side;
+    AvoidSide last_side;
+    int clear_ticks;
+} AvoidanceState;
+
+typedef struct {
+    int speed_l;
+    int speed_r;
+} WheelCommand;
+
+extern void avoidance_reset(AvoidanceState* s);
+
+/**
+ * nearness_l, nearness_r: see proximity_nearness
+ * goal_error_deg: angle to the goal minus current theta, counter-clockwise positive
+ */
+extern WheelCommand avoidance_step(AvoidanceState* s, double nearness_l, double nearness_r, double goal_error_deg, int speed);
+
+#endif
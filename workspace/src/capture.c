@@ -0,0 +1,453 @@
+// pwrite is POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include <wiringPi.h>
+
+typedef struct {
+    uint32_t time_us;
+    uint16_t adc[CAPTURE_CHANNELS];
+} RingSample;
+
+// Single producer (sensor thread), single consumer (writer thread)
+RingSample capture_ring[CAPTURE_RING];
+atomic_uint ring_head = 0; // next to write, sensor thread
+atomic_uint ring_tail = 0; // next to read, writer thread
+atomic_uint capture_dropped = 0;
+atomic_bool capture_on = false;
+atomic_bool capture_stop = false;
+thrd_t capture_thread;
+
+// Writer thread only from here
+int capture_fd = -1;
+int capture_flush_ms = CAPTURE_FLUSH_MS;
+uint8_t write_buffer[CAPTURE_WRITE_BLOCKS * CAPTURE_BLOCK_SIZE];
+int buffer_blocks = 0; // complete blocks in write_buffer, the one being filled comes after them
+off_t buffer_offset = CAPTURE_BLOCK_SIZE; // of write_buffer in the file
+CaptureIndexEntry* capture_index = NULL;
+uint32_t index_size = 0;
+uint32_t total_blocks = 0;
+uint64_t total_samples = 0;
+// 64 bit time and the step of the last sample, across blocks
+uint64_t time_high = 0;
+uint32_t last_time_us = 0;
+int64_t last_step_us = 0;
+CaptureSample block_last;
+bool write_failed = false; // warned once, the count of dropped samples says the rest
+
+int varint_put(uint8_t* out, uint64_t value)
+{
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+int varint_get(const uint8_t* in, int size, uint64_t* value)
+{
+    uint64_t result = 0;
+    for (int n = 0; (n < size) && (n < 10); n++) {
+        result |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+        if ((in[n] & 0x80) == 0) {
+            *value = result;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+CaptureBlockHeader* current_block(void)
+{
+    return (CaptureBlockHeader*)(write_buffer + buffer_blocks * CAPTURE_BLOCK_SIZE);
+}
+
+/**
+ * After a failed write the blocks in write_buffer are lost: their samples count as dropped and
+ * they come out of the index, so the next blocks go to the same offset and the file stays readable
+ */
+void drop_blocks(int blocks)
+{
+    for (int b = 0; b < blocks; b++) {
+        const CaptureBlockHeader* block = (const CaptureBlockHeader*)(write_buffer + b * CAPTURE_BLOCK_SIZE);
+        atomic_fetch_add_explicit(&capture_dropped, block->count, memory_order_relaxed);
+    }
+    total_blocks -= (uint32_t)blocks;
+    memset(write_buffer, 0, CAPTURE_BLOCK_SIZE);
+    buffer_blocks = 0;
+}
+
+/**
+ * Writes the complete blocks and the one being filled, keeps the last one in the buffer when partial.
+ * Always leaves room for the next block, on failure what was in the buffer is dropped
+ */
+int flush_blocks(bool keep_partial)
+{
+    CaptureBlockHeader* block = buffer_blocks < CAPTURE_WRITE_BLOCKS ? current_block() : NULL;
+    int blocks = buffer_blocks + ((block != NULL) && (block->count > 0) ? 1 : 0);
+    if (blocks == 0) {
+        return 0;
+    }
+    size_t size = (size_t)blocks * CAPTURE_BLOCK_SIZE;
+    ssize_t written = pwrite(capture_fd, write_buffer, size, buffer_offset);
+    if (written != (ssize_t)size) {
+        if (!write_failed) {
+            fprintf(stderr, "[WARN] Capture write failed, dropping the samples that do not fit: %s\n", written < 0 ? strerror(errno) : "disk full");
+        }
+        write_failed = true;
+        drop_blocks(blocks);
+        return -1;
+    }
+    buffer_offset += (off_t)buffer_blocks * CAPTURE_BLOCK_SIZE;
+    if (keep_partial && (block != NULL) && (block->count > 0)) {
+        // Written again, at the same offset, once it has more samples
+        memmove(write_buffer, block, CAPTURE_BLOCK_SIZE);
+    } else {
+        memset(write_buffer, 0, CAPTURE_BLOCK_SIZE);
+    }
+    buffer_blocks = 0;
+    return 0;
+}
+
+int add_index(const CaptureBlockHeader* block)
+{
+    if (total_blocks >= index_size) {
+        uint32_t size = index_size == 0 ? 256 : 2 * index_size;
+        CaptureIndexEntry* index = realloc(capture_index, size * sizeof(CaptureIndexEntry));
+        if (index == NULL) {
+            return -1;
+        }
+        capture_index = index;
+        index_size = size;
+    }
+    capture_index[total_blocks].first_sample = block->first_sample;
+    capture_index[total_blocks].first_time_us = block->first_time_us;
+    total_blocks++;
+    return 0;
+}
+
+void encode_sample(const CaptureSample* s)
+{
+    CaptureBlockHeader* block = current_block();
+    if (block->count > 0 && block->bytes + CAPTURE_MAX_SAMPLE_BYTES > CAPTURE_PAYLOAD) {
+        buffer_blocks++;
+        if (buffer_blocks == CAPTURE_WRITE_BLOCKS) {
+            // Empty afterwards either way, what could not be written is counted as dropped
+            flush_blocks(false);
+        }
+        block = current_block();
+        memset(block, 0, CAPTURE_BLOCK_SIZE);
+    }
+    if (block->count == 0) {
+        block->magic = CAPTURE_BLOCK_MAGIC;
+        block->first_sample = total_samples;
+        block->first_time_us = s->time_us;
+        memcpy(block->first, s->adc, sizeof(block->first));
+        add_index(block);
+    } else {
+        uint8_t* out = (uint8_t*)(block + 1) + block->bytes;
+        int64_t step_us = (int64_t)(s->time_us - block_last.time_us);
+        int n = varint_put(out, zigzag(step_us - last_step_us));
+        for (int c = 0; c < CAPTURE_CHANNELS; c++) {
+            n += varint_put(out + n, zigzag((int64_t)s->adc[c] - block_last.adc[c]));
+        }
+        block->bytes += (uint16_t)n;
+        last_step_us = step_us;
+    }
+    if (block->count == 0) {
+        last_step_us = 0;
+    }
+    block->count++;
+    block_last = *s;
+    total_samples++;
+}
+
+int capture_writer(void* arg)
+{
+    int flush_ms = *(int*)arg;
+    unsigned int last_flush_ms = millis();
+    bool stopping = false;
+    while (!stopping) {
+        stopping = atomic_load(&capture_stop);
+        unsigned int head = atomic_load_explicit(&ring_head, memory_order_acquire);
+        unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        while (tail != head) {
+            const RingSample* r = &capture_ring[tail % CAPTURE_RING];
+            if (r->time_us < last_time_us) {
+                time_high += 1ull << 32;
+            }
+            last_time_us = r->time_us;
+            CaptureSample s = { .time_us = time_high | r->time_us };
+            memcpy(s.adc, r->adc, sizeof(s.adc));
+            tail++;
+            atomic_store_explicit(&ring_tail, tail, memory_order_release);
+            encode_sample(&s);
+        }
+        if (millis() - last_flush_ms >= (unsigned int)flush_ms) {
+            flush_blocks(true);
+            last_flush_ms = millis();
+        }
+        if (!stopping) {
+            delay(CAPTURE_POLL_MS);
+        }
+    }
+    return 0;
+}
+
+int start_capture(const char* path, int flush_ms)
+{
+    if (path == NULL) {
+        return 0;
+    }
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture_fd < 0) {
+        fprintf(stderr, "[WARN] Could not open the capture %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    capture_flush_ms = flush_ms;
+    memset(write_buffer, 0, sizeof(write_buffer));
+    CaptureFileHeader* header = (CaptureFileHeader*)write_buffer;
+    header->magic = CAPTURE_MAGIC;
+    header->version = CAPTURE_VERSION;
+    header->channels = CAPTURE_CHANNELS;
+    header->block_size = CAPTURE_BLOCK_SIZE;
+    header->start_time = (int64_t)time(NULL);
+    if (pwrite(capture_fd, write_buffer, CAPTURE_BLOCK_SIZE, 0) != CAPTURE_BLOCK_SIZE) {
+        fprintf(stderr, "[WARN] Could not write the capture header: %s\n", strerror(errno));
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    memset(write_buffer, 0, CAPTURE_BLOCK_SIZE);
+    if (thrd_create(&capture_thread, capture_writer, &capture_flush_ms) != thrd_success) {
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    atomic_store(&capture_on, true);
+    fprintf(stderr, "Capturing the ADC channels into %s\n", path);
+    return 0;
+}
+
+void capture_sample(unsigned int time_us, int adc0, int adc1, int adc2, int adc3)
+{
+    if (!atomic_load_explicit(&capture_on, memory_order_relaxed)) {
+        return;
+    }
+    unsigned int head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring_tail, memory_order_acquire) >= CAPTURE_RING) {
+        atomic_fetch_add_explicit(&capture_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    RingSample* r = &capture_ring[head % CAPTURE_RING];
+    r->time_us = time_us;
+    r->adc[0] = (uint16_t)adc0;
+    r->adc[1] = (uint16_t)adc1;
+    r->adc[2] = (uint16_t)adc2;
+    r->adc[3] = (uint16_t)adc3;
+    atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+}
+
+void stop_capture(void)
+{
+    if (!atomic_exchange(&capture_on, false)) {
+        return;
+    }
+    atomic_store(&capture_stop, true);
+    thrd_join(capture_thread, NULL);
+    flush_blocks(false);
+    CaptureFooter footer = {
+        .magic = CAPTURE_INDEX_MAGIC,
+        .blocks = total_blocks,
+        .index_offset = (uint64_t)CAPTURE_BLOCK_SIZE * (1 + total_blocks),
+    };
+    size_t index_bytes = total_blocks * sizeof(CaptureIndexEntry);
+    if ((capture_index != NULL && pwrite(capture_fd, capture_index, index_bytes, (off_t)footer.index_offset) != (ssize_t)index_bytes)
+        || pwrite(capture_fd, &footer, sizeof(footer), (off_t)(footer.index_offset + index_bytes)) != (ssize_t)sizeof(footer)) {
+        fprintf(stderr, "[WARN] Could not write the capture index, the reader will scan the blocks\n");
+    }
+    close(capture_fd);
+    capture_fd = -1;
+    free(capture_index);
+    capture_index = NULL;
+    fprintf(stderr, "[DEBUG] Captured %llu samples in %u blocks, %u dropped\n", (unsigned long long)total_samples, total_blocks, atomic_load(&capture_dropped));
+}
+
+int read_block(CaptureReader* r, uint32_t block_i)
+{
+    r->block_i = r->blocks;
+    if (block_i >= r->blocks) {
+        return 0;
+    }
+    if ((fseeko(r->f, (off_t)CAPTURE_BLOCK_SIZE * (1 + block_i), SEEK_SET) != 0) || (fread(r->block, CAPTURE_BLOCK_SIZE, 1, r->f) != 1)) {
+        return -1;
+    }
+    const CaptureBlockHeader* block = (const CaptureBlockHeader*)r->block;
+    if ((block->magic != CAPTURE_BLOCK_MAGIC) || (block->bytes > CAPTURE_PAYLOAD)) {
+        return -2;
+    }
+    r->block_i = block_i;
+    r->sample_i = 0;
+    r->pos = 0;
+    return 1;
+}
+
+int capture_open(const char* path, CaptureReader* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        return -1;
+    }
+    if ((fread(&r->header, sizeof(r->header), 1, r->f) != 1) || (r->header.magic != CAPTURE_MAGIC)
+        || (r->header.version != CAPTURE_VERSION) || (r->header.block_size != CAPTURE_BLOCK_SIZE)) {
+        capture_close(r);
+        return -2;
+    }
+    fseeko(r->f, 0, SEEK_END);
+    off_t size = ftello(r->f);
+    CaptureFooter footer;
+    if ((size >= (off_t)sizeof(footer)) && (fseeko(r->f, size - (off_t)sizeof(footer), SEEK_SET) == 0)
+        && (fread(&footer, sizeof(footer), 1, r->f) == 1) && (footer.magic == CAPTURE_INDEX_MAGIC)) {
+        r->blocks = footer.blocks;
+        r->index = malloc(footer.blocks * sizeof(CaptureIndexEntry) + 1);
+        if ((r->index != NULL) && ((fseeko(r->f, (off_t)footer.index_offset, SEEK_SET) != 0) || (fread(r->index, sizeof(CaptureIndexEntry), footer.blocks, r->f) != footer.blocks))) {
+            free(r->index);
+            r->index = NULL;
+        }
+    }
+    if (r->index == NULL) {
+        // Cut short, every whole block after the header until the first that is not one
+        r->blocks = (uint32_t)(size / CAPTURE_BLOCK_SIZE) - 1;
+        for (uint32_t b = 0; b < r->blocks; b++) {
+            if (read_block(r, b) <= 0) {
+                r->blocks = b;
+                break;
+            }
+        }
+    }
+    return read_block(r, 0) < 0 ? -3 : 0;
+}
+
+uint64_t block_time(CaptureReader* r, uint32_t b)
+{
+    if (r->index != NULL) {
+        return r->index[b].first_time_us;
+    }
+    CaptureBlockHeader block;
+    fseeko(r->f, (off_t)CAPTURE_BLOCK_SIZE * (1 + b), SEEK_SET);
+    if (fread(&block, sizeof(block), 1, r->f) != 1) {
+        return UINT64_MAX;
+    }
+    return block.first_time_us;
+}
+
+int capture_seek(CaptureReader* r, uint64_t time_us)
+{
+    // Last block starting at or before time_us
+    uint32_t low = 0;
+    uint32_t high = r->blocks;
+    while (high - low > 1) {
+        uint32_t middle = low + (high - low) / 2;
+        if (block_time(r, middle) <= time_us) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    int error = read_block(r, low);
+    if (error < 0) {
+        return error;
+    }
+    r->has_pending = false;
+    CaptureSample s;
+    for (;;) {
+        int more = capture_next(r, &s);
+        if (more <= 0) {
+            return more;
+        }
+        if (s.time_us >= time_us) {
+            // Handed out again by the next capture_next
+            r->pending = s;
+            r->has_pending = true;
+            return 0;
+        }
+    }
+}
+
+int capture_next(CaptureReader* r, CaptureSample* sample)
+{
+    if (r->has_pending) {
+        r->has_pending = false;
+        *sample = r->pending;
+        return 1;
+    }
+    const CaptureBlockHeader* block = (const CaptureBlockHeader*)r->block;
+    while ((r->block_i >= r->blocks) || (r->sample_i >= block->count)) {
+        if (r->block_i + 1 >= r->blocks) {
+            r->block_i = r->blocks;
+            return 0;
+        }
+        int error = read_block(r, r->block_i + 1);
+        if (error <= 0) {
+            return error;
+        }
+    }
+    if (r->sample_i == 0) {
+        r->last.time_us = block->first_time_us;
+        memcpy(r->last.adc, block->first, sizeof(r->last.adc));
+        r->last_step_us = 0;
+    } else {
+        const uint8_t* payload = (const uint8_t*)(block + 1);
+        uint64_t value;
+        int n = varint_get(payload + r->pos, block->bytes - r->pos, &value);
+        if (n < 0) {
+            return -4;
+        }
+        r->pos += n;
+        r->last_step_us += unzigzag(value);
+        r->last.time_us += (uint64_t)r->last_step_us;
+        for (int c = 0; c < CAPTURE_CHANNELS; c++) {
+            n = varint_get(payload + r->pos, block->bytes - r->pos, &value);
+            if (n < 0) {
+                return -4;
+            }
+            r->pos += n;
+            r->last.adc[c] = (uint16_t)(r->last.adc[c] + unzigzag(value));
+        }
+    }
+    r->sample_i++;
+    *sample = r->last;
+    return 1;
+}
+
+void capture_close(CaptureReader* r)
+{
+    if (r->f != NULL) {
+        fclose(r->f);
+    }
+    free(r->index);
+    r->f = NULL;
+    r->index = NULL;
+}
@@ -0,0 +1,125 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/**
+ * Black box recording of the raw ADC channels, compressed, for whole shifts on the SD card.
+ *
+ * The sensor thread only copies each sample into a ring, a writer thread encodes them and
+ * writes whole CAPTURE_BLOCK_SIZE blocks at block aligned offsets, several at a time.
+ * In a block the first sample is stored as it is and the rest as varints: the change of the
+ * time step and the change of each channel, zigzag encoded, about 5 bytes a sample against
+ * 20 of the DEBUG_SENSORS text. Every block header has its first sample number and time, and
+ * an index of them goes at the end of the file on stop. The reader seeks with it, or scans the
+ * block headers when the recording was cut short. Little endian, planning/capture.py reads it too.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC 0x50414352 // "RCAP"
+#define CAPTURE_BLOCK_MAGIC 0x4b4c4243 // "CBLK"
+#define CAPTURE_INDEX_MAGIC 0x58444952 // "RIDX"
+#define CAPTURE_VERSION 1
+#define CAPTURE_CHANNELS 4
+#define CAPTURE_BLOCK_SIZE 4096
+// Blocks encoded before they are written in one go
+#define CAPTURE_WRITE_BLOCKS 16
+// Samples the sensor thread can be ahead of the writer, 40 s at 10 ms
+#define CAPTURE_RING 4096
+// How often the writer thread looks at the ring
+#define CAPTURE_POLL_MS 50
+// The current block is written this often even when not full, the most a crash can lose
+#define CAPTURE_FLUSH_MS 5000
+// Longest encoding of a sample, a 64 bit varint and 3 bytes per channel
+#define CAPTURE_MAX_SAMPLE_BYTES (10 + 3 * CAPTURE_CHANNELS)
+
+typedef struct {
+    uint64_t time_us; // micros() of the sample, made 64 bit
+    uint16_t adc[CAPTURE_CHANNELS];
+} CaptureSample;
+
+/**
+ * First block of the file, the rest of it is zeros
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    uint32_t block_size;
+    uint32_t reserved;
+    int64_t start_time; // time(), when the recording started
+} CaptureFileHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count; // samples in the block
+    uint16_t bytes; // of the payload in use
+    uint64_t first_sample; // since the start of the recording
+    uint64_t first_time_us;
+    uint16_t first[CAPTURE_CHANNELS];
+} CaptureBlockHeader;
+
+#define CAPTURE_PAYLOAD (CAPTURE_BLOCK_SIZE - (int)sizeof(CaptureBlockHeader))
+
+typedef struct {
+    uint64_t first_sample;
+    uint64_t first_time_us;
+} CaptureIndexEntry;
+
+/**
+ * Last bytes of a file that was stopped cleanly, the index is right before it
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t blocks;
+    uint64_t index_offset;
+} CaptureFooter;
+
+/**
+ * Writer, path NULL leaves it off
+ */
+extern int start_capture(const char* path, int flush_ms);
+/**
+ * Sensor thread, every sample. Never blocks, a full ring drops the sample
+ */
+extern void capture_sample(unsigned int time_us, int adc0, int adc1, int adc2, int adc3);
+/**
+ * Writes what is left and the index
+ */
+extern void stop_capture(void);
+
+/**
+ * Block encoding, used by the writer and the reader
+ */
+extern int varint_put(uint8_t* out, uint64_t value);
+extern int varint_get(const uint8_t* in, int size, uint64_t* value);
+
+typedef struct {
+    FILE* f;
+    CaptureFileHeader header;
+    uint32_t blocks;
+    CaptureIndexEntry* index; // NULL when the file has none, the block headers are read instead
+    uint8_t block[CAPTURE_BLOCK_SIZE];
+    uint32_t block_i; // loaded in block, blocks when none
+    int sample_i; // next sample of the block
+    int pos; // next byte of the payload
+    CaptureSample last;
+    int64_t last_step_us;
+    CaptureSample pending; // found by capture_seek
+    bool has_pending;
+} CaptureReader;
+
+extern int capture_open(const char* path, CaptureReader* r);
+/**
+ * Next capture_next is the first sample at or after time_us (or the end)
+ */
+extern int capture_seek(CaptureReader* r, uint64_t time_us);
+/**
+ * 1 with a sample, 0 at the end, negative on a broken block
+ */
+extern int capture_next(CaptureReader* r, CaptureSample* sample);
+extern void capture_close(CaptureReader* r);
+
+#endif
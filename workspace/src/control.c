@@ -1,14 +1,21 @@
 #include "control.h"
+#include "avoidance.h"
 #include "helper.h"
+#include "localisation.h"
+#include "metrics.h"
 #include "motor.h"
+#include "occupancy.h"
+#include "program.h"
+#include "reaction.h"
+#include "scheduler.h"
 #include "sensors.h"
+#include "stall.h"
+#include "trace.h"
 #include <math.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <wiringPi.h>
 
-#define CONTROL_MS_CLOCK 40
-
 /**
  * CHAT GPT
  * ./main 2>&1 >/dev/null | grep -Eo 'Point [0-9]+\.idx: \(x, y, theta\) [0-9\.]+, [0-9\.]+, [0-9\.]+' | awk -F'[ ,( )]' '{print $9, $10, $11}'
@@ -16,16 +23,21 @@
  * ./main 2>&1 >/dev/null | grep -Eo 'Point .+' | awk -F'[ ,( )]' '{print $9, $10, $11}'
 
 */
-typedef bool (*is_interrupt)(void);
-
-typedef int (*action)(double, int, is_interrupt, Point);
-
+/**
+ * An action of a sequence, a task of the scheduler. Moves and turns command the wheels and
+ * check every tick whether they got there, the obstacle wait stops them and watches the IR sensors
+ */
 typedef struct actionStruct {
-    action f;
-    double param;
+    Task task; // first, the task functions get the action back from it
+    int (*move_robot)(int);
+    bool (*has_reached)(Point, Point, double);
+    double param; // mm, degrees, obstacle distance
     int speed;
-    is_interrupt is_interrupt;
-    struct actionStruct* interrupt;
+    Point* pose; // where the sequence is, the action goes from there
+    unsigned int first_ms; // obstacle wait
+    unsigned int last_obstacle_ms;
+    unsigned int start_us;
+    TraceSpan span;
 } actionNode;
 
 double dist(Point p1, Point p2)
@@ -62,9 +74,10 @@ void copy_point(Point p1, Point* p2)
     p2->theta = p1.theta;
 }
 
-int debug_action(actionNode a, const char* idx)
+int debug_action(const actionNode* a, const char* idx)
 {
-    fprintf(stderr, "[DEBUG] Action\t %s:\t \n\tf->%p, \n\tparam->%f, \n\tspeed->%d, \n\tis_interrpt->%p, \n\tinterrupt->%p\n", idx, a.f, a.param, a.speed, a.is_interrupt, a.interrupt);
+    fprintf(stderr, "[DEBUG] Action\t %s:\t \n\tname->%s, \n\tparam->%f, \n\tspeed->%d, \n\tmonitors->%x, \n\tpreempt->%s\n", idx, a->task.name, a->param, a->speed, a->task.monitors,
+        a->task.preempt != NULL ? a->task.preempt->name : "none");
     return 0;
 }
 
@@ -74,28 +87,36 @@ int debug_point(Point p, const char* idx)
     return 0;
 }
 
-int wait_target(Point p_init, bool (*has_reached)(Point, Point, double), double param, int delay_ms, bool (*interrupt)(void))
+/**
+ * Everything that learns from the sensors while we move, once per control tick
+ */
+void observe_pose(Point pose)
 {
-    int error = CONTROL_OK;
-    bool reach = false;
-    while (!reach) {
-        int last_time = millis();
-        Point now_point;
-        error = peek_update_point(p_init, &now_point);
-        if (error == UNKNOWN_ERROR) {
-            break;
-        }
-        reach = has_reached(p_init, now_point, param);
-        if (reach) {
-            break;
-        }
-        if (interrupt()) {
-            error = INTERRUPT;
-            break;
-        }
-        wait_delay(delay_ms, last_time);
-    }
-    return error;
+    mapping_observe(pose);
+    localisation_tick();
+}
+
+StallParams stall_params;
+StallWindow stall_window_l;
+StallWindow stall_window_r;
+WheelFault wheel_fault_l = WHEEL_OK;
+WheelFault wheel_fault_r = WHEEL_OK;
+
+/**
+ * Starts the stall windows again, the command of a new move has nothing to do with the last one
+ */
+void stall_start(void)
+{
+    load_stall_params(&stall_params);
+    stall_reset(&stall_window_l);
+    stall_reset(&stall_window_r);
+    wheel_fault_l = WHEEL_OK;
+    wheel_fault_r = WHEEL_OK;
+}
+
+bool has_wheel_fault(void)
+{
+    return (wheel_fault_l != WHEEL_OK) || (wheel_fault_r != WHEEL_OK);
 }
 
 bool has_displaced(Point p_in, Point p_now, double d)
@@ -130,12 +151,13 @@ int displacement(double (*counter)(WheelSensor, int*), Point p_init, Point* resu
     return CONTROL_OK;
 }
 
+const double distance_wheels_mm = 115.0;
+
 void integrate_move_point(Point* p, double countL, double countR)
 {
     const int N_STEPS = 1000;
     const double dl = countL / (double)N_STEPS;
     const double dr = countR / (double)N_STEPS;
-    const double distance_wheels_mm = 115.0;
 
     double x = p->x;
     double y = p->y;
@@ -170,23 +192,20 @@ double simplify_angle(double angle)
     return angle;
 }
 
-int move_internal(int (*move_robot)(int), int speed, bool (*interrupt)(void), Point p, bool (*has_reached)(Point, Point, double), double param)
-{
-    if (move_robot(speed) < 0) {
-        return UNKNOWN_ERROR;
-    }
-
-    int result = wait_target(p, has_reached, param, CONTROL_MS_CLOCK, interrupt);
-
-    return result;
-}
-
 const int countsPerLap = 20;
 // 6.6cm wheel diameter measured experimentally
 const double perimeter_wheel_mm = 66.0 * PI;
 const double circle_circumference_mm = PI * 100.0;
 
-double internal_calculate_distance(WheelSensor pin, int wheel_count, int* errorCode, bool debug)
+/**
+ * Slots since the last reset, with the fraction of the current one in FINE_ODOMETRY mode
+ */
+double wheel_count(WheelSensor pin)
+{
+    return fine_odometry ? wheelCounterFine(pin) : wheelCounter(pin);
+}
+
+double internal_calculate_distance(WheelSensor pin, double wheel_count, int* errorCode, bool debug)
 {
     if (wheel_count < 0) {
         // error reading
@@ -194,24 +213,23 @@ double internal_calculate_distance(WheelSensor pin, int wheel_count, int* errorC
     } else {
         *errorCode = 0;
     }
-    double distance_moved = perimeter_wheel_mm * ((double)wheel_count / (double)countsPerLap);
+    double distance_moved = perimeter_wheel_mm * (wheel_count / (double)countsPerLap);
     double sign = distance_sign(pin);
     if (debug) {
-        fprintf(stderr, "[DEBUG] Atomic count [pin:%d], %d, \t d %f, sign %f\n", pin, wheel_count, distance_moved, sign);
+        fprintf(stderr, "[DEBUG] Atomic count [pin:%d], %.3f, \t d %f, sign %f\n", pin, wheel_count, distance_moved, sign);
     }
     return sign * distance_moved;
 }
 
 double peek_distance_counter(WheelSensor pin, int* errorCode)
 {
-    int wheel_count = wheelCounter(pin);
-    return internal_calculate_distance(pin, wheel_count, errorCode, false);
+    return internal_calculate_distance(pin, wheel_count(pin), errorCode, false);
 }
 
 double distance_atomic_count(WheelSensor pin, int* errorCode)
 {
-    int wheel_count = reset_count(pin);
-    return internal_calculate_distance(pin, wheel_count, errorCode, true);
+    double count = fine_odometry ? reset_count_fine(pin) : reset_count(pin);
+    return internal_calculate_distance(pin, count, errorCode, true);
 }
 
 int atomic_update_point(Point p_init, Point* result)
@@ -224,43 +242,59 @@ int peek_update_point(Point p_init, Point* result)
     return displacement(peek_distance_counter, p_init, result);
 }
 
-int move_forward(double d_mm, int speed, bool (*interrupt)(void), Point p)
+/**
+ * Every start of an action, for the metrics and the trace
+ */
+void begin_action(actionNode* a)
 {
-    if (d_mm == 0) {
-        return CONTROL_OK;
-    }
-
-    return move_internal(set_wheel_moving, speed, interrupt, p, has_displaced, d_mm);
+    a->start_us = micros();
+    a->span = trace_begin(a->task.name);
+    debug_action(a, "input");
 }
 
-int turn_left(double degrees, int speed, bool (*interrupt)(void), Point p)
+/**
+ * Starts the stall windows and the wheels, from the pose the sequence is at
+ */
+int start_motion(Task* t)
 {
-    if (degrees < 0) {
-        fprintf(stderr, "Degrees must be positive calling turn left. %f", degrees);
+    actionNode* a = (actionNode*)t;
+    begin_action(a);
+    if (a->param == 0) {
+        return CONTROL_OK;
+    }
+    stall_start();
+    if (a->move_robot(a->speed) < 0) {
         return UNKNOWN_ERROR;
     }
-    return turn_in_place(degrees, speed, interrupt, p);
+    return TASK_RUNNING;
 }
 
-int turn_right(double degrees, int speed, bool (*interrupt)(void), Point p)
+int start_turn(Task* t)
 {
-    if (degrees < 0) {
-        fprintf(stderr, "Degrees must be positive calling turn right. %f", degrees);
-        return UNKNOWN_ERROR;
+    actionNode* a = (actionNode*)t;
+    if (fabs(a->param) >= IGNORE_ANGLE) {
+        begin_action(a);
+        fprintf(stderr, "[WARN] THAT ANGLE IS TOO BIG, IGNORING (angle %f)", a->param);
+        return CONTROL_OK;
     }
-    return turn_in_place(-degrees, -speed, interrupt, p);
+    return start_motion(t);
 }
 
-int turn_in_place(double degrees, int speed, bool (*interrupt)(void), Point p)
+/**
+ * One control tick of a move or a turn, done once the odometry says we got there
+ */
+int step_motion(Task* t)
 {
-    if (degrees == 0) {
-        return CONTROL_OK;
+    actionNode* a = (actionNode*)t;
+    Point now_point;
+    if (peek_update_point(*a->pose, &now_point) == UNKNOWN_ERROR) {
+        return UNKNOWN_ERROR;
     }
-    if (fabs(degrees) >= IGNORE_ANGLE) {
-        fprintf(stderr, "[WARN] THAT ANGLE IS TOO BIG, IGNORING (angle %f)", degrees);
+    observe_pose(now_point);
+    if (a->has_reached(*a->pose, now_point, a->param)) {
         return CONTROL_OK;
     }
-    return move_internal(set_wheel_turning, speed, interrupt, p, has_turned, degrees);
+    return TASK_RUNNING;
 }
 
 int reset_motion(void)
@@ -274,51 +308,137 @@ int reset_motion(void)
     return CONTROL_OK;
 }
 
-int run_actions(int count, actionNode actions[], Point p_init, Point* result)
+int odometry_tick(WheelCounts* last, Point* pose)
 {
-    int i = 0;
-    Point p;
-    copy_point(p_init, &p);
-    fprintf(stderr, "\n\n[DEBUG] RUNNING %d ACTIONS\n\n", count);
+    double count_l = wheel_count(SENSOR_L);
+    double count_r = wheel_count(SENSOR_R);
+    if ((count_l < 0) || (count_r < 0)) {
+        fprintf(stderr, "Broken sensor reads. Reads L: %f; R: %f \n", count_l, count_r);
+        return UNKNOWN_ERROR;
+    }
+    double d_l = distance_sign(SENSOR_L) * perimeter_wheel_mm * (count_l - last->count_l) / (double)countsPerLap;
+    double d_r = distance_sign(SENSOR_R) * perimeter_wheel_mm * (count_r - last->count_r) / (double)countsPerLap;
+    integrate_move_point(pose, d_l, d_r);
+    last->count_l = count_l;
+    last->count_r = count_r;
+    return CONTROL_OK;
+}
 
-    int errorCode = CONTROL_OK;
+Counter obstacle_interrupts_metric = COUNTER("obstacle_interrupts_total", "Times an obstacle came in the way of the control loop");
+// Last is_obstacle_interrupt, an obstacle that stays in the way is counted once
+bool obstacle_in_way = false;
+Counter wheel_faults_metric = COUNTER("wheel_faults_total", "Stalled or slipping wheels that stopped an action");
+Histogram action_metric = HISTOGRAM("action_us", "Time of each action of run_actions, interrupts included");
 
-    while ((i < count) && (errorCode >= 0)) {
-        actionNode action = actions[i];
-        debug_action(action, "input");
+void register_control_metrics(void)
+{
+    register_counter(&obstacle_interrupts_metric);
+    register_counter(&wheel_faults_metric);
+    register_histogram(&action_metric);
+}
 
-        errorCode = action.f(action.param, action.speed, action.is_interrupt, p);
-        fprintf(stderr, "[DEBUG] executed action i: %d; returned code: %d\n", i, errorCode);
+/**
+ * After each action: where it left us, and the wheel counts ready for the next one
+ */
+int action_finished(Scheduler* s, Task* task, int result)
+{
+    actionNode* a = (actionNode*)task;
+    Point* p = s->data;
+    histogram_record(&action_metric, micros() - a->start_us);
+    trace_end(a->span);
+    fprintf(stderr, "[DEBUG] executed action i: %d; returned code: %d\n", s->current, result);
+
+    if (result == UNKNOWN_ERROR) {
+        fprintf(stderr, "Unknown Error when executing step %d\n", s->current);
+        return UNKNOWN_ERROR;
+    }
+    if (result == RETRY) {
+        return RETRY;
+    }
 
-        if (errorCode == UNKNOWN_ERROR) {
-            fprintf(stderr, "Unknown Error when executing step %d\n", i);
-            return UNKNOWN_ERROR;
-        }
-        if (errorCode == INTERRUPT) {
-            actionNode* interrupt = action.interrupt;
-            if (interrupt == NULL) {
-                break;
-            }
-            debug_action(*interrupt, "interrupt");
-            errorCode = interrupt->f(interrupt->param, interrupt->speed, interrupt->is_interrupt, p_init);
-        }
+    // Update p, using temporary variable p_out
+    Point p_temp;
+    if (atomic_update_point(*p, &p_temp) == UNKNOWN_ERROR) {
+        return UNKNOWN_ERROR;
+    }
+    copy_point(p_temp, p);
+    p->theta = simplify_angle(p->theta);
+
+    TraceSpan reset_span = trace_begin("reset_motion");
+    int reset = reset_motion();
+    trace_end(reset_span);
+    if (reset < 0) {
+        fprintf(stderr, "Error when resetting motion between actions\n");
+        return UNKNOWN_ERROR;
+    }
+    return result;
+}
 
-        if (errorCode == RETRY) {
-            continue;
-        }
+bool is_obstacle_interrupt(void)
+{
+    bool obstacle = has_obstacle(1500);
+    if (obstacle && !obstacle_in_way) {
+        counter_add(&obstacle_interrupts_metric, 1);
+        reaction_interrupt();
+    }
+    obstacle_in_way = obstacle;
+    return obstacle;
+}
+
+/**
+ * Commanded speed against the encoder rate of each wheel, once per control tick
+ */
+bool is_stall_interrupt(void)
+{
+    unsigned int now = millis();
+    wheel_fault_l = stall_update(&stall_window_l, &stall_params, now, wheelSlots(SENSOR_L), get_speed(MOTOR_L));
+    wheel_fault_r = stall_update(&stall_window_r, &stall_params, now, wheelSlots(SENSOR_R), get_speed(MOTOR_R));
+    if (has_wheel_fault()) {
+        counter_add(&wheel_faults_metric, 1);
+        fprintf(stderr, "[WARN] Wheel fault. left %s (speed %d), right %s (speed %d)\n", wheel_fault_name(wheel_fault_l), get_speed(MOTOR_L), wheel_fault_name(wheel_fault_r), get_speed(MOTOR_R));
+        return true;
+    }
+    return false;
+}
 
-        i++;
+int obstacle_monitor(void)
+{
+    return is_obstacle_interrupt() ? INTERRUPT : CONTROL_OK;
+}
 
-        // Update p, using temporary variable p_out
-        Point p_temp;
-        atomic_update_point(p, &p_temp);
-        copy_point(p_temp, &p);
-        p.theta = simplify_angle(p.theta);
+int stall_monitor(void)
+{
+    return is_stall_interrupt() ? STALL : CONTROL_OK;
+}
 
-        if (reset_motion() < 0) {
-            fprintf(stderr, "Error when resetting motion between actions\n");
-            return UNKNOWN_ERROR;
+int run_actions(int count, actionNode actions[], Point p_init, Point* result)
+{
+    Point p;
+    copy_point(p_init, &p);
+    fprintf(stderr, "\n\n[DEBUG] RUNNING %d ACTIONS\n\n", count);
+
+    Task** tasks = malloc(sizeof(Task*) * (size_t)count);
+    if (tasks == NULL) {
+        return UNKNOWN_ERROR;
+    }
+    for (int i = 0; i < count; i++) {
+        actions[i].pose = &p;
+        if (actions[i].task.preempt != NULL) {
+            ((actionNode*)actions[i].task.preempt)->pose = &p;
         }
+        tasks[i] = &actions[i].task;
+    }
+    Scheduler scheduler;
+    scheduler_init(&scheduler, tasks, count, CONTROL_MS_CLOCK);
+    scheduler.finished = action_finished;
+    scheduler.data = &p;
+    scheduler_add_monitor(&scheduler, "obstacle", MONITOR_OBSTACLE, obstacle_monitor);
+    scheduler_add_monitor(&scheduler, "stall", MONITOR_STALL, stall_monitor);
+
+    int errorCode = scheduler_run(&scheduler);
+    free(tasks);
+    if (errorCode == UNKNOWN_ERROR) {
+        return UNKNOWN_ERROR;
     }
 
     copy_point(p, result);
@@ -328,71 +448,103 @@ int run_actions(int count, actionNode actions[], Point p_init, Point* result)
     return errorCode;
 }
 
-bool is_obstacle_interrupt()
+int start_obstacle_wait(Task* t)
 {
-    return has_obstacle(1500);
+    actionNode* a = (actionNode*)t;
+    begin_action(a);
+    if (set_wheel_moving(0) < 0) {
+        return UNKNOWN_ERROR;
+    }
+    a->first_ms = millis();
+    a->last_obstacle_ms = a->first_ms;
+    return TASK_RUNNING;
 }
 
-bool null_interrupt()
-{
-    return false;
+/**
+ * RETRY as soon as the way is clear, INTERRUPT when the obstacle is still there after OBSTACLE_WAIT_MS
+ */
+int step_obstacle_wait(Task* t)
+{
+    actionNode* a = (actionNode*)t;
+    if (a->last_obstacle_ms - a->first_ms >= OBSTACLE_WAIT_MS) {
+        fprintf(stderr, "stopped. last  %u; last no obsttacle %u. Time waited %d \n", a->last_obstacle_ms, a->first_ms, OBSTACLE_WAIT_MS);
+        return INTERRUPT;
+    }
+    if (!has_obstacle((int)round(a->param))) {
+        return RETRY;
+    }
+    a->last_obstacle_ms = millis();
+    fprintf(stderr, "no_obstacle_last_time_ms %u, time_to_wait_ms %d, last_obstacle_ms %u\n", a->first_ms, OBSTACLE_WAIT_MS, a->last_obstacle_ms);
+    return TASK_RUNNING;
 }
 
-int wait_obstacle(int time_to_wait_ms, bool (*obstacle_detector)(int), int d_mm, int delay_ms)
+/**
+ * Obstacle wait as a step of its own, the way being clear ends it instead of retrying
+ */
+int step_clear_wait(Task* t)
 {
-    int no_obstacle_last_time_ms = millis();
-    int last_obstacle_ms = no_obstacle_last_time_ms;
-    while ((last_obstacle_ms - no_obstacle_last_time_ms) < time_to_wait_ms) {
-        bool obstacle = obstacle_detector(d_mm);
-        if (obstacle) {
-            last_obstacle_ms = millis();
-            fprintf(stderr, "no_obstacle_last_time_ms %d, time_to_wait_ms %d, last_obstacle_ms %d\n", no_obstacle_last_time_ms, time_to_wait_ms, last_obstacle_ms);
-        } else {
-            return RETRY;
-        }
-        delay(delay_ms);
-    }
-    fprintf(stderr, "stopped. last  %d; last no obsttacle %d. Time waited %d \n", last_obstacle_ms, no_obstacle_last_time_ms, time_to_wait_ms);
-    return INTERRUPT;
+    int result = step_obstacle_wait(t);
+    return result == RETRY ? CONTROL_OK : result;
 }
 
-int wait_interrupt_action(double d_obstacle_mm, int speed_ignore, is_interrupt interrupt, Point to)
+void action_factory(actionNode* a, const char* name, TaskStep start, TaskStep step, double param, int speed)
 {
-    if (set_wheel_moving(0) < 0) {
-        return UNKNOWN_ERROR;
-    }
-    return wait_obstacle(1 * 1000, has_obstacle, (int)round(d_obstacle_mm) /* obstacle distance mm */, 40 /* delay checks ms*/);
+    a->task = (Task) { .name = name, .start = start, .step = step };
+    a->move_robot = NULL;
+    a->has_reached = NULL;
+    a->param = param;
+    a->speed = speed;
+    a->pose = NULL;
 }
 
 void move_action_factory(actionNode* a, double d_mm, int speed, actionNode* interrupt)
 {
-    a->f = move_forward;
-    a->speed = speed;
-    a->param = d_mm;
-    a->is_interrupt = is_obstacle_interrupt;
-    a->interrupt = interrupt;
+    action_factory(a, "move", start_motion, step_motion, d_mm, speed);
+    a->move_robot = set_wheel_moving;
+    a->has_reached = has_displaced;
+    a->task.monitors = MONITOR_OBSTACLE | MONITOR_STALL;
+    a->task.preempt = interrupt != NULL ? &interrupt->task : NULL;
 }
+
 void interrupt_action_factory(actionNode* a)
 {
-    a->f = wait_interrupt_action;
-    a->param = 1500.0; // distance measuring
-    a->speed = 0;
-    a->is_interrupt = null_interrupt;
-    a->interrupt = NULL;
+    action_factory(a, "obstacle_wait", start_obstacle_wait, step_obstacle_wait, 1500.0 /* obstacle distance mm */, 0);
 }
 
 void turn_action_factory(actionNode* a, double degrees, int speed)
 {
-    a->is_interrupt = null_interrupt;
-    a->speed = speed;
-    a->interrupt = NULL;
-    if (degrees < 0) {
-        a->f = turn_right;
-        a->param = -degrees;
-    } else {
-        a->param = degrees;
-        a->f = turn_left;
+    action_factory(a, "turn", start_turn, step_motion, degrees, degrees < 0 ? -speed : speed);
+    a->move_robot = set_wheel_turning;
+    a->has_reached = has_turned;
+    a->task.monitors = MONITOR_STALL;
+}
+
+int run_program(const Program* program, int default_speed, Point init, Point* result)
+{
+    actionNode* actions = malloc(sizeof(actionNode) * (size_t)program->count);
+    if (actions == NULL) {
+        return UNKNOWN_ERROR;
+    }
+    actionNode obstacle_wait;
+    interrupt_action_factory(&obstacle_wait);
+    for (int i = 0; i < program->count; i++) {
+        const ProgramStep* step = &program->steps[i];
+        int speed = step->speed != 0 ? step->speed : default_speed;
+        switch (step->type) {
+        case PROGRAM_MOVE:
+            move_action_factory(&actions[i], step->param, speed, step->preempt == PROGRAM_PREEMPT_OBSTACLE_WAIT ? &obstacle_wait : NULL);
+            break;
+        case PROGRAM_TURN:
+            turn_action_factory(&actions[i], step->param, speed);
+            break;
+        case PROGRAM_WAIT_CLEAR:
+            action_factory(&actions[i], "clear_wait", start_obstacle_wait, step_clear_wait, step->param, 0);
+            break;
+        }
     }
+    int run_result = run_actions(program->count, actions, init, result);
+    free(actions);
+    return run_result;
 }
 
 int move_from_to(Point from, Point to, int speed, Point* result)
@@ -407,15 +559,12 @@ int move_from_to(Point from, Point to, int speed, Point* result)
     fprintf(stderr, "Trayectory change angle %f, move d %f, angle final %f\n", first_angle, distance, final_angle_turn);
 
     actionNode move_interupt;
-    actionNode turn_to_go;
-    actionNode turn_end;
-    actionNode move;
+    actionNode actions[3];
     interrupt_action_factory(&move_interupt);
-    turn_action_factory(&turn_to_go, first_angle, speed);
-    move_action_factory(&move, distance, speed, &move_interupt);
-    turn_action_factory(&turn_end, final_angle_turn, speed);
+    turn_action_factory(&actions[0], first_angle, speed);
+    move_action_factory(&actions[1], distance, speed, &move_interupt);
+    turn_action_factory(&actions[2], final_angle_turn, speed);
 
-    actionNode actions[3] = { turn_to_go, move, turn_end };
     int run_result = run_actions(3, actions, from, result);
 
     return run_result;
@@ -433,23 +582,206 @@ int go_around(int speed, Point init, Point* result)
     actionNode move_interupt;
     interrupt_action_factory(&move_interupt);
 
-    actionNode action_0;
+    actionNode actions[4];
     // (3) girará a la izquierda 90 grados,
-    turn_action_factory(&action_0, 90, speed);
-    actionNode action_1;
+    turn_action_factory(&actions[0], 90, speed);
     // (4) avanzará 40 cm,
-    move_action_factory(&action_1, 400, speed, &move_interupt);
-    actionNode action_2;
+    move_action_factory(&actions[1], 400, speed, &move_interupt);
     // (5) girará a la derecha 90 grados,
-    turn_action_factory(&action_2, -90, speed);
-    actionNode action_3;
+    turn_action_factory(&actions[2], -90, speed);
     // (7) avanzará 50 cm y considerará finalizada la rutina de esquiva.
-    move_action_factory(&action_3, 500, speed, &move_interupt);
-    actionNode actions[4] = {
-        action_0,
-        action_1,
-        action_2,
-        action_3,
-    };
+    move_action_factory(&actions[3], 500, speed, &move_interupt);
     return run_actions(4, actions, init, result);
 }
+
+/**
+ * A closed loop drive, move_reactive or approach_target, as a task of the scheduler. It integrates
+ * the odometry itself every tick and commands the wheels as a differential drive
+ */
+typedef struct {
+    Task task; // first, as actionNode
+    Point pose;
+    Point to;
+    int speed;
+    WheelCounts last;
+    unsigned int start_ms;
+    unsigned int timeout_ms;
+    AvoidanceState avoidance; // reactive
+    double tolerance_mm; // approach
+    bool align_theta;
+    bool arrived; // within tolerance_mm once, only the heading is left
+    ApproachReport* report;
+} driveNode;
+
+int start_drive(Task* t)
+{
+    driveNode* d = (driveNode*)t;
+    if (reset_motion() < 0) {
+        return UNKNOWN_ERROR;
+    }
+    stall_start();
+    d->last = (WheelCounts) { 0, 0 };
+    d->start_ms = millis();
+    return TASK_RUNNING;
+}
+
+void drive_factory(driveNode* d, const char* name, TaskStep step, Point from, Point to, int speed, unsigned int timeout_ms)
+{
+    d->task = (Task) { .name = name, .start = start_drive, .step = step, .monitors = MONITOR_STALL };
+    copy_point(from, &d->pose);
+    copy_point(to, &d->to);
+    d->speed = speed;
+    d->timeout_ms = timeout_ms;
+    d->report = NULL;
+}
+
+/**
+ * Odometry and mapping of one tick, INTERRUPT once the drive is out of time
+ */
+int drive_tick(driveNode* d)
+{
+    if (millis() - d->start_ms >= d->timeout_ms) {
+        return INTERRUPT;
+    }
+    if (odometry_tick(&d->last, &d->pose) == UNKNOWN_ERROR) {
+        return UNKNOWN_ERROR;
+    }
+    observe_pose(d->pose);
+    return TASK_RUNNING;
+}
+
+/**
+ * Runs the drive through the scheduler, then stops the wheels and leaves the pose where they stopped
+ */
+int run_drive(driveNode* d)
+{
+    Task* tasks[] = { &d->task };
+    Scheduler scheduler;
+    scheduler_init(&scheduler, tasks, 1, CONTROL_MS_CLOCK);
+    scheduler_add_monitor(&scheduler, "obstacle", MONITOR_OBSTACLE, obstacle_monitor);
+    scheduler_add_monitor(&scheduler, "stall", MONITOR_STALL, stall_monitor);
+    int error = scheduler_run(&scheduler);
+
+    // Before the stop, distance_sign still has the direction the wheels turned in during the last tick
+    int tick = odometry_tick(&d->last, &d->pose);
+    if (set_wheel_moving(0) < 0) {
+        return UNKNOWN_ERROR;
+    }
+    if (tick == UNKNOWN_ERROR) {
+        return UNKNOWN_ERROR;
+    }
+    d->pose.theta = simplify_angle(d->pose.theta);
+    if (reset_motion() < 0) {
+        return UNKNOWN_ERROR;
+    }
+    return error;
+}
+
+int step_reactive(Task* t)
+{
+    driveNode* d = (driveNode*)t;
+    int tick = drive_tick(d);
+    if (tick != TASK_RUNNING) {
+        return tick;
+    }
+    if (dist(d->pose, d->to) < REACTIVE_TOLERANCE_MM) {
+        return CONTROL_OK;
+    }
+    double goal_error = simplify_angle(angle_to(d->pose, d->to) - d->pose.theta);
+    WheelCommand command = avoidance_step(&d->avoidance, proximity_nearness(MOTION_SENSOR_L), proximity_nearness(MOTION_SENSOR_R), goal_error, d->speed);
+    if (set_wheel_differential(command.speed_l, command.speed_r) < 0) {
+        return UNKNOWN_ERROR;
+    }
+    return TASK_RUNNING;
+}
+
+int move_reactive(Point from, Point to, int speed, Point* result)
+{
+    fprintf(stderr, "REACTIVE GOING TO %f, %f, %f\n", to.x, to.y, to.theta);
+    driveNode drive;
+    drive_factory(&drive, "reactive", step_reactive, from, to, speed, REACTIVE_TIMEOUT_MS);
+    avoidance_reset(&drive.avoidance);
+
+    int error = run_drive(&drive);
+    if (error == UNKNOWN_ERROR) {
+        return UNKNOWN_ERROR;
+    }
+    debug_point(drive.pose, "reactive.result");
+
+    if ((error == CONTROL_OK) && (fabs(to.theta) < IGNORE_ANGLE)) {
+        actionNode turn_end;
+        turn_action_factory(&turn_end, simplify_angle(to.theta - drive.pose.theta), speed);
+        return run_actions(1, &turn_end, drive.pose, result);
+    }
+    copy_point(drive.pose, result);
+    return error;
+}
+
+int step_approach(Task* t)
+{
+    driveNode* d = (driveNode*)t;
+    int tick = drive_tick(d);
+    if (tick != TASK_RUNNING) {
+        return tick;
+    }
+
+    int speed = d->speed;
+    double distance = dist(d->pose, d->to);
+    double v = 0;
+    double w = 0;
+    // Once in, the turn in place may drift the odometry back over the tolerance. Driving again from
+    // there would aim at a point a few mm away, with a bearing that flips every tick
+    d->arrived = d->arrived || (distance <= d->tolerance_mm);
+    if (!d->arrived) {
+        // Drive backwards when the target is behind us, a small overshoot should not cost two turns
+        double bearing = simplify_angle(angle_to(d->pose, d->to) - d->pose.theta);
+        double direction = 1.0;
+        if (fabs(bearing) > 90.0) {
+            direction = -1.0;
+            bearing = simplify_angle(bearing + 180.0);
+        }
+        w = speed * fmax(-1.0, fmin(1.0, bearing / APPROACH_TURN_FULL_DEG));
+        if (fabs(bearing) < APPROACH_TURN_ONLY_DEG) {
+            v = direction * fmax(APPROACH_MIN_SPEED, fmin(speed, speed * distance / APPROACH_SLOW_DOWN_MM));
+        }
+    } else if (d->align_theta && fabs(simplify_angle(d->to.theta - d->pose.theta)) > APPROACH_TOLERANCE_DEG) {
+        double heading = simplify_angle(d->to.theta - d->pose.theta);
+        w = (heading > 0 ? 1.0 : -1.0) * fmax(APPROACH_MIN_SPEED, fmin(speed, speed * fabs(heading) / APPROACH_TURN_FULL_DEG));
+    } else {
+        d->report->converged = true;
+        return CONTROL_OK;
+    }
+    // Turning in place has to get past the deadband, while driving a small correction is enough
+    if ((v == 0) && (fabs(w) > 0) && (fabs(w) < APPROACH_MIN_SPEED)) {
+        w = w > 0 ? APPROACH_MIN_SPEED : -APPROACH_MIN_SPEED;
+    }
+    if (set_wheel_differential((int)round(v - w), (int)round(v + w)) < 0) {
+        return UNKNOWN_ERROR;
+    }
+    return TASK_RUNNING;
+}
+
+int approach_target(Point from, Point to, int speed, double tolerance_mm, Point* result, ApproachReport* report)
+{
+    fprintf(stderr, "APPROACHING %f, %f, %f\n", to.x, to.y, to.theta);
+    driveNode drive;
+    drive_factory(&drive, "approach", step_approach, from, to, speed, APPROACH_TIMEOUT_MS);
+    drive.task.monitors |= MONITOR_OBSTACLE;
+    drive.align_theta = fabs(to.theta) < IGNORE_ANGLE;
+    drive.tolerance_mm = tolerance_mm;
+    drive.arrived = false;
+    drive.report = report;
+    report->converged = false;
+
+    int error = run_drive(&drive);
+    if (error == UNKNOWN_ERROR) {
+        return UNKNOWN_ERROR;
+    }
+    report->time_ms = millis() - drive.start_ms;
+    report->distance_mm = dist(drive.pose, to);
+    report->angle_deg = drive.align_theta ? simplify_angle(to.theta - drive.pose.theta) : 0.0;
+    fprintf(stderr, "[DEBUG] Approach %s in %u ms. d=%f, angle=%f\n", report->converged ? "converged" : "stopped", report->time_ms, report->distance_mm, report->angle_deg);
+
+    copy_point(drive.pose, result);
+    return error;
+}
@@ -1,10 +1,30 @@
 #ifndef CONTROL_H
 #define CONTROL_H
 
+#include "program.h"
 #include "sensors.h"
 #include <stdbool.h>
 
 #define IGNORE_ANGLE 10000
+#define CONTROL_MS_CLOCK 40
+// Scheduler monitors of the actions, see scheduler.h
+#define MONITOR_OBSTACLE 1
+#define MONITOR_STALL 2
+// An obstacle that stays this long in front ends the move, one that goes away lets it go on
+#define OBSTACLE_WAIT_MS 1000
+
+// Reactive avoidance ends when this close to the target
+#define REACTIVE_TOLERANCE_MM 30.0
+#define REACTIVE_TIMEOUT_MS 30000
+
+// Final approach, slow closed loop on what is left of the move
+#define APPROACH_TIMEOUT_MS 10000
+// Slowest wheel command, below it the servo deadband decides whether the wheel turns (STALL_MIN_SPEED)
+#define APPROACH_MIN_SPEED 20
+#define APPROACH_SLOW_DOWN_MM 100.0
+#define APPROACH_TURN_FULL_DEG 45.0
+#define APPROACH_TURN_ONLY_DEG 30.0
+#define APPROACH_TOLERANCE_DEG 3.0
 
 typedef struct {
     double x;
@@ -12,10 +32,32 @@ typedef struct {
     double theta;
 } Point;
 
+typedef struct {
+    bool converged;
+    unsigned int time_ms;
+    double distance_mm;
+    double angle_deg;
+} ApproachReport;
+
+typedef struct {
+    double count_l;
+    double count_r;
+} WheelCounts;
+
+extern const int countsPerLap;
+extern const double perimeter_wheel_mm;
+extern const double distance_wheels_mm;
+
 extern double dist(Point p1, Point p2);
 
 extern void copy_point(Point p1, Point* p2);
 
+extern double angle_to(Point p1, Point p2);
+
+extern double simplify_angle(double angle);
+
+extern void integrate_move_point(Point* p, double countL, double countR);
+
 extern int debug_point(Point p, const char* idx);
 
 extern double peek_distance_counter(WheelSensor pin, int* errorCode);
@@ -28,8 +70,41 @@ extern int peek_update_point(Point p_init, Point* result);
 
 extern int reset_motion(void);
 
+/**
+ * An obstacle in stopping range, what interrupts a move
+ */
+extern bool is_obstacle_interrupt(void);
+/**
+ * Obstacle interrupts, wheel faults and time per action, see metrics.h
+ */
+extern void register_control_metrics(void);
+
+/**
+ * Incremental odometry, integrates into pose the wheel counts since last
+ * and stores the new counts into last. Needed when the path is not a straight line or a turn in place
+ */
+extern int odometry_tick(WheelCounts* last, Point* pose);
+
 extern int move_from_to(Point from, Point to, int speed, Point* result);
 
+/**
+ * All the steps of a validated program as one sequence, steps without a speed go at default_speed
+ */
+extern int run_program(const Program* program, int default_speed, Point init, Point* result);
+
 extern int go_around(int speed, Point init, Point* result);
 
+/**
+ * Steers around obstacles using both IR channels while heading to the target. Runs on the scheduler,
+ * STALL when a wheel stalls or slips
+ */
+extern int move_reactive(Point from, Point to, int speed, Point* result);
+
+/**
+ * Low speed closed loop on the remaining distance and heading error, used once we are close to the target.
+ * Done within tolerance_mm of the target, report tells how long it took to converge. Runs on the scheduler,
+ * INTERRUPT on an obstacle and STALL when a wheel stalls or slips
+ */
+extern int approach_target(Point from, Point to, int speed, double tolerance_mm, Point* result, ApproachReport* report);
+
 #endif
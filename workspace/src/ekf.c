@@ -0,0 +1,204 @@
+#include "ekf.h"
+#include "sensors.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <threads.h>
+
+void ekf_init(Ekf* f, Point p, double sigma_xy_mm, double sigma_theta_deg)
+{
+    f->x = p.x;
+    f->y = p.y;
+    f->theta = p.theta * PI / 180.0;
+    memset(f->cov, 0, sizeof(f->cov));
+    f->cov[0][0] = sigma_xy_mm * sigma_xy_mm;
+    f->cov[1][1] = sigma_xy_mm * sigma_xy_mm;
+    double sigma_theta = sigma_theta_deg * PI / 180.0;
+    f->cov[2][2] = sigma_theta * sigma_theta;
+}
+
+void ekf_predict(Ekf* f, double d_l, double d_r)
+{
+    if ((d_l == 0) && (d_r == 0)) {
+        return;
+    }
+    const double b = distance_wheels_mm;
+    double d = (d_l + d_r) / 2.0;
+    double dtheta = (d_r - d_l) / b;
+    double h = f->theta + dtheta / 2.0;
+    double c = cos(h);
+    double s = sin(h);
+
+    // Jacobian on the state
+    double F[3][3] = {
+        { 1, 0, -d * s },
+        { 0, 1, d * c },
+        { 0, 0, 1 },
+    };
+    // Jacobian on the wheel increments (d_l, d_r)
+    double W[3][2] = {
+        { 0.5 * c + d * s / (2.0 * b), 0.5 * c - d * s / (2.0 * b) },
+        { 0.5 * s - d * c / (2.0 * b), 0.5 * s + d * c / (2.0 * b) },
+        { -1.0 / b, 1.0 / b },
+    };
+    double q_l = EKF_WHEEL_VARIANCE * fabs(d_l);
+    double q_r = EKF_WHEEL_VARIANCE * fabs(d_r);
+
+    // P = F P F' + W Q W'
+    double FP[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            FP[i][j] = F[i][0] * f->cov[0][j] + F[i][1] * f->cov[1][j] + F[i][2] * f->cov[2][j];
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            f->cov[i][j] = FP[i][0] * F[j][0] + FP[i][1] * F[j][1] + FP[i][2] * F[j][2]
+                + W[i][0] * q_l * W[j][0] + W[i][1] * q_r * W[j][1];
+        }
+    }
+
+    f->x += d * c;
+    f->y += d * s;
+    f->theta += dtheta;
+}
+
+int invert3(const double m[3][3], double out[3][3])
+{
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+        - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+        + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (fabs(det) < 1e-12) {
+        return -1;
+    }
+    double inv = 1.0 / det;
+    out[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv;
+    out[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+    out[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+    out[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv;
+    out[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+    out[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+    out[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv;
+    out[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+    out[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+    return 0;
+}
+
+void ekf_correct(Ekf* f, Point z, double sigma_xy_mm, double sigma_theta_deg)
+{
+    double sigma_theta = sigma_theta_deg * PI / 180.0;
+    double R[3] = { sigma_xy_mm * sigma_xy_mm, sigma_xy_mm * sigma_xy_mm, sigma_theta * sigma_theta };
+
+    // H is the identity: S = P + R, K = P S^-1
+    double S[3][3];
+    memcpy(S, f->cov, sizeof(S));
+    for (int i = 0; i < 3; i++) {
+        S[i][i] += R[i];
+    }
+    double S_inv[3][3];
+    if (invert3((const double(*)[3])S, S_inv) < 0) {
+        return;
+    }
+    double K[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            K[i][j] = f->cov[i][0] * S_inv[0][j] + f->cov[i][1] * S_inv[1][j] + f->cov[i][2] * S_inv[2][j];
+        }
+    }
+
+    double innovation[3] = { z.x - f->x, z.y - f->y, z.theta * PI / 180.0 - f->theta };
+    innovation[2] = atan2(sin(innovation[2]), cos(innovation[2]));
+    f->x += K[0][0] * innovation[0] + K[0][1] * innovation[1] + K[0][2] * innovation[2];
+    f->y += K[1][0] * innovation[0] + K[1][1] * innovation[1] + K[1][2] * innovation[2];
+    f->theta += K[2][0] * innovation[0] + K[2][1] * innovation[1] + K[2][2] * innovation[2];
+
+    // P = (I - K) P
+    double P[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            P[i][j] = f->cov[i][j] - (K[i][0] * f->cov[0][j] + K[i][1] * f->cov[1][j] + K[i][2] * f->cov[2][j]);
+        }
+    }
+    memcpy(f->cov, P, sizeof(P));
+}
+
+void ekf_estimate(const Ekf* f, PoseEstimate* result)
+{
+    result->pose.x = f->x;
+    result->pose.y = f->y;
+    result->pose.theta = simplify_angle(f->theta * 180.0 / PI);
+    memcpy(result->cov, f->cov, sizeof(result->cov));
+}
+
+double position_sigma(const PoseEstimate* e)
+{
+    return sqrt(e->cov[0][0] + e->cov[1][1]);
+}
+
+Ekf pose_filter;
+mtx_t pose_filter_lock;
+atomic_bool pose_filter_started = false;
+int ekf_odometer_l = 0;
+int ekf_odometer_r = 0;
+
+void start_pose_estimator(Point p_init)
+{
+    if (!pose_filter_started) {
+        mtx_init(&pose_filter_lock, mtx_plain);
+    }
+    mtx_lock(&pose_filter_lock);
+    ekf_init(&pose_filter, p_init, 0.0, 0.0);
+    ekf_odometer_l = wheelOdometer(SENSOR_L);
+    ekf_odometer_r = wheelOdometer(SENSOR_R);
+    mtx_unlock(&pose_filter_lock);
+    pose_filter_started = true;
+}
+
+void ekf_tick(void)
+{
+    if (!pose_filter_started) {
+        return;
+    }
+    int odometer_l = wheelOdometer(SENSOR_L);
+    int odometer_r = wheelOdometer(SENSOR_R);
+    if ((odometer_l == ekf_odometer_l) && (odometer_r == ekf_odometer_r)) {
+        return;
+    }
+    double d_l = perimeter_wheel_mm * (double)(odometer_l - ekf_odometer_l) / (double)countsPerLap;
+    double d_r = perimeter_wheel_mm * (double)(odometer_r - ekf_odometer_r) / (double)countsPerLap;
+    ekf_odometer_l = odometer_l;
+    ekf_odometer_r = odometer_r;
+
+    mtx_lock(&pose_filter_lock);
+    ekf_predict(&pose_filter, d_l, d_r);
+    mtx_unlock(&pose_filter_lock);
+}
+
+void pose_estimate(PoseEstimate* result)
+{
+    if (!pose_filter_started) {
+        memset(result, 0, sizeof(*result));
+        return;
+    }
+    mtx_lock(&pose_filter_lock);
+    ekf_estimate(&pose_filter, result);
+    mtx_unlock(&pose_filter_lock);
+}
+
+void correct_pose_estimate(Point z, double sigma_xy_mm, double sigma_theta_deg)
+{
+    if (!pose_filter_started) {
+        return;
+    }
+    mtx_lock(&pose_filter_lock);
+    ekf_correct(&pose_filter, z, sigma_xy_mm, sigma_theta_deg);
+    mtx_unlock(&pose_filter_lock);
+}
+
+int debug_estimate(PoseEstimate e, const char* idx)
+{
+    fprintf(stderr, "[DEBUG] Estimate %s: (x, y, theta) %f, %f, %f; sigma (x, y, theta) %f, %f, %f\n", idx,
+        e.pose.x, e.pose.y, e.pose.theta, sqrt(e.cov[0][0]), sqrt(e.cov[1][1]), sqrt(e.cov[2][2]) * 180.0 / PI);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef EKF_H
+#define EKF_H
+
+#include "control.h"
+
+/**
+ * Extended Kalman filter on the pose (x, y, theta), fed with the encoder increments of every sample.
+ *
+ * Fixed 3x3 matrices and no allocation, so it can run inside the sensor thread.
+ * Each wheel's variance grows with the distance it moved (differential drive model),
+ * so the covariance tells callers how much the pose can be trusted.
+ */
+
+// Variance added per mm moved by each wheel (mm^2 / mm), ~7 degrees of heading drift per metre
+#define EKF_WHEEL_VARIANCE 0.1
+
+typedef struct {
+    Point pose; // mm, mm, degrees
+    double cov[3][3]; // x, y in mm, theta in radians
+} PoseEstimate;
+
+typedef struct {
+    double x;
+    double y;
+    double theta; // radians
+    double cov[3][3];
+} Ekf;
+
+extern void ekf_init(Ekf* f, Point p, double sigma_xy_mm, double sigma_theta_deg);
+
+/**
+ * d_l, d_r: mm moved by each wheel since the last prediction
+ */
+extern void ekf_predict(Ekf* f, double d_l, double d_r);
+
+/**
+ * Fuses an absolute pose measurement (e.g. localisation), sigma in mm and degrees
+ */
+extern void ekf_correct(Ekf* f, Point z, double sigma_xy_mm, double sigma_theta_deg);
+
+extern void ekf_estimate(const Ekf* f, PoseEstimate* result);
+
+/**
+ * Standard deviation of the position in mm (square root of the covariance trace on x, y)
+ */
+extern double position_sigma(const PoseEstimate* e);
+
+/**
+ * Global estimator. ekf_tick is called every sample by the sensor thread
+ */
+extern void start_pose_estimator(Point p_init);
+extern void ekf_tick(void);
+extern void pose_estimate(PoseEstimate* result);
+extern void correct_pose_estimate(Point z, double sigma_xy_mm, double sigma_theta_deg);
+extern int debug_estimate(PoseEstimate e, const char* idx);
+
+#endif
@@ -2,19 +2,27 @@
 /**
  * See https://en.cppreference.com/w/c/thread
  */
+#include "localisation.h"
+#include "metrics.h"
 #include "motor.h"
 #include "sensors.h"
+#include "state.h"
+#include "trace.h"
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wiringPi.h>
 
+Counter wait_delay_missed_metric = COUNTER("wait_delay_missed_total", "Waits that started past their deadline");
+
 void wait_delay(unsigned int target_wait_ms, unsigned int last_millis)
 {
     unsigned int now = millis();
     int diff = now - last_millis;
     if (diff >= target_wait_ms) {
         fprintf(stderr, "wait_delay unable to keep up, your delay is too short compared to execution time");
+        counter_add(&wait_delay_missed_metric, 1);
         // just get a switch for LINUX to handle the thread
         delay(1);
         return;
@@ -32,9 +40,19 @@ void shutdown(void)
         fprintf(stderr, "\n\t[ERROR] Stopping sensor thread cleanly didn't work\n");
     }
     cleanup(pins, pinc);
+    stop_localisation();
+    // On Ctrl+C main never gets to it, and the readers would wait for running to drop forever
+    stop_state_segment();
+    metrics_dump_file();
+    stop_trace();
 }
-void sigint_handler(int signum)
+void signal_handler(int signum)
 {
+    if (signum == SIGUSR1) {
+        // Dumped by the control thread, printing from here could interrupt another print
+        metrics_request_dump();
+        return;
+    }
     fprintf(stderr, "\n\tCleaning up after Ctrl+C\n");
     shutdown();
     exit(-1);
@@ -43,7 +61,11 @@ void sigint_handler(int signum)
 int startup(void)
 {
     // LINUX specific
-    signal(SIGINT, sigint_handler);
+    signal(SIGINT, signal_handler);
+    signal(SIGUSR1, signal_handler);
+    register_counter(&wait_delay_missed_metric);
+    start_trace();
+    trace_thread("control");
     fprintf(stderr, "MAIN PROGRAM\n");
     if (setup(pins, pinc) < -0) {
         fprintf(stderr, "Error setting up pins\n");
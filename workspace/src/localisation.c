@@ -0,0 +1,451 @@
+#include "localisation.h"
+#include "helper.h"
+#include "sensors.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+// xorshift, every thread keeps its own state so no locking is needed
+float random_uniform(unsigned int* state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (float)(x >> 8) / 16777216.0f;
+}
+
+float random_gaussian(unsigned int* state, float sigma)
+{
+    float u1 = random_uniform(state) + 1e-7f;
+    float u2 = random_uniform(state);
+    return sigma * sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)PI * u2);
+}
+
+float expected_range(const OccupancyGrid* map, float x, float y, float theta, float side)
+{
+    float c = cosf(theta);
+    float s = sinf(theta);
+    float ox = x + (float)IR_SENSOR_FORWARD_MM * c - side * s;
+    float oy = y + (float)IR_SENSOR_FORWARD_MM * s + side * c;
+    for (float d = 0; d < (float)IR_MAX_RANGE_MM; d += (float)OCCUPANCY_CELL_MM / 2.0f) {
+        int cx = (int)roundf((ox + d * c) / (float)OCCUPANCY_CELL_MM);
+        int cy = (int)roundf((oy + d * s) / (float)OCCUPANCY_CELL_MM);
+        if (occupancy_is_occupied(map, cx, cy)) {
+            return d < (float)IR_MIN_RANGE_MM ? (float)IR_MIN_RANGE_MM : d;
+        }
+    }
+    return (float)IR_MAX_RANGE_MM;
+}
+
+void predict_range(WorkerRange* w)
+{
+    ParticleSet* p = &w->l->sets[w->l->current];
+    unsigned int seed = w->seed;
+    const float base = (float)distance_wheels_mm;
+    for (int i = w->begin; i < w->end; i++) {
+        float dl = w->d_l + random_gaussian(&seed, (float)MCL_WHEEL_NOISE * fabsf(w->d_l) + 0.1f);
+        float dr = w->d_r + random_gaussian(&seed, (float)MCL_WHEEL_NOISE * fabsf(w->d_r) + 0.1f);
+        float d = (dl + dr) / 2.0f;
+        float dtheta = (dr - dl) / base;
+        float heading = p->theta[i] + dtheta / 2.0f;
+        p->x[i] += d * cosf(heading);
+        p->y[i] += d * sinf(heading);
+        p->theta[i] += dtheta;
+    }
+}
+
+void weight_range(WorkerRange* w)
+{
+    ParticleSet* p = &w->l->sets[w->l->current];
+    const OccupancyGrid* map = w->l->map;
+    for (int i = w->begin; i < w->end; i++) {
+        p->expected_l[i] = expected_range(map, p->x[i], p->y[i], p->theta[i], (float)IR_SENSOR_SIDE_MM);
+        p->expected_r[i] = expected_range(map, p->x[i], p->y[i], p->theta[i], -(float)IR_SENSOR_SIDE_MM);
+    }
+
+    // No branches or calls other than expf, the compiler can vectorise this one
+    const float inv_var = 1.0f / (float)(MCL_RANGE_SIGMA_MM * MCL_RANGE_SIGMA_MM);
+    const float hit = 1.0f - (float)MCL_RANDOM_READING;
+    const float uniform = (float)MCL_RANDOM_READING;
+    const float z_l = w->z_l;
+    const float z_r = w->z_r;
+    float* restrict weight = p->weight;
+    const float* restrict expected_l = p->expected_l;
+    const float* restrict expected_r = p->expected_r;
+    for (int i = w->begin; i < w->end; i++) {
+        float el = expected_l[i] - z_l;
+        float er = expected_r[i] - z_r;
+        float likelihood_l = hit * expf(-0.5f * el * el * inv_var) + uniform;
+        float likelihood_r = hit * expf(-0.5f * er * er * inv_var) + uniform;
+        weight[i] *= likelihood_l * likelihood_r;
+    }
+}
+
+void run_range(WorkerRange* w)
+{
+    if (w->mode == MCL_PREDICT) {
+        predict_range(w);
+    } else {
+        weight_range(w);
+    }
+}
+
+typedef struct {
+    WorkerPool* pool;
+    int index;
+    unsigned int seen; // generation when started, a job can come before the thread first runs
+} PoolSlot;
+
+int pool_worker(void* arg)
+{
+    PoolSlot slot = *(PoolSlot*)arg;
+    free(arg);
+    WorkerPool* pool = slot.pool;
+    unsigned int seen = slot.seen;
+    mtx_lock(&pool->lock);
+    while (true) {
+        while ((pool->generation == seen) && !pool->stop) {
+            cnd_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        mtx_unlock(&pool->lock);
+        run_range(&pool->ranges[slot.index]);
+        mtx_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            cnd_signal(&pool->done);
+        }
+    }
+    mtx_unlock(&pool->lock);
+    return 0;
+}
+
+int localisation_start_workers(Localisation* l)
+{
+    WorkerPool* pool = &l->pool;
+    mtx_init(&pool->lock, mtx_plain);
+    cnd_init(&pool->wake);
+    cnd_init(&pool->done);
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->stop = false;
+    pool->started = 0;
+    for (int t = 1; t < l->threads; t++) {
+        PoolSlot* slot = malloc(sizeof(PoolSlot));
+        if (slot == NULL) {
+            break;
+        }
+        slot->pool = pool;
+        slot->index = t;
+        slot->seen = pool->generation;
+        if (thrd_create(&pool->threads[t], pool_worker, slot) != thrd_success) {
+            free(slot);
+            break;
+        }
+        pool->started++;
+    }
+    return pool->started;
+}
+
+void localisation_stop_workers(Localisation* l)
+{
+    WorkerPool* pool = &l->pool;
+    if (pool->started == 0) {
+        return;
+    }
+    mtx_lock(&pool->lock);
+    pool->stop = true;
+    cnd_broadcast(&pool->wake);
+    mtx_unlock(&pool->lock);
+    for (int t = 1; t <= pool->started; t++) {
+        thrd_join(pool->threads[t], NULL);
+    }
+    pool->started = 0;
+    cnd_destroy(&pool->wake);
+    cnd_destroy(&pool->done);
+    mtx_destroy(&pool->lock);
+}
+
+/**
+ * Splits the particles between the calling thread and the pool, and waits for all the chunks
+ */
+void run_workers(Localisation* l, WorkerRange job)
+{
+    WorkerPool* pool = &l->pool;
+    int n = l->sets[l->current].n;
+    int threads = (n < MCL_PARALLEL_MIN) ? 1 : pool->started + 1;
+
+    for (int t = 0; t < threads; t++) {
+        pool->ranges[t] = job;
+        pool->ranges[t].begin = n * t / threads;
+        pool->ranges[t].end = n * (t + 1) / threads;
+        pool->ranges[t].seed = l->seed + 7919u * (unsigned int)(t + 1);
+    }
+    if (threads > 1) {
+        mtx_lock(&pool->lock);
+        pool->pending = threads - 1;
+        pool->generation++;
+        cnd_broadcast(&pool->wake);
+        mtx_unlock(&pool->lock);
+    }
+    run_range(&pool->ranges[0]);
+    if (threads > 1) {
+        mtx_lock(&pool->lock);
+        while (pool->pending > 0) {
+            cnd_wait(&pool->done, &pool->lock);
+        }
+        mtx_unlock(&pool->lock);
+    }
+    random_uniform(&l->seed);
+}
+
+void localisation_init(Localisation* l, const OccupancyGrid* map, Point p, double spread_mm, double spread_deg, int n, int threads)
+{
+    l->map = map;
+    l->current = 0;
+    l->threads = threads < 1 ? 1 : (threads > MCL_MAX_THREADS ? MCL_MAX_THREADS : threads);
+    l->seed = 2463534242u;
+    l->moved_mm = 0;
+    l->turned_deg = 0;
+    l->pool.started = 0;
+    if (n > MCL_MAX_PARTICLES) {
+        n = MCL_MAX_PARTICLES;
+    } else if (n < MCL_MIN_PARTICLES) {
+        n = MCL_MIN_PARTICLES;
+    }
+    ParticleSet* s = &l->sets[0];
+    s->n = n;
+    for (int i = 0; i < n; i++) {
+        s->x[i] = (float)p.x + random_gaussian(&l->seed, (float)spread_mm);
+        s->y[i] = (float)p.y + random_gaussian(&l->seed, (float)spread_mm);
+        s->theta[i] = (float)((p.theta + random_gaussian(&l->seed, (float)spread_deg)) * PI / 180.0);
+        s->weight[i] = 1.0f / (float)n;
+    }
+}
+
+void localisation_predict(Localisation* l, double d_l, double d_r)
+{
+    if ((d_l == 0) && (d_r == 0)) {
+        return;
+    }
+    WorkerRange job = { 0 };
+    job.l = l;
+    job.mode = MCL_PREDICT;
+    job.d_l = (float)d_l;
+    job.d_r = (float)d_r;
+    run_workers(l, job);
+    l->moved_mm += fabs(d_l + d_r) / 2.0;
+    l->turned_deg += fabs(d_r - d_l) / distance_wheels_mm * 180.0 / PI;
+}
+
+/**
+ * KLD bound on how many particles we need for k non empty bins
+ */
+int kld_particles(int k)
+{
+    if (k <= 1) {
+        return MCL_MIN_PARTICLES;
+    }
+    double a = 2.0 / (9.0 * (k - 1));
+    double b = 1.0 - a + sqrt(a) * MCL_KLD_Z;
+    int n = (int)ceil((k - 1) / (2.0 * MCL_KLD_EPSILON) * b * b * b);
+    if (n < MCL_MIN_PARTICLES) {
+        return MCL_MIN_PARTICLES;
+    }
+    return n > MCL_MAX_PARTICLES ? MCL_MAX_PARTICLES : n;
+}
+
+#define MCL_BINS_BITS 16
+unsigned int particle_bin(float x, float y, float theta)
+{
+    unsigned int bx = (unsigned int)(int)floorf(x / (float)MCL_BIN_MM);
+    unsigned int by = (unsigned int)(int)floorf(y / (float)MCL_BIN_MM);
+    unsigned int bt = (unsigned int)(int)floorf(theta * (float)(180.0 / PI / MCL_BIN_DEG));
+    return ((bx * 73856093u) ^ (by * 19349663u) ^ (bt * 83492791u)) & ((1u << MCL_BINS_BITS) - 1u);
+}
+
+void resample(Localisation* l)
+{
+    static float cumulative[MCL_MAX_PARTICLES];
+    static unsigned char bins[(1u << MCL_BINS_BITS) / 8];
+    ParticleSet* from = &l->sets[l->current];
+    ParticleSet* to = &l->sets[1 - l->current];
+
+    float total = 0;
+    for (int i = 0; i < from->n; i++) {
+        total += from->weight[i];
+        cumulative[i] = total;
+    }
+
+    memset(bins, 0, sizeof(bins));
+    int k = 0;
+    int n = 0;
+    int needed = MCL_MIN_PARTICLES;
+    while ((n < needed) && (n < MCL_MAX_PARTICLES)) {
+        // Binary search of a random point on the cumulative weights
+        float r = random_uniform(&l->seed) * total;
+        int lo = 0;
+        int hi = from->n - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cumulative[mid] < r) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        to->x[n] = from->x[lo];
+        to->y[n] = from->y[lo];
+        to->theta[n] = from->theta[lo];
+        n++;
+
+        unsigned int bin = particle_bin(from->x[lo], from->y[lo], from->theta[lo]);
+        if (!(bins[bin / 8] & (1u << (bin % 8)))) {
+            bins[bin / 8] |= (unsigned char)(1u << (bin % 8));
+            k++;
+            needed = kld_particles(k);
+        }
+    }
+    to->n = n;
+    for (int i = 0; i < n; i++) {
+        to->weight[i] = 1.0f / (float)n;
+    }
+    l->current = 1 - l->current;
+}
+
+void localisation_correct(Localisation* l, double z_l, double z_r)
+{
+    if ((l->moved_mm < MCL_UPDATE_MM) && (l->turned_deg < MCL_UPDATE_DEG)) {
+        return;
+    }
+    l->moved_mm = 0;
+    l->turned_deg = 0;
+
+    WorkerRange job = { 0 };
+    job.l = l;
+    job.mode = MCL_WEIGHT;
+    job.z_l = (float)z_l;
+    job.z_r = (float)z_r;
+    run_workers(l, job);
+
+    ParticleSet* s = &l->sets[l->current];
+    float total = 0;
+    for (int i = 0; i < s->n; i++) {
+        total += s->weight[i];
+    }
+    if (total <= 0) {
+        // Nothing agrees with the readings, better to keep what we had than divide by zero
+        for (int i = 0; i < s->n; i++) {
+            s->weight[i] = 1.0f / (float)s->n;
+        }
+        return;
+    }
+    float squares = 0;
+    for (int i = 0; i < s->n; i++) {
+        s->weight[i] /= total;
+        squares += s->weight[i] * s->weight[i];
+    }
+    // Effective sample size
+    if (1.0f / squares < (float)s->n / 2.0f) {
+        resample(l);
+    }
+}
+
+void localisation_estimate(const Localisation* l, Point* result)
+{
+    const ParticleSet* s = &l->sets[l->current];
+    double x = 0;
+    double y = 0;
+    double c = 0;
+    double sn = 0;
+    double total = 0;
+    for (int i = 0; i < s->n; i++) {
+        double w = s->weight[i];
+        x += w * s->x[i];
+        y += w * s->y[i];
+        c += w * cos(s->theta[i]);
+        sn += w * sin(s->theta[i]);
+        total += w;
+    }
+    result->x = x / total;
+    result->y = y / total;
+    result->theta = atan2(sn, c) * 180.0 / PI;
+}
+
+int localisation_count(const Localisation* l)
+{
+    return l->sets[l->current].n;
+}
+
+Localisation localisation;
+OccupancyGrid localisation_map;
+bool localisation_enabled = false;
+int last_odometer_l = 0;
+int last_odometer_r = 0;
+
+int start_localisation(Point p_init)
+{
+    if (get_default_var("LOCALISATION", 0) == 0) {
+        return 0;
+    }
+    const char* mapfile = getenv("LOCALISATION_MAP");
+    if (mapfile == NULL) {
+        mapfile = "map.txt";
+    }
+    if (occupancy_load(&localisation_map, mapfile) < 0) {
+        fprintf(stderr, "[ERROR] Could not read %s for localisation\n", mapfile);
+        return -1;
+    }
+    localisation_init(&localisation, &localisation_map, p_init,
+        get_default_var("LOCALISATION_SPREAD_MM", 50),
+        get_default_var("LOCALISATION_SPREAD_DEG", 5),
+        get_default_var("LOCALISATION_PARTICLES", 500),
+        get_default_var("LOCALISATION_THREADS", 1));
+    last_odometer_l = wheelOdometer(SENSOR_L);
+    last_odometer_r = wheelOdometer(SENSOR_R);
+    int workers = localisation_start_workers(&localisation);
+    localisation_enabled = true;
+    fprintf(stderr, "Localisation on %s with %d particles, %d threads\n", mapfile, localisation_count(&localisation), workers + 1);
+    return 0;
+}
+
+void stop_localisation(void)
+{
+    if (!localisation_enabled) {
+        return;
+    }
+    localisation_enabled = false;
+    localisation_stop_workers(&localisation);
+}
+
+void localisation_tick(void)
+{
+    if (!localisation_enabled) {
+        return;
+    }
+    int odometer_l = wheelOdometer(SENSOR_L);
+    int odometer_r = wheelOdometer(SENSOR_R);
+    double d_l = perimeter_wheel_mm * (double)(odometer_l - last_odometer_l) / (double)countsPerLap;
+    double d_r = perimeter_wheel_mm * (double)(odometer_r - last_odometer_r) / (double)countsPerLap;
+    last_odometer_l = odometer_l;
+    last_odometer_r = odometer_r;
+
+    localisation_predict(&localisation, d_l, d_r);
+    localisation_correct(&localisation, proximity_distance_mm(MOTION_SENSOR_L), proximity_distance_mm(MOTION_SENSOR_R));
+}
+
+bool localised_point(Point* result)
+{
+    if (!localisation_enabled) {
+        return false;
+    }
+    localisation_tick();
+    localisation_estimate(&localisation, result);
+    return true;
+}
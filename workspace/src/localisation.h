@@ -0,0 +1,136 @@
+#ifndef LOCALISATION_H
+#define LOCALISATION_H
+
+#include "control.h"
+#include "occupancy.h"
+#include <threads.h>
+
+/**
+ * Monte Carlo localisation against the map.
+ *
+ * Particles are moved with the encoder increments (plus noise) and weighted with how well
+ * the IR distances they would see on the map match the measured ones.
+ * The particle count adapts with KLD sampling: few particles when they agree, more when they spread.
+ */
+
+#define MCL_MAX_PARTICLES 2000
+#define MCL_MIN_PARTICLES 100
+#define MCL_MAX_THREADS 4
+// Below this many particles threads cost more than they save
+#define MCL_PARALLEL_MIN 500
+
+// Motion noise, as a fraction of what each wheel moved
+#define MCL_WHEEL_NOISE 0.1
+// IR distance noise and chance of a random reading
+#define MCL_RANGE_SIGMA_MM 50.0
+#define MCL_RANDOM_READING 0.05
+// We only weigh after moving this much, readings while stopped tell us nothing new
+#define MCL_UPDATE_MM 20.0
+#define MCL_UPDATE_DEG 5.0
+
+// KLD sampling: error bound, upper 1 - delta quantile of the normal, and histogram bin size
+#define MCL_KLD_EPSILON 0.05
+#define MCL_KLD_Z 2.326
+#define MCL_BIN_MM 100.0
+#define MCL_BIN_DEG 10.0
+
+/**
+ * Structure of arrays, so each step is a tight loop over contiguous floats
+ */
+typedef struct {
+    int n;
+    float x[MCL_MAX_PARTICLES];
+    float y[MCL_MAX_PARTICLES];
+    float theta[MCL_MAX_PARTICLES]; // radians
+    float weight[MCL_MAX_PARTICLES];
+    // Scratch space for the expected readings of each particle
+    float expected_l[MCL_MAX_PARTICLES];
+    float expected_r[MCL_MAX_PARTICLES];
+} ParticleSet;
+
+typedef enum {
+    MCL_PREDICT,
+    MCL_WEIGHT,
+} WorkerMode;
+
+typedef struct Localisation Localisation;
+
+/**
+ * One chunk of the particles for one thread
+ */
+typedef struct {
+    Localisation* l;
+    WorkerMode mode;
+    int begin;
+    int end;
+    float d_l;
+    float d_r;
+    float z_l;
+    float z_r;
+    unsigned int seed;
+} WorkerRange;
+
+/**
+ * Threads kept waiting for the chunks of each predict and weight, the calling thread does the first one.
+ * A job is a new generation, the last worker to finish signals done
+ */
+typedef struct {
+    thrd_t threads[MCL_MAX_THREADS];
+    int started; // workers besides the calling thread
+    mtx_t lock;
+    cnd_t wake;
+    cnd_t done;
+    unsigned int generation;
+    int pending;
+    bool stop;
+    WorkerRange ranges[MCL_MAX_THREADS];
+} WorkerPool;
+
+struct Localisation {
+    const OccupancyGrid* map;
+    ParticleSet sets[2];
+    int current;
+    int threads;
+    unsigned int seed;
+    // Motion accumulated since the last weighting
+    double moved_mm;
+    double turned_deg;
+    WorkerPool pool;
+};
+
+/**
+ * Without localisation_start_workers everything runs on the calling thread
+ */
+extern void localisation_init(Localisation* l, const OccupancyGrid* map, Point p, double spread_mm, double spread_deg, int n, int threads);
+/**
+ * Starts threads - 1 workers, returns how many started
+ */
+extern int localisation_start_workers(Localisation* l);
+extern void localisation_stop_workers(Localisation* l);
+
+/**
+ * d_l, d_r: mm moved by each wheel since the last call
+ */
+extern void localisation_predict(Localisation* l, double d_l, double d_r);
+
+/**
+ * z_l, z_r: measured IR distances, IR_MAX_RANGE_MM when nothing is seen
+ */
+extern void localisation_correct(Localisation* l, double z_l, double z_r);
+
+/**
+ * Weighted mean of the particles, theta in degrees like Point
+ */
+extern void localisation_estimate(const Localisation* l, Point* result);
+
+extern int localisation_count(const Localisation* l);
+
+/**
+ * Global filter used by the control loops, enabled with LOCALISATION=1
+ */
+extern int start_localisation(Point p_init);
+extern void stop_localisation(void);
+extern void localisation_tick(void);
+extern bool localised_point(Point* result);
+
+#endif
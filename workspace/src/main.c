@@ -1,7 +1,13 @@
 #include "control.h"
+#include "ekf.h"
 #include "helper.h"
+#include "localisation.h"
+#include "metrics.h"
 #include "motor.h"
+#include "occupancy.h"
 #include "sensors.h"
+#include "state.h"
+#include "sync.h"
 #include <math.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -24,6 +30,42 @@ int get_n_tries(void)
     return get_default_var("N_TRIES", 1);
 }
 
+bool use_reactive_avoidance(void)
+{
+    return get_default_var("REACTIVE_AVOIDANCE", 1) != 0;
+}
+
+// A retry is only worth it when we are further than this many sigmas (plus the tolerance) from the target
+#define RETRY_SIGMAS 2.0
+// How much we trust the particle filter when fusing it into the pose estimate
+#define LOCALISED_SIGMA_MM 30.0
+#define LOCALISED_SIGMA_DEG 3.0
+
+int get_target_tolerance(void)
+{
+    return get_default_var("TARGET_TOLERANCE_MM", 20);
+}
+
+/**
+ * The sigma only counts once the map corrected the estimate. Before that it is the wheels' own drift,
+ * and a retry measured by the same wheels cannot do better than the move did
+ */
+bool is_correction_worth(double distance, const PoseEstimate* estimate, bool corrected)
+{
+    double sigma = corrected ? position_sigma(estimate) : 0.0;
+    return distance > get_target_tolerance() + RETRY_SIGMAS * sigma;
+}
+
+int get_approach_radius(void)
+{
+    return get_default_var("APPROACH_RADIUS_MM", 150);
+}
+
+int get_approach_speed(void)
+{
+    return get_default_var("APPROACH_SPEED", 20);
+}
+
 int get_init_point(Point* init)
 {
     // Read the values of the environment variables
@@ -142,10 +184,13 @@ int main() {
 
 */
 
+Counter move_retries_metric = COUNTER("move_retries_total", "Tries of execute_move_protocol after the first one");
+
 int execute_move_protocol(Point p_init, Point p_target, Point* p_result)
 {
     int speed = get_default_speed();
     int n_tries = get_n_tries();
+    int max_tries = n_tries;
     Point p_now;
     copy_point(p_init, &p_now);
     int result = 0;
@@ -154,6 +199,9 @@ int execute_move_protocol(Point p_init, Point p_target, Point* p_result)
 
     while (n_tries > 0) {
         fprintf(stderr, "EXECUTING TRY %d\n", n_tries);
+        if (n_tries < max_tries) {
+            counter_add(&move_retries_metric, 1);
+        }
         n_tries--;
         result = move_from_to(p_now, p_target, speed, &p_out);
         fprintf(stderr, "RESULT MOVE? %d\n", result);
@@ -163,14 +211,25 @@ int execute_move_protocol(Point p_init, Point p_target, Point* p_result)
             fprintf(stderr, "[WARN] Executing interrupt\n");
             Point p_temp;
 
-            int result = go_around(speed, p_out, &p_temp);
-            if (result == UNKNOWN_ERROR) {
+            if (use_reactive_avoidance()) {
+                result_go_around = move_reactive(p_out, p_target, speed, &p_temp);
+            } else {
+                result_go_around = go_around(speed, p_out, &p_temp);
+            }
+            if (result_go_around == UNKNOWN_ERROR) {
                 fprintf(stderr, "[ERROR] Unkown error going around\n");
-                return result;
+                return result_go_around;
+            }
+            if (result_go_around == STALL) {
+                result = STALL;
             }
-            if (result == INTERRUPT) {
+            if (result_go_around == INTERRUPT) {
                 fprintf(stderr, "[WARN] Interrupt during interrupt\n");
             }
+            if (use_reactive_avoidance() && (result_go_around == CONTROL_OK)) {
+                // The reactive layer keeps heading to the target, so we are done
+                result = CONTROL_OK;
+            }
 
             copy_point(p_temp, &p_out);
         }
@@ -179,12 +238,45 @@ int execute_move_protocol(Point p_init, Point p_target, Point* p_result)
             fprintf(stderr, "Unkown error");
             return result;
         }
+        if (result == STALL) {
+            // Another try would push against the same wheel, tell where we gave up
+            fprintf(stderr, "[ERROR] Wheel stalled or slipping, giving up the move\n");
+            debug_point(p_out, "p_out");
+            break;
+        }
+
+        bool corrected = false;
+        if (localised_point(&p_out)) {
+            debug_point(p_out, "localised");
+            correct_pose_estimate(p_out, LOCALISED_SIGMA_MM, LOCALISED_SIGMA_DEG);
+            corrected = true;
+        }
+        PoseEstimate estimate;
+        pose_estimate(&estimate);
+        debug_estimate(estimate, "pose");
+        if (corrected) {
+            // The fused pose is where we are from here on: the checks, the next try and the result
+            copy_point(estimate.pose, &p_out);
+        }
 
         debug_point(p_out, "p_out");
         debug_point(p_target, "p_target");
         double distance = dist(p_out, p_target);
 
-        if (result == CONTROL_OK) {
+        if ((distance > get_target_tolerance()) && (distance < get_approach_radius())) {
+            // Close enough that a full move_from_to retry would cost more than it fixes. Before the sigma
+            // check, 2 sigma can be wider than the radius and the approach would never run
+            ApproachReport report;
+            result = approach_target(p_out, p_target, get_approach_speed(), get_target_tolerance(), &p_out, &report);
+            break;
+        }
+        if (!is_correction_worth(distance, &estimate, corrected)) {
+            // Closer than we can tell, another try would just chase the noise
+            fprintf(stderr, "CONTROL_OK. d=%f, sigma=%f\n", distance, position_sigma(&estimate));
+            result = CONTROL_OK;
+            break;
+        }
+        if ((result == CONTROL_OK) && (n_tries == 0)) {
             fprintf(stderr, "CONTROL_OK. d=%f\n", distance);
             break;
         }
@@ -201,6 +293,24 @@ int run(int argc, char* argv[])
     int total_parsed = 0;
     Point p_init = { 0.0, 0.0, 0.0 };
     get_init_point(&p_init);
+    start_pose_estimator(p_init);
+    start_wheel_sync();
+    if (start_localisation(p_init) < 0) {
+        return UNKNOWN_ERROR;
+    }
+
+    // Checked before anything moves, a broken program should not leave the robot half way
+    if ((argc >= 3) && (strcmp(argv[1], "program") == 0)) {
+        Program program;
+        if (program_load(argv[2], &program) < 0) {
+            return UNKNOWN_ERROR;
+        }
+        Point p_out;
+        int result = run_program(&program, get_default_speed(), p_init, &p_out);
+        program_free(&program);
+        debug_point(p_out, "program.result");
+        return result;
+    }
 
     int result = 0;
     int nruns = 0;
@@ -229,7 +339,13 @@ int main(int argc, char* argv[])
         return 10;
     }
 
+    register_control_metrics();
+    register_counter(&move_retries_metric);
+    start_mapping();
+    start_state_segment();
     int result = run(argc, argv);
+    stop_mapping();
+    stop_state_segment();
     shutdown();
     return -result;
 }
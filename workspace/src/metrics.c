@@ -0,0 +1,146 @@
+#include "metrics.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+Counter* counters[METRICS_MAX];
+Histogram* histograms[METRICS_MAX];
+atomic_int counter_count = 0;
+atomic_int histogram_count = 0;
+atomic_int metrics_threads = 0;
+_Thread_local int metrics_slot = -1;
+atomic_bool dump_requested = false;
+
+void register_counter(Counter* c)
+{
+    int i = atomic_fetch_add(&counter_count, 1);
+    if (i >= METRICS_MAX) {
+        fprintf(stderr, "[WARN] Too many counters, %s is not dumped\n", c->name);
+        return;
+    }
+    counters[i] = c;
+}
+
+void register_histogram(Histogram* h)
+{
+    int i = atomic_fetch_add(&histogram_count, 1);
+    if (i >= METRICS_MAX) {
+        fprintf(stderr, "[WARN] Too many histograms, %s is not dumped\n", h->name);
+        return;
+    }
+    histograms[i] = h;
+}
+
+int thread_slot(void)
+{
+    if (metrics_slot < 0) {
+        int i = atomic_fetch_add(&metrics_threads, 1);
+        metrics_slot = i < METRICS_THREADS ? i : METRICS_THREADS - 1;
+    }
+    return metrics_slot;
+}
+
+void counter_add(Counter* c, uint64_t n)
+{
+    atomic_fetch_add_explicit(&c->cells[thread_slot()].value, n, memory_order_relaxed);
+}
+
+uint64_t counter_value(const Counter* c)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_THREADS; i++) {
+        total += atomic_load_explicit(&c->cells[i].value, memory_order_relaxed);
+    }
+    return total;
+}
+
+int histogram_bucket(uint32_t value)
+{
+    if (value < (1u << HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    int exponent = 31 - __builtin_clz(value);
+    int sub = (int)(value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+uint32_t histogram_bucket_start(int bucket)
+{
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return (uint32_t)bucket;
+    }
+    int exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint32_t sub = (uint32_t)(bucket & ((1 << HISTOGRAM_SUB_BITS) - 1));
+    return ((1u << HISTOGRAM_SUB_BITS) + sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+void histogram_record(Histogram* h, uint32_t value)
+{
+    HistogramCell* cell = &h->cells[thread_slot()];
+    atomic_fetch_add_explicit(&cell->buckets[histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cell->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cell->sum, value, memory_order_relaxed);
+}
+
+void dump_histogram(FILE* f, const Histogram* h)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name);
+    uint64_t cumulative = 0;
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_THREADS; i++) {
+        sum += atomic_load_explicit(&h->cells[i].sum, memory_order_relaxed);
+    }
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        uint64_t in_bucket = 0;
+        for (int i = 0; i < METRICS_THREADS; i++) {
+            in_bucket += atomic_load_explicit(&h->cells[i].buckets[b], memory_order_relaxed);
+        }
+        if (in_bucket == 0) {
+            continue;
+        }
+        cumulative += in_bucket;
+        // Upper bound of the bucket, inclusive, as the format wants it
+        unsigned long long upper = b + 1 < HISTOGRAM_BUCKETS ? histogram_bucket_start(b + 1) - 1ull : UINT32_MAX;
+        fprintf(f, "%s_bucket{le=\"%llu\"} %llu\n", h->name, upper, (unsigned long long)cumulative);
+    }
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", h->name, (unsigned long long)cumulative);
+    fprintf(f, "%s_sum %llu\n%s_count %llu\n", h->name, (unsigned long long)sum, h->name, (unsigned long long)cumulative);
+}
+
+void metrics_dump(FILE* f)
+{
+    int n_counters = atomic_load(&counter_count);
+    for (int i = 0; i < n_counters && i < METRICS_MAX; i++) {
+        const Counter* c = counters[i];
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", c->name, c->help, c->name, c->name, (unsigned long long)counter_value(c));
+    }
+    int n_histograms = atomic_load(&histogram_count);
+    for (int i = 0; i < n_histograms && i < METRICS_MAX; i++) {
+        dump_histogram(f, histograms[i]);
+    }
+    fflush(f);
+}
+
+void metrics_request_dump(void)
+{
+    atomic_store(&dump_requested, true);
+}
+
+void metrics_dump_file(void)
+{
+    const char* path = getenv("METRICS_FILE");
+    FILE* f = path != NULL ? fopen(path, "w") : NULL;
+    if (path != NULL && f == NULL) {
+        fprintf(stderr, "[WARN] Could not write the metrics on %s\n", path);
+    }
+    metrics_dump(f != NULL ? f : stderr);
+    if (f != NULL) {
+        fclose(f);
+    }
+}
+
+void metrics_poll(void)
+{
+    if (atomic_exchange(&dump_requested, false)) {
+        metrics_dump_file();
+    }
+}
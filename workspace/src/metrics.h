@@ -0,0 +1,77 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/**
+ * Counters and latency histograms, cheap enough for the sensor thread.
+ *
+ * Each thread adds into its own cache line of a metric (relaxed atomics, no sharing between
+ * the sensor and control threads), and the dump adds the lines up. Histograms are HDR-like:
+ * exact below 8, then 8 buckets per power of two, so any value is within 12.5%.
+ * Metrics are globals of the module that owns them, registered once at start, and dumped
+ * at shutdown or on SIGUSR1 in the Prometheus text format.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_THREADS 8 // more threads than this share the last slots, still correct, just shared
+#define METRICS_MAX 32
+#define METRICS_CACHE_LINE 64
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t value;
+} CounterCell;
+
+typedef struct {
+    const char* name;
+    const char* help;
+    CounterCell cells[METRICS_THREADS];
+} Counter;
+
+typedef struct {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint32_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+} HistogramCell;
+
+typedef struct {
+    const char* name; // values in us
+    const char* help;
+    HistogramCell cells[METRICS_THREADS];
+} Histogram;
+
+#define COUNTER(metric_name, metric_help) { .name = (metric_name), .help = (metric_help) }
+#define HISTOGRAM(metric_name, metric_help) { .name = (metric_name), .help = (metric_help) }
+
+extern void register_counter(Counter* c);
+extern void register_histogram(Histogram* h);
+
+extern void counter_add(Counter* c, uint64_t n);
+extern void histogram_record(Histogram* h, uint32_t value);
+extern uint64_t counter_value(const Counter* c);
+
+extern int histogram_bucket(uint32_t value);
+/**
+ * Smallest value that falls in the bucket
+ */
+extern uint32_t histogram_bucket_start(int bucket);
+
+extern void metrics_dump(FILE* f);
+/**
+ * Safe from a signal handler, the dump happens on the next metrics_poll
+ */
+extern void metrics_request_dump(void);
+/**
+ * Called every tick by the control thread, dumps when asked to (METRICS_FILE or stderr). Not on the
+ * sensor thread, formatting the dump would hold up its samples
+ */
+extern void metrics_poll(void);
+/**
+ * Dump at the end of the program, to METRICS_FILE when set, otherwise stderr
+ */
+extern void metrics_dump_file(void);
+
+#endif
@@ -1,16 +1,41 @@
 #include "motor.h"
+#include "helper.h"
+#include "metrics.h"
+#include "reaction.h"
+#include "trace.h"
 #include "wiringPins.h"
 #include <math.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <threads.h>
 #include <unistd.h>
 #include <wiringPi.h>
 
+atomic_int motor_l_speed = 0;
+atomic_int motor_r_speed = 0;
+PwmChannel channel_l = { .pin = MOTOR_L };
+PwmChannel channel_r = { .pin = MOTOR_R };
+// set_speed and motor_tick come from different threads, a stale frame must not restart a stopped wheel
+mtx_t motor_lock;
+int pwm_tick_us = MIN_TICK_US;
+bool pwm_dither = true;
+int motor_slew_us = MOTOR_SLEW_US;
+MotorStats motor_stats_total = { 0 };
+Counter pwm_writes_metric = COUNTER("pwm_writes_total", "Writes to the PWM registers of both wheels, commands and dither frames");
+
 void cleanup(int* pins, int pinc)
 {
+    MotorStats stats;
+    motor_stats(&stats);
+    if (stats.commands > 0) {
+        fprintf(stderr, "[DEBUG] Motor commands %u, writes %u, skipped %u. Latency us mean %.1f, max %u. Skew us mean %.1f, max %u\n",
+            stats.commands, stats.writes, stats.skipped, (double)stats.latency_total_us / stats.commands, stats.latency_max_us,
+            stats.skewed > 0 ? (double)stats.skew_total_us / stats.skewed : 0.0, stats.skew_max_us);
+    }
     for (int i = 0; i < pinc; i++) {
         pinMode(pins[i], INPUT);
     }
@@ -26,11 +51,11 @@ int duty_cycle(int target_us)
         target_us = SAFETY_MIN_US;
     }
 
-    if (target_us % MIN_TICK_US != 0) {
-        fprintf(stderr, "[WARN] TARGET not a multiple of MIN_TICK :(%d), approximating\n", MIN_TICK_US);
-        return (int)round(target_us / (double)MIN_TICK_US);
+    if (target_us % pwm_tick_us != 0) {
+        fprintf(stderr, "[WARN] TARGET not a multiple of MIN_TICK :(%d), approximating\n", pwm_tick_us);
+        return (int)round(target_us / (double)pwm_tick_us);
     }
-    return target_us / MIN_TICK_US;
+    return target_us / pwm_tick_us;
 }
 
 int set_to_internal(int pin, int target_us)
@@ -48,20 +73,16 @@ int set_to(int pin, int target_us)
 
 int set_wheel_moving(int speed)
 {
-    if (set_speed(MOTOR_L, speed, FORWARD) < 0)
-        return -128;
-    if (set_speed(MOTOR_R, speed, FORWARD) < 0)
-        return -127;
-    return 0;
+    return set_wheels(speed, speed);
 }
 
 int set_wheel_turning(int speed)
 {
-    if (set_speed(MOTOR_L, speed, BACKWARD) < 0)
-        return -120;
-    if (set_speed(MOTOR_R, speed, FORWARD) < 0)
-        return -119;
-    return 0;
+    return set_wheels(-speed, speed);
+}
+int set_wheel_differential(int speed_l, int speed_r)
+{
+    return set_wheels(speed_l, speed_r);
 }
 /**
  * Setup system
@@ -94,14 +115,23 @@ int setup(int* pins, int pinc)
      * the output is high,
      * otherwise the output is low.
      */
+    if (mtx_init(&motor_lock, mtx_plain) != thrd_success) {
+        return -116;
+    }
+    register_counter(&pwm_writes_metric);
     for (int i = 0; i < pinc; i++) {
         pinMode(pins[i], PWM_OUTPUT);
         set_to(pins[i], 0);
     }
 
     pwmSetMode(PWM_MODE_MS);
-    pwmSetClock(PWM_CLOCK);
-    pwmSetRange(PWM_RANGE);
+    bool fine = get_default_var("PWM_FINE", 0) != 0;
+    pwmSetClock(fine ? PWM_CLOCK_FINE : PWM_CLOCK);
+    pwmSetRange(fine ? PWM_RANGE_FINE : PWM_RANGE);
+    pwm_tick_us = fine ? MIN_TICK_FINE_US : MIN_TICK_US;
+    pwm_dither = get_default_var("PWM_DITHER", 1) != 0;
+    motor_slew_us = get_default_var("MOTOR_SLEW_US", MOTOR_SLEW_US);
+    fprintf(stderr, "PWM tick: %d us, dither %d, slew %d us per frame\n", pwm_tick_us, pwm_dither, motor_slew_us);
     // If we had 19.2e6/192/2000  we get 50Hz
     // Minimum tick is then 20ms, 20ms/4000 = 5 mu s
     // Total width is 20 000 mu s
@@ -118,8 +148,6 @@ int setup(int* pins, int pinc)
      */
     return 0;
 }
-atomic_int motor_l_speed = 0;
-atomic_int motor_r_speed = 0;
 
 int get_speed(int pin)
 {
@@ -130,21 +158,12 @@ int get_speed(int pin)
         return motor_r_speed;
     }
 }
+
 /**
- * Once calibrated, we set a number between 0 and 200, it will be rounded to the closest 5
- * CALIBRATION WOULD BE AROUND 1500 us according to spec
- * TODO: Create wrapper set_speed that in a loop modifies the speed to match what we expect
+ * Pulse width in us for a forward speed, 0 stops the servo
  */
-int set_speed(int pin, int speed, Direction direction)
+int speed_to_pulse(int pin, int forward_speed)
 {
-    int forward_speed = direction * speed;
-    if (pin == MOTOR_L) {
-        motor_l_speed = forward_speed;
-    } else if (pin == MOTOR_R) {
-        motor_r_speed = forward_speed;
-        // The right one is looking the opposite way
-    }
-
     // LEFT MOTOR:
     // Clockwise => going back
     // Counter-clockwise => going forward
@@ -159,17 +178,199 @@ int set_speed(int pin, int speed, Direction direction)
     }
 
     if (counter_clockwise_speed == 0) {
-        return set_to(pin, 0);
+        return 0;
     }
 
-    int zero = 1500;
-    int output = zero;
     if (counter_clockwise_speed > 200) {
         counter_clockwise_speed = 200;
     } else if (counter_clockwise_speed < -200) {
         counter_clockwise_speed = -200;
     }
-    output = zero + counter_clockwise_speed;
+    return PULSE_ZERO_US + counter_clockwise_speed;
+}
 
-    return set_to(pin, output);
+int slewed_pulse(int from_us, int to_us, int max_step_us)
+{
+    int from = from_us == 0 ? 0 : from_us - PULSE_ZERO_US;
+    int to = to_us == 0 ? 0 : to_us - PULSE_ZERO_US;
+    if ((max_step_us <= 0) || (to_us == 0)) {
+        return to_us;
+    }
+    // Slowing down is never held back, reversing goes through a stop
+    int base = (from > 0) == (to > 0) ? from : 0;
+    if (abs(to) <= abs(base)) {
+        return to_us;
+    }
+    int step = to - base;
+    if (step > max_step_us) {
+        step = max_step_us;
+    } else if (step < -max_step_us) {
+        step = -max_step_us;
+    }
+    return PULSE_ZERO_US + base + step;
+}
+
+int sigma_delta_step(PwmChannel* c, int tick_us, int frames)
+{
+    if (c->output_us == 0) {
+        c->error_us = 0;
+        return 0;
+    }
+    c->error_us += frames * (c->output_us - c->pwm_register * tick_us);
+    // Can only be off by more than a tick when the output jumped, that is not an error to pay back
+    c->error_us = fmax(-tick_us, fmin(tick_us, c->error_us));
+    return (int)round((c->output_us + c->error_us) / tick_us);
+}
+
+/**
+ * Moves a channel towards a new commanded pulse width, from the closest register. Called with motor_lock held,
+ * returns the register to write, the shadow is only updated once it is written
+ */
+int retarget_channel(PwmChannel* c, int target_us, unsigned int now)
+{
+    if (target_us == c->command_us) {
+        // Same command again, the dither and the trim carry on
+        return c->pwm_register;
+    }
+    c->command_us = target_us;
+    c->target_us = target_us;
+    c->output_us = slewed_pulse(c->output_us, target_us, motor_slew_us);
+    c->error_us = 0;
+    c->frame_ms = now;
+    return (int)round(c->output_us / (double)pwm_tick_us);
+}
+
+/**
+ * 1 when written, 0 when the register already had that value. Called with motor_lock held
+ */
+int write_channel(PwmChannel* c, int pwm_register)
+{
+    if (pwm_register == c->pwm_register) {
+        motor_stats_total.skipped++;
+        return 0;
+    }
+    pwmWrite(c->pin, pwm_register);
+    c->pwm_register = pwm_register;
+    motor_stats_total.writes++;
+    counter_add(&pwm_writes_metric, 1);
+    return 1;
+}
+
+/**
+ * Both channels are computed first and written back to back, so the wheels start together
+ */
+int command_wheels(bool set_l, int speed_l, bool set_r, int speed_r)
+{
+    unsigned int start_us = micros();
+    int pulse_l = speed_to_pulse(MOTOR_L, speed_l);
+    int pulse_r = speed_to_pulse(MOTOR_R, speed_r);
+    unsigned int now = millis();
+
+    TraceSpan write_span = trace_begin("motor_write");
+    mtx_lock(&motor_lock);
+    if (set_l) {
+        motor_l_speed = speed_l;
+    }
+    if (set_r) {
+        motor_r_speed = speed_r;
+    }
+    int register_l = set_l ? retarget_channel(&channel_l, pulse_l, now) : channel_l.pwm_register;
+    int register_r = set_r ? retarget_channel(&channel_r, pulse_r, now) : channel_r.pwm_register;
+    int written_l = write_channel(&channel_l, register_l);
+    unsigned int written_l_us = micros();
+    int written_r = write_channel(&channel_r, register_r);
+    unsigned int end_us = micros();
+
+    unsigned int latency_us = end_us - start_us;
+    motor_stats_total.commands++;
+    motor_stats_total.latency_total_us += latency_us;
+    if (latency_us > motor_stats_total.latency_max_us) {
+        motor_stats_total.latency_max_us = latency_us;
+    }
+    if (written_l && written_r) {
+        unsigned int skew_us = end_us - written_l_us;
+        motor_stats_total.skewed++;
+        motor_stats_total.skew_total_us += skew_us;
+        if (skew_us > motor_stats_total.skew_max_us) {
+            motor_stats_total.skew_max_us = skew_us;
+        }
+    }
+    mtx_unlock(&motor_lock);
+    trace_end(write_span);
+    if ((motor_l_speed == 0) && (motor_r_speed == 0)) {
+        reaction_stopped();
+    }
+
+    return 0;
+}
+
+int set_wheels(int speed_l, int speed_r)
+{
+    return command_wheels(true, speed_l, true, speed_r);
+}
+
+/**
+ * Once calibrated, we set a number between 0 and 200, it will be rounded to the closest 5
+ * CALIBRATION WOULD BE AROUND 1500 us according to spec
+ * Pulses between ticks are dithered by motor_tick
+ */
+int set_speed(int pin, int speed, Direction direction)
+{
+    int forward_speed = direction * speed;
+    if (pin == MOTOR_L) {
+        return command_wheels(true, forward_speed, false, 0);
+    } else if (pin == MOTOR_R) {
+        return command_wheels(false, 0, true, forward_speed);
+    }
+    return -1;
+}
+
+int set_speed_trim(int trim_l, int trim_r)
+{
+    mtx_lock(&motor_lock);
+    // The pulse is in the next frame motor_tick writes
+    channel_l.target_us = speed_to_pulse(MOTOR_L, motor_l_speed == 0 ? 0 : motor_l_speed + trim_l);
+    channel_r.target_us = speed_to_pulse(MOTOR_R, motor_r_speed == 0 ? 0 : motor_r_speed + trim_r);
+    mtx_unlock(&motor_lock);
+    return 0;
+}
+
+/**
+ * Writes the register of the frames that went by since the last one, when it changes. Called with motor_lock held
+ */
+void tick_channel(PwmChannel* c, unsigned int now)
+{
+    int frames = (int)((now - c->frame_ms) / PWM_FRAME_MS);
+    if (frames == 0) {
+        return;
+    }
+    c->frame_ms += (unsigned int)frames * PWM_FRAME_MS;
+    c->output_us = slewed_pulse(c->output_us, c->target_us, motor_slew_us * frames);
+    int pwm_register;
+    if (pwm_dither) {
+        pwm_register = sigma_delta_step(c, pwm_tick_us, frames);
+    } else {
+        pwm_register = (int)round(c->output_us / (double)pwm_tick_us);
+    }
+    if (pwm_register != c->pwm_register) {
+        pwmWrite(c->pin, pwm_register);
+        c->pwm_register = pwm_register;
+        counter_add(&pwm_writes_metric, 1);
+    }
+}
+
+void motor_tick(void)
+{
+    unsigned int now = millis();
+    mtx_lock(&motor_lock);
+    tick_channel(&channel_l, now);
+    tick_channel(&channel_r, now);
+    mtx_unlock(&motor_lock);
+}
+
+void motor_stats(MotorStats* result)
+{
+    mtx_lock(&motor_lock);
+    *result = motor_stats_total;
+    mtx_unlock(&motor_lock);
 }
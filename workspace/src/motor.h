@@ -20,11 +20,48 @@
 // Minimum tick is 20ms, 20ms/2000 = 10 mu s
 // Total width is 20 000 mu s
 #define MIN_TICK_US (1000000 / TEMP_RATIO_CLOCK_PWM) // mu s
+// PWM_FINE=1: same 50Hz with half the clock divider and twice the range, 5 mu s ticks
+#define PWM_CLOCK_FINE 96
+#define PWM_RANGE_FINE 4000
+#define MIN_TICK_FINE_US (1000000 / (CLOCK_SPEED / PWM_CLOCK_FINE)) // mu s
+#define PWM_FRAME_MS (1000 / FREQUENCY)
+#define PULSE_ZERO_US 1500 // mu s, stopped
+// Largest increase of the pulse offset per frame, 0 is no limit. Slowing down and stopping are never limited
+#define MOTOR_SLEW_US 0
 #define SPEC_MIN_US 1300 // mu s
 #define SPEC_MAX_US 1700 // mu s
 #define SAFETY_MIN_US 0 // mu s
 #define SAFETY_MAX_US 10000 // mu s
 
+/**
+ * One servo output. The pulse width asked for is usually between two ticks, so each frame the register
+ * takes whichever of the two pays back the error of the frames before (sigma-delta), and the pulse is right on average
+ */
+typedef struct {
+    int pin;
+    int command_us; // from the last command, 0 stopped
+    int target_us; // with the trim
+    int output_us; // target_us through the slew limit
+    double error_us; // what the frames so far fell short of output_us
+    int pwm_register; // last written
+    unsigned int frame_ms; // when the frame of the last register started
+} PwmChannel;
+
+/**
+ * Since start. Latency is from the command to both registers written, skew between the two writes
+ * of a command that changed both wheels
+ */
+typedef struct {
+    unsigned int commands;
+    unsigned int writes; // registers written by commands, the dither frames are not counted
+    unsigned int skipped; // the register already had the value
+    unsigned int skewed; // commands with both wheels written
+    unsigned long long latency_total_us;
+    unsigned int latency_max_us;
+    unsigned long long skew_total_us;
+    unsigned int skew_max_us;
+} MotorStats;
+
 typedef enum {
     FORWARD = 1,
     BACKWARD = -1,
@@ -36,8 +73,16 @@ extern int duty_cycle(int target_us);
 
 extern int set_to(int pin, int target_us);
 
+/**
+ * Forward speed of each wheel, written back to back. A wheel whose register does not change is not written
+ */
+extern int set_wheels(int speed_l, int speed_r);
 extern int set_wheel_moving(int speed);
 extern int set_wheel_turning(int speed);
+/**
+ * Each wheel gets its own forward speed, used to steer while moving
+ */
+extern int set_wheel_differential(int speed_l, int speed_r);
 
 /**
  * Setup system
@@ -48,5 +93,19 @@ extern int setup(int* pins, int pinc);
  */
 extern int set_speed(int pin, int speed, Direction direction);
 extern int get_speed(int pin);
+/**
+ * Speed units added to each wheel on top of the commanded speed, get_speed is not affected.
+ * The next set_speed of a wheel clears its trim
+ */
+extern int set_speed_trim(int trim_l, int trim_r);
+/**
+ * Register for the next frames of a channel, the target rounded unless it has to pay back error_us
+ */
+extern int sigma_delta_step(PwmChannel* c, int tick_us, int frames);
+/**
+ * Called every sample by the sensor thread, writes the dithered registers once per PWM frame. PWM_DITHER=0 rounds instead
+ */
+extern void motor_tick(void);
+extern void motor_stats(MotorStats* result);
 
 #endif
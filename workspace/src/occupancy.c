@@ -0,0 +1,292 @@
+#include "occupancy.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void occupancy_clear(OccupancyGrid* g, int w, int h)
+{
+    g->w = w;
+    g->h = h;
+    memset(g->fixed, 0, sizeof(g->fixed));
+    memset(g->log_odds, 0, sizeof(g->log_odds));
+}
+
+int occupancy_load(OccupancyGrid* g, const char* mapfile)
+{
+    FILE* f = fopen(mapfile, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    // Rows are read top to bottom, we count the columns on the first one
+    static signed char rows[OCCUPANCY_MAX_H][OCCUPANCY_MAX_W];
+    int w = 0;
+    int h = 0;
+    int x = 0;
+    int value = 0;
+    int c = 0;
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '\n') {
+            if (x > 0) {
+                if ((w != 0) && (x != w)) {
+                    fprintf(stderr, "[ERROR] Map row %d has %d columns, expected %d\n", h, x, w);
+                    fclose(f);
+                    return -2;
+                }
+                w = x;
+                h++;
+            }
+            x = 0;
+            continue;
+        }
+        if (c < '0' || c > '9') {
+            continue;
+        }
+        ungetc(c, f);
+        if ((fscanf(f, "%d", &value) != 1) || (x >= OCCUPANCY_MAX_W) || (h >= OCCUPANCY_MAX_H)) {
+            fprintf(stderr, "[ERROR] Map %s unreadable or bigger than %dx%d\n", mapfile, OCCUPANCY_MAX_W, OCCUPANCY_MAX_H);
+            fclose(f);
+            return -3;
+        }
+        rows[h][x++] = (signed char)value;
+    }
+    if (x > 0) {
+        w = x;
+        h++;
+    }
+    fclose(f);
+
+    occupancy_clear(g, w, h);
+    for (int row = 0; row < h; row++) {
+        memcpy(g->fixed[h - 1 - row], rows[row], (size_t)w);
+    }
+    return 0;
+}
+
+bool occupancy_in_grid(const OccupancyGrid* g, int x, int y)
+{
+    return (x >= 0) && (y >= 0) && (x < g->w) && (y < g->h);
+}
+
+void occupancy_add(OccupancyGrid* g, int x, int y, double increment)
+{
+    if (!occupancy_in_grid(g, x, y)) {
+        return;
+    }
+    double value = g->log_odds[y][x] + increment;
+    if (value > LOG_ODDS_MAX) {
+        value = LOG_ODDS_MAX;
+    } else if (value < -LOG_ODDS_MAX) {
+        value = -LOG_ODDS_MAX;
+    }
+    g->log_odds[y][x] = (float)value;
+}
+
+int mm_to_cell(double mm)
+{
+    return (int)round(mm / OCCUPANCY_CELL_MM);
+}
+
+void occupancy_update(OccupancyGrid* g, Point pose, MotionSensor pin, double distance_mm)
+{
+    double angle = pose.theta * PI / 180.0;
+    double side = (pin == MOTION_SENSOR_L) ? IR_SENSOR_SIDE_MM : -IR_SENSOR_SIDE_MM;
+    double ox = pose.x + IR_SENSOR_FORWARD_MM * cos(angle) - side * sin(angle);
+    double oy = pose.y + IR_SENSOR_FORWARD_MM * sin(angle) + side * cos(angle);
+
+    bool hit = distance_mm < IR_MAX_RANGE_MM;
+    double range = hit ? distance_mm : IR_MAX_RANGE_MM;
+    int hit_x = mm_to_cell(ox + range * cos(angle));
+    int hit_y = mm_to_cell(oy + range * sin(angle));
+
+    // Half cell steps so we never jump over a cell, every cell only once
+    int last_x = -1;
+    int last_y = -1;
+    for (double d = 0; d < range; d += OCCUPANCY_CELL_MM / 2.0) {
+        int x = mm_to_cell(ox + d * cos(angle));
+        int y = mm_to_cell(oy + d * sin(angle));
+        if ((x == last_x) && (y == last_y)) {
+            continue;
+        }
+        last_x = x;
+        last_y = y;
+        if (hit && (x == hit_x) && (y == hit_y)) {
+            break;
+        }
+        occupancy_add(g, x, y, LOG_ODDS_FREE);
+    }
+    if (hit) {
+        occupancy_add(g, hit_x, hit_y, LOG_ODDS_OCCUPIED);
+    }
+}
+
+void occupancy_observe(OccupancyGrid* g, Point pose)
+{
+    occupancy_update(g, pose, MOTION_SENSOR_L, proximity_distance_mm(MOTION_SENSOR_L));
+    occupancy_update(g, pose, MOTION_SENSOR_R, proximity_distance_mm(MOTION_SENSOR_R));
+}
+
+bool occupancy_is_occupied(const OccupancyGrid* g, int x, int y)
+{
+    if (!occupancy_in_grid(g, x, y)) {
+        return false;
+    }
+    return (g->fixed[y][x] > 0) || (g->log_odds[y][x] > LOG_ODDS_SAVE_THRESHOLD);
+}
+
+typedef struct {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} CellBox;
+
+bool boxes_touch(CellBox a, CellBox b)
+{
+    // One cell of margin, the planner does not know what to do with touching rectangles
+    return (a.x0 <= b.x1 + 1) && (b.x0 <= a.x1 + 1) && (a.y0 <= b.y1 + 1) && (b.y0 <= a.y1 + 1);
+}
+
+int occupied_boxes(const OccupancyGrid* g, CellBox* boxes, int max_boxes)
+{
+    static bool seen[OCCUPANCY_MAX_H][OCCUPANCY_MAX_W];
+    static int stack[OCCUPANCY_MAX_H * OCCUPANCY_MAX_W];
+    memset(seen, 0, sizeof(seen));
+    int n = 0;
+
+    // Bounding box of every connected group of occupied cells
+    for (int y = 0; y < g->h; y++) {
+        for (int x = 0; x < g->w; x++) {
+            if (seen[y][x] || !occupancy_is_occupied(g, x, y)) {
+                continue;
+            }
+            if (n >= max_boxes) {
+                return -1;
+            }
+            CellBox box = { x, y, x, y };
+            int top = 0;
+            stack[top++] = y * OCCUPANCY_MAX_W + x;
+            seen[y][x] = true;
+            while (top > 0) {
+                int idx = stack[--top];
+                int cx = idx % OCCUPANCY_MAX_W;
+                int cy = idx / OCCUPANCY_MAX_W;
+                box.x0 = cx < box.x0 ? cx : box.x0;
+                box.x1 = cx > box.x1 ? cx : box.x1;
+                box.y0 = cy < box.y0 ? cy : box.y0;
+                box.y1 = cy > box.y1 ? cy : box.y1;
+                const int nx[4] = { cx + 1, cx - 1, cx, cx };
+                const int ny[4] = { cy, cy, cy + 1, cy - 1 };
+                for (int k = 0; k < 4; k++) {
+                    if (occupancy_in_grid(g, nx[k], ny[k]) && !seen[ny[k]][nx[k]] && occupancy_is_occupied(g, nx[k], ny[k])) {
+                        seen[ny[k]][nx[k]] = true;
+                        stack[top++] = ny[k] * OCCUPANCY_MAX_W + nx[k];
+                    }
+                }
+            }
+            // A rectangle needs two different corners on each axis
+            if (box.x1 == box.x0) {
+                box.x1 = box.x0 + 1 < g->w ? box.x0 + 1 : box.x0;
+                box.x0 = box.x1 - 1;
+            }
+            if (box.y1 == box.y0) {
+                box.y1 = box.y0 + 1 < g->h ? box.y0 + 1 : box.y0;
+                box.y0 = box.y1 - 1;
+            }
+            boxes[n++] = box;
+        }
+    }
+
+    // Merge boxes until none of them touch
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) {
+                if (!boxes_touch(boxes[i], boxes[j])) {
+                    continue;
+                }
+                boxes[i].x0 = boxes[j].x0 < boxes[i].x0 ? boxes[j].x0 : boxes[i].x0;
+                boxes[i].y0 = boxes[j].y0 < boxes[i].y0 ? boxes[j].y0 : boxes[i].y0;
+                boxes[i].x1 = boxes[j].x1 > boxes[i].x1 ? boxes[j].x1 : boxes[i].x1;
+                boxes[i].y1 = boxes[j].y1 > boxes[i].y1 ? boxes[j].y1 : boxes[i].y1;
+                boxes[j] = boxes[--n];
+                merged = true;
+                j = i;
+            }
+        }
+    }
+    return n;
+}
+
+int occupancy_save(const OccupancyGrid* g, const char* mapfile)
+{
+    static CellBox boxes[OCCUPANCY_MAX_H * OCCUPANCY_MAX_W / 4];
+    static signed char out[OCCUPANCY_MAX_H][OCCUPANCY_MAX_W];
+    int n = occupied_boxes(g, boxes, sizeof(boxes) / sizeof(boxes[0]));
+    if (n < 0) {
+        return -1;
+    }
+
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < n; i++) {
+        CellBox b = boxes[i];
+        for (int y = b.y0; y <= b.y1; y++) {
+            for (int x = b.x0; x <= b.x1; x++) {
+                bool corner = ((x == b.x0) || (x == b.x1)) && ((y == b.y0) || (y == b.y1));
+                out[y][x] = corner ? 2 : 1;
+            }
+        }
+    }
+
+    FILE* f = fopen(mapfile, "w");
+    if (f == NULL) {
+        return -2;
+    }
+    for (int y = g->h - 1; y >= 0; y--) {
+        for (int x = 0; x < g->w; x++) {
+            fprintf(f, x == 0 ? "%d" : " %d", out[y][x]);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return 0;
+}
+
+OccupancyGrid learnt_map;
+const char* learnt_map_file = NULL;
+
+int start_mapping(void)
+{
+    learnt_map_file = getenv("OCCUPANCY_MAP");
+    if (learnt_map_file == NULL) {
+        return 0;
+    }
+    if (occupancy_load(&learnt_map, learnt_map_file) < 0) {
+        fprintf(stderr, "[WARN] Could not read %s, starting an empty %dx%d map\n", learnt_map_file, OCCUPANCY_DEFAULT_W, OCCUPANCY_DEFAULT_H);
+        occupancy_clear(&learnt_map, OCCUPANCY_DEFAULT_W, OCCUPANCY_DEFAULT_H);
+    }
+    fprintf(stderr, "Mapping on %s (%dx%d)\n", learnt_map_file, learnt_map.w, learnt_map.h);
+    return 0;
+}
+
+void mapping_observe(Point pose)
+{
+    if (learnt_map_file == NULL) {
+        return;
+    }
+    occupancy_observe(&learnt_map, pose);
+}
+
+int stop_mapping(void)
+{
+    if (learnt_map_file == NULL) {
+        return 0;
+    }
+    if (occupancy_save(&learnt_map, learnt_map_file) < 0) {
+        fprintf(stderr, "[ERROR] Could not save the learnt map on %s\n", learnt_map_file);
+        return -1;
+    }
+    fprintf(stderr, "Saved learnt map on %s\n", learnt_map_file);
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include "control.h"
+#include "sensors.h"
+#include <stdbool.h>
+
+/**
+ * Online occupancy grid, learnt from the IR readings projected through the odometry pose.
+ *
+ * Same cell size and file format as map.txt (see planning/detection.py read_map), so
+ * what we learn in a run can be planned around by the next one.
+ * Memory is fixed: the grid never grows past OCCUPANCY_MAX_W x OCCUPANCY_MAX_H.
+ */
+
+#define OCCUPANCY_CELL_MM 100.0
+#define OCCUPANCY_MAX_W 256
+#define OCCUPANCY_MAX_H 256
+// Size used when there is no map file to start from
+#define OCCUPANCY_DEFAULT_W 42
+#define OCCUPANCY_DEFAULT_H 13
+
+// Log-odds increments of the inverse sensor model, and clamping so cells can still change their mind
+#define LOG_ODDS_OCCUPIED 0.85
+#define LOG_ODDS_FREE -0.4
+#define LOG_ODDS_MAX 3.5
+// Above this the cell is saved as an obstacle (~0.8 probability)
+#define LOG_ODDS_SAVE_THRESHOLD 1.4
+
+typedef struct {
+    int w;
+    int h;
+    // Static map as read from the file, indexed [y][x], y going up
+    signed char fixed[OCCUPANCY_MAX_H][OCCUPANCY_MAX_W];
+    float log_odds[OCCUPANCY_MAX_H][OCCUPANCY_MAX_W];
+} OccupancyGrid;
+
+extern void occupancy_clear(OccupancyGrid* g, int w, int h);
+
+/**
+ * Reads a map.txt file into g, returns < 0 if the file can not be read or is too big
+ */
+extern int occupancy_load(OccupancyGrid* g, const char* mapfile);
+
+/**
+ * Updates the cells along the ray of one sensor reading, seen from pose (mm and degrees)
+ */
+extern void occupancy_update(OccupancyGrid* g, Point pose, MotionSensor pin, double distance_mm);
+
+/**
+ * Both IR sensors at once, with their current readings
+ */
+extern void occupancy_observe(OccupancyGrid* g, Point pose);
+
+extern bool occupancy_is_occupied(const OccupancyGrid* g, int x, int y);
+
+/**
+ * Writes the grid in map.txt format, obstacles as rectangles with corners 2 and inside 1
+ */
+extern int occupancy_save(const OccupancyGrid* g, const char* mapfile);
+
+/**
+ * Global grid used by the control loops, enabled with the OCCUPANCY_MAP environment variable
+ */
+extern int start_mapping(void);
+extern void mapping_observe(Point pose);
+extern int stop_mapping(void);
+
+#endif
@@ -0,0 +1,114 @@
+#include "program.h"
+#include "wiringPins.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+int program_validate(const Program* program)
+{
+    for (int i = 0; i < program->count; i++) {
+        const ProgramStep* step = &program->steps[i];
+        if ((step->speed < -100) || (step->speed > 100)) {
+            fprintf(stderr, "[ERROR] Program step %d: speed %d out of range\n", i, step->speed);
+            return -3;
+        }
+        if (!isfinite(step->param)) {
+            fprintf(stderr, "[ERROR] Program step %d: parameter is not a number\n", i);
+            return -4;
+        }
+        switch (step->type) {
+        case PROGRAM_MOVE:
+            if ((step->param < 0) || (step->param > PROGRAM_MAX_MOVE_MM)) {
+                fprintf(stderr, "[ERROR] Program step %d: move of %f mm\n", i, step->param);
+                return -4;
+            }
+            if (step->preempt > PROGRAM_PREEMPT_OBSTACLE_WAIT) {
+                fprintf(stderr, "[ERROR] Program step %d: unknown preempt %d\n", i, step->preempt);
+                return -5;
+            }
+            break;
+        case PROGRAM_TURN:
+            if (fabsf(step->param) > PROGRAM_MAX_TURN_DEG) {
+                fprintf(stderr, "[ERROR] Program step %d: turn of %f degrees\n", i, step->param);
+                return -4;
+            }
+            // Turns only watch for stalls, there is nothing to wait for
+            if (step->preempt != PROGRAM_PREEMPT_NONE) {
+                fprintf(stderr, "[ERROR] Program step %d: a turn cannot be preempted\n", i);
+                return -5;
+            }
+            break;
+        case PROGRAM_WAIT_CLEAR:
+            if ((step->param <= 0) || (step->preempt != PROGRAM_PREEMPT_NONE)) {
+                fprintf(stderr, "[ERROR] Program step %d: bad wait for a clear way\n", i);
+                return -5;
+            }
+            break;
+        default:
+            fprintf(stderr, "[ERROR] Program step %d: unknown type %d\n", i, step->type);
+            return -6;
+        }
+    }
+    return 0;
+}
+
+int program_read(FILE* f, Program* program)
+{
+    program->steps = NULL;
+    program->count = 0;
+    ProgramHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        fprintf(stderr, "[ERROR] Program too short for its header\n");
+        return -1;
+    }
+    if ((header.magic != PROGRAM_MAGIC) || (header.version != PROGRAM_VERSION)) {
+        fprintf(stderr, "[ERROR] Not a version %d motion program\n", PROGRAM_VERSION);
+        return -1;
+    }
+    if ((header.count == 0) || (header.count > PROGRAM_MAX_STEPS)) {
+        fprintf(stderr, "[ERROR] Program of %d steps, 1 to %d expected\n", header.count, PROGRAM_MAX_STEPS);
+        return -2;
+    }
+    ProgramStep* steps = malloc(sizeof(ProgramStep) * header.count);
+    if (steps == NULL) {
+        return -2;
+    }
+    if (fread(steps, sizeof(ProgramStep), header.count, f) != header.count) {
+        fprintf(stderr, "[ERROR] Program cut short, %d steps expected\n", header.count);
+        free(steps);
+        return -2;
+    }
+    program->steps = steps;
+    program->count = header.count;
+    int error = program_validate(program);
+    if (error < 0) {
+        program_free(program);
+    }
+    return error;
+}
+
+int program_load(const char* path, Program* program)
+{
+    bool is_stdin = strcmp(path, "-") == 0;
+    FILE* f = is_stdin ? stdin : fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] Could not open the program %s\n", path);
+        return -1;
+    }
+    int error = program_read(f, program);
+    if (!is_stdin) {
+        fclose(f);
+    }
+    if (error == 0) {
+        fprintf(stderr, "[DEBUG] Program %s: %d steps\n", path, program->count);
+    }
+    return error;
+}
+
+void program_free(Program* program)
+{
+    free(program->steps);
+    program->steps = NULL;
+    program->count = 0;
+}
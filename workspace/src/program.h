@@ -0,0 +1,62 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+/**
+ * Motion programs: a whole route as one binary array of actions, loaded and checked once
+ * and run as a single sequence of the scheduler, instead of one main per step.
+ *
+ * Little endian, a ProgramHeader and count ProgramSteps right after it, no padding in either.
+ * planning/motion_program.py writes them from a text listing.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROGRAM_MAGIC 0x47504d52 // "RMPG"
+#define PROGRAM_VERSION 1
+#define PROGRAM_MAX_STEPS 4096
+// Sanity limits of the parameters, a step past them is a broken program, not a long route
+#define PROGRAM_MAX_MOVE_MM 20000.0f
+#define PROGRAM_MAX_TURN_DEG 360.0f
+
+typedef enum {
+    PROGRAM_MOVE = 1, // param mm forward
+    PROGRAM_TURN = 2, // param degrees, counter-clockwise positive
+    PROGRAM_WAIT_CLEAR = 3, // stops until nothing is closer than param mm, INTERRUPT when it stays OBSTACLE_WAIT_MS
+} ProgramStepType;
+
+typedef enum {
+    PROGRAM_PREEMPT_NONE = 0,
+    PROGRAM_PREEMPT_OBSTACLE_WAIT = 1, // a move waits for the obstacle to go away and goes on, as move_from_to
+} ProgramPreempt;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+} ProgramHeader;
+
+typedef struct {
+    uint8_t type; // ProgramStepType
+    uint8_t preempt; // ProgramPreempt
+    int16_t speed; // 0 takes SPEED
+    float param;
+} ProgramStep;
+
+typedef struct {
+    ProgramStep* steps;
+    int count;
+} Program;
+
+/**
+ * Reads and validates a whole program, path "-" is stdin. Negative on any error, nothing to free then
+ */
+extern int program_load(const char* path, Program* program);
+extern int program_read(FILE* f, Program* program);
+/**
+ * Negative with the first bad step reported on stderr
+ */
+extern int program_validate(const Program* program);
+extern void program_free(Program* program);
+
+#endif
@@ -0,0 +1,100 @@
+#include "reaction.h"
+#include "helper.h"
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <wiringPi.h>
+
+Histogram reaction_interrupt_metric = HISTOGRAM("obstacle_interrupt_us", "From the IR sample crossing the obstacle threshold to is_obstacle_interrupt");
+Histogram reaction_handled_metric = HISTOGRAM("obstacle_handled_us", "From the IR sample crossing the obstacle threshold to run_actions taking the interrupt");
+Histogram reaction_stop_metric = HISTOGRAM("obstacle_stop_us", "From the IR sample crossing the obstacle threshold to the PWM write stopping the wheels");
+Counter obstacle_steps_metric = COUNTER("obstacle_steps_total", "Synthetic obstacle steps injected, OBSTACLE_STEP_MS");
+
+atomic_int reaction_stage = REACTION_IDLE;
+atomic_uint reaction_tag_us = 0;
+bool reaction_over[2] = { false, false }; // sensor thread only
+int obstacle_step_ms = 0;
+int obstacle_step_hold_ms = OBSTACLE_STEP_HOLD_MS;
+bool obstacle_step_on = false;
+
+void start_reaction_probe(void)
+{
+    register_histogram(&reaction_interrupt_metric);
+    register_histogram(&reaction_handled_metric);
+    register_histogram(&reaction_stop_metric);
+    register_counter(&obstacle_steps_metric);
+    obstacle_step_ms = get_default_var("OBSTACLE_STEP_MS", 0);
+    obstacle_step_hold_ms = get_default_var("OBSTACLE_STEP_HOLD_MS", OBSTACLE_STEP_HOLD_MS);
+    if (obstacle_step_ms > 0) {
+        fprintf(stderr, "[WARN] Synthetic obstacle of %d ms every %d ms, the IR sensors are ignored\n", obstacle_step_hold_ms, obstacle_step_ms);
+    }
+}
+
+bool reaction_stale(unsigned int now_us)
+{
+    return now_us - atomic_load(&reaction_tag_us) > REACTION_TIMEOUT_MS * 1000u;
+}
+
+void reaction_sample(int channel, int measure, int threshold, unsigned int sample_us)
+{
+    bool over = measure >= threshold;
+    bool crossed = over && !reaction_over[channel];
+    reaction_over[channel] = over;
+    if (!crossed) {
+        return;
+    }
+    int stage = atomic_load(&reaction_stage);
+    if ((stage != REACTION_IDLE) && !reaction_stale(sample_us)) {
+        // Already following one, the other channel or a bounce around the threshold
+        return;
+    }
+    // Tag first, the stage publishes it
+    atomic_store(&reaction_tag_us, sample_us);
+    atomic_store(&reaction_stage, REACTION_DETECTED);
+}
+
+/**
+ * Records the stage when the tag is at from, and moves it to to
+ */
+void reaction_advance(ReactionStage from, ReactionStage to, Histogram* h)
+{
+    unsigned int now_us = micros();
+    int expected = from;
+    if (reaction_stale(now_us)) {
+        atomic_compare_exchange_strong(&reaction_stage, &expected, REACTION_IDLE);
+        return;
+    }
+    if (atomic_compare_exchange_strong(&reaction_stage, &expected, to)) {
+        histogram_record(h, now_us - atomic_load(&reaction_tag_us));
+    }
+}
+
+void reaction_interrupt(void)
+{
+    reaction_advance(REACTION_DETECTED, REACTION_INTERRUPTED, &reaction_interrupt_metric);
+}
+
+void reaction_handled(void)
+{
+    reaction_advance(REACTION_INTERRUPTED, REACTION_HANDLED, &reaction_handled_metric);
+}
+
+void reaction_stopped(void)
+{
+    // The stop can come straight from the action that saw the interrupt, or from the interrupt action
+    reaction_advance(REACTION_HANDLED, REACTION_IDLE, &reaction_stop_metric);
+    reaction_advance(REACTION_INTERRUPTED, REACTION_IDLE, &reaction_stop_metric);
+}
+
+int obstacle_step(int measure, int step_reading, unsigned int now_ms)
+{
+    if (obstacle_step_ms <= 0) {
+        return measure;
+    }
+    bool on = (now_ms % (unsigned int)obstacle_step_ms) < (unsigned int)obstacle_step_hold_ms;
+    if (on && !obstacle_step_on) {
+        counter_add(&obstacle_steps_metric, 1);
+    }
+    obstacle_step_on = on;
+    return on ? step_reading : measure;
+}
@@ -0,0 +1,45 @@
+#ifndef REACTION_H
+#define REACTION_H
+
+/**
+ * Obstacle reaction latency: from the IR sample whose raw reading first crosses the obstacle
+ * threshold to the PWM write that stops the wheels.
+ *
+ * The sensor thread tags the sample with micros(), the control thread moves it through
+ * is_obstacle_interrupt and run_actions, and the stop in command_wheels closes it. Each
+ * stage goes into a histogram (see metrics.h), all of them from the same tagged sample.
+ * A tag nothing reacted to within REACTION_TIMEOUT_MS is dropped (a noise spike, the robot not moving).
+ */
+
+#include <stdbool.h>
+
+#define REACTION_TIMEOUT_MS 1000
+// OBSTACLE_STEP_MS > 0 turns the IR readings into a close obstacle every that many ms, for this long
+#define OBSTACLE_STEP_HOLD_MS 500
+
+typedef enum {
+    REACTION_IDLE = 0,
+    REACTION_DETECTED = 1,
+    REACTION_INTERRUPTED = 2,
+    REACTION_HANDLED = 3,
+} ReactionStage;
+
+extern void start_reaction_probe(void);
+
+/**
+ * Sensor thread, every IR sample, channel 0 or 1. sample_us is when the sample was taken
+ */
+extern void reaction_sample(int channel, int measure, int threshold, unsigned int sample_us);
+/**
+ * Control thread, when an obstacle interrupt starts, run_actions takes it and the wheels are stopped
+ */
+extern void reaction_interrupt(void);
+extern void reaction_handled(void);
+extern void reaction_stopped(void);
+
+/**
+ * Reading to use instead of measure, a synthetic obstacle step when OBSTACLE_STEP_MS is set
+ */
+extern int obstacle_step(int measure, int step_reading, unsigned int now_ms);
+
+#endif
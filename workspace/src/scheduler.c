@@ -0,0 +1,155 @@
+#include "scheduler.h"
+#include "helper.h"
+#include "metrics.h"
+#include "reaction.h"
+#include "trace.h"
+#include <stdio.h>
+#include <wiringPi.h>
+
+void task_reset(Task* t)
+{
+    t->started = false;
+    t->tick = 0;
+}
+
+void scheduler_init(Scheduler* s, Task** tasks, int count, unsigned int period_ms)
+{
+    s->tasks = tasks;
+    s->count = count;
+    s->current = 0;
+    s->running = count > 0 ? tasks[0] : NULL;
+    s->n_monitors = 0;
+    s->period_ms = period_ms;
+    s->finished = NULL;
+    s->data = NULL;
+    for (int i = 0; i < count; i++) {
+        task_reset(tasks[i]);
+    }
+}
+
+int scheduler_add_monitor(Scheduler* s, const char* name, unsigned int bit, int (*check)(void))
+{
+    if (s->n_monitors >= SCHEDULER_MONITORS) {
+        fprintf(stderr, "[ERROR] No room for monitor %s\n", name);
+        return UNKNOWN_ERROR;
+    }
+    s->monitors[s->n_monitors] = (Monitor) { .name = name, .bit = bit, .check = check };
+    s->n_monitors++;
+    return CONTROL_OK;
+}
+
+int step_task(Task* t)
+{
+    if (!t->started) {
+        t->started = true;
+        t->tick = 0;
+        int result = t->start(t);
+        if (result != TASK_RUNNING) {
+            return result;
+        }
+    }
+    t->tick++;
+    return t->step(t);
+}
+
+/**
+ * First code of the monitors the task listens to, in the order they were added
+ */
+int check_monitors(Scheduler* s, const Task* t)
+{
+    TraceSpan span = trace_begin("monitors");
+    int code = CONTROL_OK;
+    for (int i = 0; (i < s->n_monitors) && (code == CONTROL_OK); i++) {
+        if (t->monitors & s->monitors[i].bit) {
+            code = s->monitors[i].check();
+            if (code != CONTROL_OK) {
+                fprintf(stderr, "[DEBUG] Monitor %s stops %s: %d\n", s->monitors[i].name, t->name, code);
+            }
+        }
+    }
+    trace_end(span);
+    return code;
+}
+
+/**
+ * The task of the sequence is over, moves to the next one unless it ended the sequence
+ */
+int finish_task(Scheduler* s, int result)
+{
+    Task* task = s->tasks[s->current];
+    if (s->finished != NULL) {
+        result = s->finished(s, task, result);
+    }
+    if (result == RETRY) {
+        task_reset(task);
+        s->running = task;
+        return TASK_RUNNING;
+    }
+    s->current++;
+    if ((result < 0) || (s->current >= s->count)) {
+        s->running = NULL;
+        return result;
+    }
+    s->running = s->tasks[s->current];
+    return TASK_RUNNING;
+}
+
+/**
+ * Steps the running task once, TASK_RUNNING when it keeps running or another task takes over
+ */
+int switch_task(Scheduler* s)
+{
+    Task* task = s->tasks[s->current];
+    int result = step_task(s->running);
+    if (result == TASK_RUNNING) {
+        int code = check_monitors(s, s->running);
+        if (code == CONTROL_OK) {
+            return TASK_RUNNING;
+        }
+        if ((code == INTERRUPT) && (s->running == task) && (task->preempt != NULL)) {
+            reaction_handled();
+            task_reset(task->preempt);
+            s->running = task->preempt;
+            return TASK_RUNNING;
+        }
+        result = code;
+    }
+    if ((s->running != task) && (result == RETRY)) {
+        // The preempting task is over and lets the task go on, from its start
+        task_reset(task);
+        s->running = task;
+        return TASK_RUNNING;
+    }
+    return finish_task(s, result);
+}
+
+int scheduler_tick(Scheduler* s)
+{
+    // A task taking over starts in the same tick, the wheels should not wait a period to stop
+    for (int i = 0; i < SCHEDULER_SWITCHES; i++) {
+        if (s->running == NULL) {
+            return CONTROL_OK;
+        }
+        Task* running = s->running;
+        int result = switch_task(s);
+        if ((result != TASK_RUNNING) || (s->running == running && running->started)) {
+            return result;
+        }
+    }
+    return TASK_RUNNING;
+}
+
+int scheduler_run(Scheduler* s)
+{
+    int result = TASK_RUNNING;
+    while (result == TASK_RUNNING) {
+        unsigned int last_time = millis();
+        result = scheduler_tick(s);
+        if (result == TASK_RUNNING) {
+            // In the slack of the tick, a SIGUSR1 dump should not wait for the end of the move
+            metrics_poll();
+            wait_delay(s->period_ms, last_time);
+        }
+    }
+    return result;
+}
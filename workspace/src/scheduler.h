@@ -0,0 +1,79 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/**
+ * Cooperative scheduler for sequences of actions on the control thread.
+ *
+ * An action is a resumable state machine: start commands the wheels, step does one control tick
+ * and returns TASK_RUNNING until it is done, with its own state kept in the task. Nothing blocks,
+ * the scheduler ticks every period_ms and between the steps runs the monitors (obstacle, stall,
+ * anything else that has to be watched while we move). A monitor firing on a task that listens to
+ * it preempts the task: it runs the task's preempt action in its place, or ends the sequence.
+ */
+
+#include "wiringPins.h"
+#include <stdbool.h>
+
+// Step result of a task that is not done yet, anything else is its result (CONTROL_OK or an error code)
+#define TASK_RUNNING CONTROL_CONTINUE
+#define SCHEDULER_MONITORS 8
+// Task switches in one tick, a flickering monitor could otherwise keep it going
+#define SCHEDULER_SWITCHES 4
+// Task.monitors that listens to every monitor
+#define MONITOR_ALL (~0u)
+
+typedef struct Task Task;
+typedef int (*TaskStep)(Task* task);
+
+struct Task {
+    const char* name;
+    TaskStep start; // TASK_RUNNING, or the result when there is nothing to do
+    TaskStep step;
+    unsigned int monitors; // bits of the monitors that can preempt it
+    /**
+     * Runs in its place when a monitor fires with INTERRUPT. Its RETRY starts the task again,
+     * any other result is taken as the task's. NULL ends the task with the monitor code
+     */
+    Task* preempt;
+    void* data; // for the task functions
+    bool started;
+    int tick; // steps since start
+};
+
+typedef struct {
+    const char* name;
+    unsigned int bit;
+    int (*check)(void); // CONTROL_OK, or the code that preempts the task
+} Monitor;
+
+typedef struct Scheduler Scheduler;
+struct Scheduler {
+    Task** tasks;
+    int count;
+    int current;
+    Task* running; // tasks[current] or the task preempting it
+    Monitor monitors[SCHEDULER_MONITORS];
+    int n_monitors;
+    unsigned int period_ms;
+    /**
+     * After every task of the sequence, with its result. Returns the result to go on with,
+     * RETRY runs the task again, negative ends the sequence. NULL keeps the result
+     */
+    int (*finished)(Scheduler* s, Task* task, int result);
+    void* data; // for finished
+};
+
+extern void scheduler_init(Scheduler* s, Task** tasks, int count, unsigned int period_ms);
+extern int scheduler_add_monitor(Scheduler* s, const char* name, unsigned int bit, int (*check)(void));
+extern void task_reset(Task* t);
+
+/**
+ * One control tick. TASK_RUNNING until the sequence is over, then the result of the last task
+ */
+extern int scheduler_tick(Scheduler* s);
+/**
+ * Ticks every period_ms until the sequence is over
+ */
+extern int scheduler_run(Scheduler* s);
+
+#endif
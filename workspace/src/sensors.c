@@ -3,11 +3,21 @@
  * See https://en.cppreference.com/w/c/thread
  */
 #include "sensors.h"
+#include "capture.h"
+#include "ekf.h"
 #include "helper.h"
+#include "metrics.h"
 #include "motor.h"
+#include "reaction.h"
+#include "state.h"
+#include "sync.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "wiringPi.h"
+#include <math.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <threads.h>
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
@@ -15,11 +25,36 @@
 atomic_bool stop = 0;
 atomic_int counter_l = 0;
 atomic_int counter_r = 0;
+// Never reset, counts backwards when the wheel is commanded backwards
+atomic_int odometer_l = 0;
+atomic_int odometer_r = 0;
+// Thousandths of a slot, edges plus the phase into the current slot. Never reset, reset_count moves the base
+#define FINE_SLOT 1000
+atomic_int fine_count_l = 0;
+atomic_int fine_count_r = 0;
+atomic_int fine_base_l = 0;
+atomic_int fine_base_r = 0;
+
+// micros() when the current sample was taken, what the obstacle reaction probe tags
+unsigned int sample_start_us = 0;
 
 // mm measurements
 atomic_int motion_len_l = 1000000;
 atomic_int motion_len_r = 1000000;
 
+// Filtered raw IR reading, higher is closer
+atomic_int proximity_l = 0;
+atomic_int proximity_r = 0;
+// Thresholds in use, and the noise floor in hundredths of a reading
+atomic_int ignore_level_l = 0;
+atomic_int ignore_level_r = 0;
+atomic_int obstacle_level_l = 0;
+atomic_int obstacle_level_r = 0;
+atomic_int noise_mean_l = 0;
+atomic_int noise_mean_r = 0;
+atomic_int noise_sigma_l = 0;
+atomic_int noise_sigma_r = 0;
+
 /**
  *
 CALIBRATION
@@ -89,6 +124,67 @@ idx, min, max
 #define IGNORE_PROXIMITY_L 200
 #define IGNORE_PROXIMITY_R 200
 
+#define EXP_AVR_WEIGHT 3
+#define MOTION_EXP_AVR_WEIGHT 10
+
+// IR noise floor, fixed point Welford over about the last 40s at the nominal period
+#define NOISE_FRACTION_BITS 16
+#define NOISE_WINDOW 4096
+#define NOISE_WARMUP 50
+// Gaussian cut at mean + sigma: its mean is 0.288 sigma lower, its sigma 0.793 as wide
+#define NOISE_CUT_MEAN_SHIFT 0.288
+#define NOISE_CUT_SIGMA_RATIO 0.793
+#define NOISE_RESET_SIGMAS 4
+// Sigma assumed while there are not enough samples for one
+#define NOISE_START_SIGMA 50.0
+#define NOISE_IGNORE_SIGMAS 3
+#define NOISE_OBSTACLE_SIGMAS 6
+
+// Thresholds at 45% and 55% of the swing, at least +-20 around the middle.
+// A wider band only delays the edges, and late edges get the sign of the next command.
+#define ENCODER_HYSTERESIS 10
+#define ENCODER_MIN_BAND 20
+// ~1s time constant at 100Hz, the slowest speeds still see an edge before the envelope collapses
+#define ENCODER_ENVELOPE_DECAY 10
+
+// Sampling period, as short as SENSOR_SAMPLES_PER_EDGE samples between the slot edges we expect
+#define SENSOR_PERIOD_MIN_MS 2
+#define SENSOR_PERIOD_MAX_MS 20
+#define SENSOR_SAMPLES_PER_EDGE 16
+
+SensorParams sensor_params = {
+    .switch_point_l = SWITCH_POINT_L,
+    .switch_point_r = SWITCH_POINT_R,
+    .exp_avr_weight = EXP_AVR_WEIGHT,
+    .encoder_hysteresis = ENCODER_HYSTERESIS,
+    .encoder_min_band = ENCODER_MIN_BAND,
+    .encoder_envelope_decay = ENCODER_ENVELOPE_DECAY,
+    .motion_exp_avr_weight = MOTION_EXP_AVR_WEIGHT,
+    .obstacle_proximity_l = OBSTACLE_PROXIMITY_L,
+    .obstacle_proximity_r = OBSTACLE_PROXIMITY_R,
+    .ignore_proximity_l = IGNORE_PROXIMITY_L,
+    .ignore_proximity_r = IGNORE_PROXIMITY_R,
+    .noise_ignore_sigmas = NOISE_IGNORE_SIGMAS,
+    .noise_obstacle_sigmas = NOISE_OBSTACLE_SIGMAS,
+};
+
+void load_sensor_params(SensorParams* params)
+{
+    params->switch_point_l = get_default_var("SWITCH_POINT_L", SWITCH_POINT_L);
+    params->switch_point_r = get_default_var("SWITCH_POINT_R", SWITCH_POINT_R);
+    params->exp_avr_weight = get_default_var("EXP_AVR_WEIGHT", EXP_AVR_WEIGHT);
+    params->encoder_hysteresis = get_default_var("ENCODER_HYSTERESIS", ENCODER_HYSTERESIS);
+    params->encoder_min_band = get_default_var("ENCODER_MIN_BAND", ENCODER_MIN_BAND);
+    params->encoder_envelope_decay = get_default_var("ENCODER_ENVELOPE_DECAY", ENCODER_ENVELOPE_DECAY);
+    params->motion_exp_avr_weight = get_default_var("MOTION_EXP_AVR_WEIGHT", MOTION_EXP_AVR_WEIGHT);
+    params->obstacle_proximity_l = get_default_var("OBSTACLE_PROXIMITY_L", OBSTACLE_PROXIMITY_L);
+    params->obstacle_proximity_r = get_default_var("OBSTACLE_PROXIMITY_R", OBSTACLE_PROXIMITY_R);
+    params->ignore_proximity_l = get_default_var("IGNORE_PROXIMITY_L", IGNORE_PROXIMITY_L);
+    params->ignore_proximity_r = get_default_var("IGNORE_PROXIMITY_R", IGNORE_PROXIMITY_R);
+    params->noise_ignore_sigmas = get_default_var("NOISE_IGNORE_SIGMAS", NOISE_IGNORE_SIGMAS);
+    params->noise_obstacle_sigmas = get_default_var("NOISE_OBSTACLE_SIGMAS", NOISE_OBSTACLE_SIGMAS);
+}
+
 bool should_print_sensor(void)
 {
     return get_default_var("DEBUG_SENSORS", 0) != 0;
@@ -96,6 +192,49 @@ bool should_print_sensor(void)
 
 thrd_t t;
 bool debug_print = false;
+bool fine_odometry = true;
+int period_min_ms = SENSOR_PERIOD_MIN_MS;
+int period_max_ms = SENSOR_PERIOD_MAX_MS;
+atomic_int sensor_period = SENSOR_PERIOD_MS;
+
+/**
+ * Same smoothing per ms as weight has per SENSOR_PERIOD_MS sample
+ */
+double weight_for_period(double weight, int period_ms)
+{
+    double alpha = 1.0 - pow(1.0 - 1.0 / weight, (double)period_ms / SENSOR_PERIOD_MS);
+    return 1.0 / alpha;
+}
+
+/**
+ * Period for the next sample, from the commanded speed, or the measured edges when they come faster.
+ * Speeds up at once, slows down a ms per sample so a short pause between actions does not drop the rate.
+ * Recordings stay at the nominal period so tune can replay them.
+ */
+int next_sensor_period(int period_ms, double edge_ms)
+{
+    if (debug_print) {
+        return SENSOR_PERIOD_MS;
+    }
+    int speed = abs(get_speed(MOTOR_L)) > abs(get_speed(MOTOR_R)) ? abs(get_speed(MOTOR_L)) : abs(get_speed(MOTOR_R));
+    double expected_ms = speed > 0 ? SENSOR_EDGE_MS_AT_80 * 80.0 / speed : edge_ms;
+    // Clamped before the cast, a wheel that never moved has an infinite interval
+    double wanted_ms = fmin(expected_ms, edge_ms) / SENSOR_SAMPLES_PER_EDGE;
+    int target = (int)fmax(period_min_ms, fmin(period_max_ms, wanted_ms));
+    if (target < period_ms) {
+        return target;
+    }
+    return target > period_ms ? period_ms + 1 : period_ms;
+}
+
+int sensor_period_ms(void)
+{
+    return sensor_period;
+}
+
+Counter sensor_samples_metric = COUNTER("sensor_samples_total", "Samples of the four ADC channels");
+Counter encoder_edges_metric = COUNTER("encoder_edges_total", "Slot edges counted on both wheels, the rate is edges per second");
+Histogram sensor_sample_metric = HISTOGRAM("sensor_sample_us", "Time the sensor thread spends on a sample, before waiting");
 
 int sensorThread(void* arg)
 {
@@ -103,24 +242,66 @@ int sensorThread(void* arg)
         fprintf(stdout, "adc0, adc1, adc2, adc3\n");
     }
 
+    // Per wheel, ms between the last two edges and when the last one was
+    double edge_interval_l = INFINITY;
+    double edge_interval_r = INFINITY;
+    unsigned int last_edge_l = millis();
+    unsigned int last_edge_r = last_edge_l;
+    trace_thread("sensors");
+
     // TODO: Use https://en.cppreference.com/w/c/chrono/timespec and https://en.cppreference.com/w/c/chrono/timespec_get to get precise delay increments
     while (!stop) {
         unsigned int last_time = millis();
+        unsigned int start_us = micros();
+        TraceSpan sample_span = trace_begin("sample");
+        sample_start_us = start_us;
 
         int adc0 = analogRead(100);
         int adc1 = analogRead(101);
         int adc2 = analogRead(102);
         int adc3 = analogRead(103);
 
+        adc0 = obstacle_step(adc0, distance_to_reading(MOTION_SENSOR_L, IR_MIN_RANGE_MM), last_time);
+        adc1 = obstacle_step(adc1, distance_to_reading(MOTION_SENSOR_R, IR_MIN_RANGE_MM), last_time);
+        TraceSpan filter_span = trace_begin("filter");
         writeMotionCount(MOTION_SENSOR_L, adc0);
         writeMotionCount(MOTION_SENSOR_R, adc1);
-        writeWheelCount(SENSOR_L, adc2);
-        writeWheelCount(SENSOR_R, adc3);
+        if (writeWheelCount(SENSOR_L, adc2) > 0) {
+            counter_add(&encoder_edges_metric, 1);
+            edge_interval_l = last_time - last_edge_l;
+            last_edge_l = last_time;
+        }
+        if (writeWheelCount(SENSOR_R, adc3) > 0) {
+            counter_add(&encoder_edges_metric, 1);
+            edge_interval_r = last_time - last_edge_r;
+            last_edge_r = last_time;
+        }
+        trace_end(filter_span);
+        TraceSpan odometry_span = trace_begin("odometry");
+        ekf_tick();
+        trace_end(odometry_span);
+        TraceSpan motor_span = trace_begin("motor_tick");
+        sync_tick();
+        motor_tick();
+        trace_end(motor_span);
+        state_tick(micros() - start_us);
+        telemetry_sample(start_us, adc0, adc1, adc2, adc3);
+        capture_sample(start_us, adc0, adc1, adc2, adc3);
         if (debug_print) {
             fprintf(stdout, "%d, %d, %d, %d\n", adc0, adc1, adc2, adc3);
         }
-        wait_delay(10, last_time);
+        counter_add(&sensor_samples_metric, 1);
+        histogram_record(&sensor_sample_metric, micros() - start_us);
+        trace_end(sample_span);
+        // A wheel that stopped has its interval growing with the wait for the next edge
+        double edge_ms = fmin(fmax(edge_interval_l, last_time - last_edge_l), fmax(edge_interval_r, last_time - last_edge_r));
+        int period_ms = next_sensor_period(sensor_period, edge_ms);
+        sensor_period = period_ms;
+        // At least period_min_ms, which start_sensors keeps positive
+        wait_delay((unsigned int)period_ms, last_time);
     }
+    stop_telemetry();
+    stop_capture();
     // for speed 80 -> 1v : 1.36s -> 68ms for round(1.36/20*1000)
     return 0;
 }
@@ -141,79 +322,216 @@ int moving_update(double measure, double previous_moving_average, double weight)
 {
     return (weight - 1.0) * previous_moving_average / weight + 1.0 / weight * measure;
 }
-#define EXP_AVR_WEIGHT 3.0
-bool should_sensor_count(double* moving_count, bool* is_high, double switch_point, int measure)
+
+/**
+ * Where in the slot the wheel is, from the level between the middle and the envelope.
+ * Read as a sine: asin of the level while it goes towards the extreme of the slot,
+ * pi minus that once it comes back towards the next edge. Never goes backwards within a slot.
+ */
+void update_slot_phase(WheelFilter* f, double middle, double band)
+{
+    double half_swing = fmax((f->envelope_max - f->envelope_min) / 2.0, band);
+    // Positive towards the extreme of the current slot, whether it is a light or a dark one
+    double q = (f->is_high ? 1.0 : -1.0) * (f->moving_count - middle) / half_swing;
+    double extreme = f->is_high ? fmax(f->slot_extreme, f->moving_count) : fmin(f->slot_extreme, f->moving_count);
+    f->slot_extreme = extreme;
+    if (fabs(extreme - f->moving_count) > band) {
+        f->leaving = true;
+    }
+    double angle = asin(fmax(-1.0, fmin(1.0, q)));
+    if (f->leaving) {
+        angle = PI - angle;
+    }
+    f->phase = fmax(f->phase, angle / PI);
+}
+
+bool should_sensor_count(WheelFilter* f, const SensorParams* p, int period_ms, double switch_point, int measure)
 {
-    (*moving_count) = moving_update(measure, *moving_count, EXP_AVR_WEIGHT);
-    bool new_is_high = (*moving_count) > switch_point;
-    if (new_is_high != *is_high) {
-        *is_high = new_is_high;
-        return true;
+    if (!f->started) {
+        f->moving_count = measure;
+        f->envelope_min = fmin(switch_point, measure);
+        f->envelope_max = fmax(switch_point, measure);
+        f->is_high = measure > switch_point;
+        f->slot_extreme = measure;
+        f->started = true;
+        return false;
     }
-    return false;
+    f->moving_count = moving_update(measure, f->moving_count, p->exp_avr_weight);
+    double x = f->moving_count;
+
+    // Jumps out to new extremes, slowly shrinks back towards the signal otherwise.
+    // The average is per sample, faster sampling follows the edges better, the decay is per SENSOR_PERIOD_MS
+    double decay = 1.0 - pow(1.0 - p->encoder_envelope_decay / 1000.0, (double)period_ms / SENSOR_PERIOD_MS);
+    f->envelope_max = (x > f->envelope_max) ? x : f->envelope_max - decay * (f->envelope_max - x);
+    f->envelope_min = (x < f->envelope_min) ? x : f->envelope_min + decay * (x - f->envelope_min);
+
+    double middle = (f->envelope_max + f->envelope_min) / 2.0;
+    double band = fmax(p->encoder_hysteresis / 100.0 * (f->envelope_max - f->envelope_min) / 2.0, p->encoder_min_band);
+    bool new_is_high = f->is_high ? (x > middle - band) : (x > middle + band);
+    bool edge = new_is_high != f->is_high;
+    if (edge) {
+        f->is_high = new_is_high;
+        f->edges++;
+        f->slot_extreme = x;
+        f->leaving = false;
+        f->phase = 0;
+    }
+    update_slot_phase(f, middle, band);
+    return edge;
 }
 
+/**
+ * 1 when the sample was a slot edge
+ */
 int writeWheelCount(WheelSensor pin, int measure)
 {
-    static double moving_count_l = 0;
-    static double moving_count_r = 0;
-    static bool is_high_l = true;
-    static bool is_high_r = false;
+    static WheelFilter filter_l = { 0 };
+    static WheelFilter filter_r = { 0 };
+    bool edge;
     switch (pin) {
     case SENSOR_L:
-        if (should_sensor_count(&moving_count_l, &is_high_l, SWITCH_POINT_L, measure)) {
+        edge = should_sensor_count(&filter_l, &sensor_params, sensor_period, sensor_params.switch_point_l, measure);
+        if (edge) {
             counter_l++;
+            odometer_l += get_speed(MOTOR_L) >= 0 ? 1 : -1;
         }
-        return 0;
+        fine_count_l = (int)round(FINE_SLOT * (filter_l.edges + filter_l.phase));
+        return edge;
     case SENSOR_R:
-        if (should_sensor_count(&moving_count_r, &is_high_r, SWITCH_POINT_R, measure)) {
+        edge = should_sensor_count(&filter_r, &sensor_params, sensor_period, sensor_params.switch_point_r, measure);
+        if (edge) {
             counter_r++;
+            odometer_r += get_speed(MOTOR_R) >= 0 ? 1 : -1;
         }
-        return 0;
+        fine_count_r = (int)round(FINE_SLOT * (filter_r.edges + filter_r.phase));
+        return edge;
     default:
         return -1;
     }
 }
 
-#define MOTION_EXP_AVR_WEIGHT 10
-bool is_object_nearby(double* moving_count, double switch_point, int measure)
+void welford_update(Welford* w, int x)
+{
+    int64_t x_fixed = (int64_t)x << NOISE_FRACTION_BITS;
+    if (w->n == 0) {
+        w->m2 = 0;
+    }
+    if (w->n < NOISE_WINDOW) {
+        w->n++;
+    } else {
+        // Forget a sample's worth, the same as if the oldest one left the window
+        w->m2 -= w->m2 / w->n;
+    }
+    int64_t delta = x_fixed - w->mean;
+    w->mean += delta / w->n;
+    w->m2 += (delta * (x_fixed - w->mean)) >> NOISE_FRACTION_BITS;
+}
+
+double welford_mean(const Welford* w)
 {
-    (*moving_count) = moving_update(measure, *moving_count, MOTION_EXP_AVR_WEIGHT);
-    bool is_nearby = (*moving_count) > switch_point;
-    return is_nearby;
+    return (double)w->mean / (1 << NOISE_FRACTION_BITS);
+}
+
+double welford_variance(const Welford* w)
+{
+    if (w->n < 2) {
+        return 0;
+    }
+    return (double)(w->m2 / w->n) / (1 << NOISE_FRACTION_BITS);
+}
+
+void noise_floor_update(NoiseFloor* nf, int measure)
+{
+    if (nf->level.n == 0) {
+        nf->step.n = 0;
+    } else {
+        welford_update(&nf->step, measure - nf->last);
+    }
+    welford_update(&nf->level, measure);
+    nf->last = measure;
+}
+
+/**
+ * Once warm, only the samples below mean + sigma go in (see filter_proximity), objects in range are above the noise and never pull it up.
+ * The mean and sigma of that cut distribution are corrected back here, as if the noise was gaussian.
+ * A step between two independent samples has twice the variance of one.
+ */
+bool noise_floor_warm(const NoiseFloor* nf, double* mean, double* sigma)
+{
+    *sigma = sqrt(welford_variance(&nf->step) / 2.0) / NOISE_CUT_SIGMA_RATIO;
+    *mean = welford_mean(&nf->level) + NOISE_CUT_MEAN_SHIFT * *sigma;
+    return nf->level.n >= NOISE_WARMUP;
+}
+
+int filter_proximity(ProximityFilter* f, const SensorParams* p, int ignore, int obstacle, double weight, int measure)
+{
+    double mean;
+    double sigma;
+    bool warm = noise_floor_warm(&f->noise, &mean, &sigma);
+    // Far below the floor, what we learnt was something in front (or the light went off), start again
+    double cut_sigma = warm ? sigma : fmax(sigma, NOISE_START_SIGMA);
+    if ((f->noise.level.n > 0) && (measure < mean - NOISE_RESET_SIGMAS * cut_sigma)) {
+        f->noise.level.n = 0;
+        warm = false;
+    }
+    if ((f->noise.level.n == 0) ? (measure < obstacle) : (measure < mean + cut_sigma)) {
+        noise_floor_update(&f->noise, measure);
+    }
+    f->ignore = ignore;
+    f->obstacle = obstacle;
+    // Raw sigmas also for the obstacle level, the average only sees the readings above ignore
+    if (warm && (p->noise_ignore_sigmas > 0)) {
+        f->ignore = (int)fmax(ignore, round(mean + p->noise_ignore_sigmas * sigma));
+    }
+    if (warm && (p->noise_obstacle_sigmas > 0)) {
+        f->obstacle = (int)fmax(obstacle, round(mean + p->noise_obstacle_sigmas * sigma));
+    }
+    if (f->ignore >= f->obstacle) {
+        f->ignore = f->obstacle - 1;
+    }
+
+    if (measure < f->ignore) {
+        // ignore
+        return 0;
+    }
+    f->moving_count = moving_update(measure, f->moving_count, weight);
+    // for now we just check if higher/lower, we would need to switch this with a proper measurmeent
+    f->nearby = f->moving_count > f->obstacle;
+    return (int)f->moving_count;
 }
 
 int writeMotionCount(MotionSensor pin, int measure)
 {
-    static double motion_sensor_l = 0;
-    static double motion_sensor_r = 0;
+    static ProximityFilter filter_l = { 0 };
+    static ProximityFilter filter_r = { 0 };
+    double weight = weight_for_period(sensor_params.motion_exp_avr_weight, sensor_period);
+    double mean;
+    double sigma;
 
     switch (pin) {
     case MOTION_SENSOR_L:
-        if (measure < IGNORE_PROXIMITY_L) {
-            // ignore
-            return 0;
-        }
-        if (is_object_nearby(&motion_sensor_l, OBSTACLE_PROXIMITY_L, measure)) {
-            // for now we just check if higher/lower, we would need to switch this with a proper measurmeent
-            motion_len_l = 0;
-        } else {
-            motion_len_l = 100000;
+        proximity_l = filter_proximity(&filter_l, &sensor_params, sensor_params.ignore_proximity_l, sensor_params.obstacle_proximity_l, weight, measure);
+        if (proximity_l != 0) {
+            motion_len_l = filter_l.nearby ? 0 : 100000;
         }
-
+        reaction_sample(0, measure, filter_l.obstacle, sample_start_us);
+        ignore_level_l = filter_l.ignore;
+        obstacle_level_l = filter_l.obstacle;
+        noise_floor_warm(&filter_l.noise, &mean, &sigma);
+        noise_mean_l = (int)round(100 * mean);
+        noise_sigma_l = (int)round(100 * sigma);
         return 0;
     case MOTION_SENSOR_R:
-        if (measure < IGNORE_PROXIMITY_R) {
-            // ignore
-            return 0;
-        }
-        if (is_object_nearby(&motion_sensor_r, OBSTACLE_PROXIMITY_R, measure)) {
-            // for now we just check if higher/lower, we would need to switch this with a proper measurmeent
-            motion_len_r = 0;
-        } else {
-            motion_len_r = 100000;
+        proximity_r = filter_proximity(&filter_r, &sensor_params, sensor_params.ignore_proximity_r, sensor_params.obstacle_proximity_r, weight, measure);
+        if (proximity_r != 0) {
+            motion_len_r = filter_r.nearby ? 0 : 100000;
         }
-
+        reaction_sample(1, measure, filter_r.obstacle, sample_start_us);
+        ignore_level_r = filter_r.ignore;
+        obstacle_level_r = filter_r.obstacle;
+        noise_floor_warm(&filter_r.noise, &mean, &sigma);
+        noise_mean_r = (int)round(100 * mean);
+        noise_sigma_r = (int)round(100 * sigma);
         return 0;
     default:
         return -1;
@@ -232,6 +550,182 @@ int wheelCounter(WheelSensor pin)
     }
 }
 
+double wheelCounterFine(WheelSensor pin)
+{
+    switch (pin) {
+    case SENSOR_L:
+        return (double)(fine_count_l - fine_base_l) / FINE_SLOT;
+    case SENSOR_R:
+        return (double)(fine_count_r - fine_base_r) / FINE_SLOT;
+    default:
+        return -1;
+    }
+}
+
+double wheelSlots(WheelSensor pin)
+{
+    switch (pin) {
+    case SENSOR_L:
+        return (double)fine_count_l / FINE_SLOT;
+    case SENSOR_R:
+        return (double)fine_count_r / FINE_SLOT;
+    default:
+        return -1;
+    }
+}
+
+int wheelOdometer(WheelSensor pin)
+{
+    switch (pin) {
+    case SENSOR_L:
+        return odometer_l;
+    case SENSOR_R:
+        return odometer_r;
+    default:
+        return 0;
+    }
+}
+
+int proximity_sensor(MotionSensor pin)
+{
+    switch (pin) {
+    case MOTION_SENSOR_L:
+        return proximity_l;
+    case MOTION_SENSOR_R:
+        return proximity_r;
+    default:
+        return -1;
+    }
+}
+
+double nearness_scale(int proximity, int ignore, int obstacle)
+{
+    double nearness = (double)(proximity - ignore) / (double)(obstacle - ignore);
+    if (nearness < 0.0) {
+        return 0.0;
+    }
+    if (nearness > 1.0) {
+        return 1.0;
+    }
+    return nearness;
+}
+
+double proximity_nearness(MotionSensor pin)
+{
+    return nearness_scale(proximity_sensor(pin), ignore_threshold(pin), obstacle_threshold(pin));
+}
+
+int ignore_threshold(MotionSensor pin)
+{
+    switch (pin) {
+    case MOTION_SENSOR_L:
+        return ignore_level_l != 0 ? ignore_level_l : sensor_params.ignore_proximity_l;
+    case MOTION_SENSOR_R:
+        return ignore_level_r != 0 ? ignore_level_r : sensor_params.ignore_proximity_r;
+    default:
+        return 0;
+    }
+}
+
+int obstacle_threshold(MotionSensor pin)
+{
+    switch (pin) {
+    case MOTION_SENSOR_L:
+        return obstacle_level_l != 0 ? obstacle_level_l : sensor_params.obstacle_proximity_l;
+    case MOTION_SENSOR_R:
+        return obstacle_level_r != 0 ? obstacle_level_r : sensor_params.obstacle_proximity_r;
+    default:
+        return 1;
+    }
+}
+
+double proximity_snr(MotionSensor pin)
+{
+    int proximity = proximity_sensor(pin);
+    int mean = pin == MOTION_SENSOR_L ? noise_mean_l : noise_mean_r;
+    int sigma = pin == MOTION_SENSOR_L ? noise_sigma_l : noise_sigma_r;
+    if ((proximity <= 0) || (sigma == 0)) {
+        return 0.0;
+    }
+    return (100.0 * proximity - mean) / sigma;
+}
+
+typedef struct {
+    double distance_mm;
+    int reading;
+} CalibrationPoint;
+
+// Monotonic part of the calibration table above, from 10cm onwards
+const CalibrationPoint calibration_l[] = {
+    { 100, 810 }, { 110, 740 }, { 120, 690 }, { 130, 636 }, { 140, 597 }, { 150, 565 },
+    { 160, 530 }, { 170, 503 }, { 180, 475 }, { 190, 453 }, { 200, 442 }, { 210, 413 },
+    { 220, 395 }, { 230, 392 }, { 240, 378 }, { 250, 366 }, { 260, 355 }, { 270, 344 },
+    { 280, 330 }, { 290, 324 }, { 300, 308 }, { 350, 266 }, { 400, 243 }, { 450, 229 },
+    { 500, 205 },
+};
+const CalibrationPoint calibration_r[] = {
+    { 100, 434 }, { 110, 367 }, { 120, 348 }, { 130, 320 }, { 140, 291 }, { 150, 270 },
+    { 160, 261 }, { 170, 237 }, { 180, 221 }, { 190, 200 }, { 200, 180 }, { 250, 150 },
+    { 290, 140 }, { 350, 100 },
+};
+
+double interpolate_calibration(const CalibrationPoint* table, int n, int reading)
+{
+    if (reading >= table[0].reading) {
+        return IR_MIN_RANGE_MM;
+    }
+    for (int i = 1; i < n; i++) {
+        if (reading >= table[i].reading) {
+            double ratio = (double)(table[i - 1].reading - reading) / (double)(table[i - 1].reading - table[i].reading);
+            return table[i - 1].distance_mm + ratio * (table[i].distance_mm - table[i - 1].distance_mm);
+        }
+    }
+    return IR_MAX_RANGE_MM;
+}
+
+double reading_to_distance_mm(MotionSensor pin, int reading)
+{
+    switch (pin) {
+    case MOTION_SENSOR_L:
+        return interpolate_calibration(calibration_l, sizeof(calibration_l) / sizeof(calibration_l[0]), reading);
+    case MOTION_SENSOR_R:
+        return interpolate_calibration(calibration_r, sizeof(calibration_r) / sizeof(calibration_r[0]), reading);
+    default:
+        return IR_MAX_RANGE_MM;
+    }
+}
+
+int extrapolate_reading(const CalibrationPoint* table, int n, double distance_mm)
+{
+    if (distance_mm <= table[0].distance_mm) {
+        return table[0].reading;
+    }
+    for (int i = 1; i < n; i++) {
+        if (distance_mm <= table[i].distance_mm) {
+            double ratio = (distance_mm - table[i - 1].distance_mm) / (table[i].distance_mm - table[i - 1].distance_mm);
+            return (int)round(table[i - 1].reading + ratio * (table[i].reading - table[i - 1].reading));
+        }
+    }
+    return table[n - 1].reading;
+}
+
+int distance_to_reading(MotionSensor pin, double distance_mm)
+{
+    switch (pin) {
+    case MOTION_SENSOR_L:
+        return extrapolate_reading(calibration_l, sizeof(calibration_l) / sizeof(calibration_l[0]), distance_mm);
+    case MOTION_SENSOR_R:
+        return extrapolate_reading(calibration_r, sizeof(calibration_r) / sizeof(calibration_r[0]), distance_mm);
+    default:
+        return 0;
+    }
+}
+
+double proximity_distance_mm(MotionSensor pin)
+{
+    return reading_to_distance_mm(pin, proximity_sensor(pin));
+}
+
 bool has_obstacle(int d_mm)
 {
     return ((motion_sensor(MOTION_SENSOR_L) < d_mm) || motion_sensor(MOTION_SENSOR_R) < d_mm);
@@ -241,16 +735,47 @@ int reset_count(WheelSensor pin)
 {
     switch (pin) {
     case SENSOR_L:
+        fine_base_l = fine_count_l;
         return atomic_exchange(&counter_l, 0);
     case SENSOR_R:
+        fine_base_r = fine_count_r;
         return atomic_exchange(&counter_r, 0);
     }
     return -1;
 }
 
+double reset_count_fine(WheelSensor pin)
+{
+    switch (pin) {
+    case SENSOR_L:
+        atomic_exchange(&counter_l, 0);
+        int fine_l = fine_count_l;
+        return (double)(fine_l - atomic_exchange(&fine_base_l, fine_l)) / FINE_SLOT;
+    case SENSOR_R:
+        atomic_exchange(&counter_r, 0);
+        int fine_r = fine_count_r;
+        return (double)(fine_r - atomic_exchange(&fine_base_r, fine_r)) / FINE_SLOT;
+    }
+    return -1;
+}
+
 int start_sensors(void)
 {
     debug_print = should_print_sensor();
+    period_min_ms = get_default_var("SENSOR_PERIOD_MIN_MS", SENSOR_PERIOD_MIN_MS);
+    if (period_min_ms < 1) {
+        fprintf(stderr, "[WARN] SENSOR_PERIOD_MIN_MS %d, sampling every 1 ms instead\n", period_min_ms);
+        period_min_ms = 1;
+    }
+    period_max_ms = get_default_var("SENSOR_PERIOD_MAX_MS", SENSOR_PERIOD_MAX_MS);
+    fine_odometry = get_default_var("FINE_ODOMETRY", 1) != 0;
+    load_sensor_params(&sensor_params);
+    register_counter(&sensor_samples_metric);
+    register_counter(&encoder_edges_metric);
+    register_histogram(&sensor_sample_metric);
+    start_reaction_probe();
+    start_telemetry(getenv("TELEMETRY_HOST"), get_default_var("TELEMETRY_PORT", TELEMETRY_PORT), get_default_var("TELEMETRY_BATCH_MS", TELEMETRY_BATCH_MS));
+    start_capture(getenv("CAPTURE_FILE"), get_default_var("CAPTURE_FLUSH_MS", CAPTURE_FLUSH_MS));
     // Here we set the speed we expect on channel 0. Channels can be either 0 or 1?
     if (wiringPiSPISetup(0, 500000) < 0) {
         return -1;
@@ -280,6 +805,9 @@ int start_sensors(void)
 int ask_stop(void)
 {
     fprintf(stderr, "Asked for sensor stop\n");
+    fprintf(stderr, "[DEBUG] IR noise floor L %.1f +- %.1f, R %.1f +- %.1f; thresholds L %d..%d, R %d..%d\n",
+        noise_mean_l / 100.0, noise_sigma_l / 100.0, noise_mean_r / 100.0, noise_sigma_r / 100.0,
+        ignore_level_l, obstacle_level_l, ignore_level_r, obstacle_level_r);
     stop = 1;
     if (t == NULL)
         return -1;
@@ -4,10 +4,22 @@
 #include "wiringPins.h"
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define SENSOR_PIN_L MOTOR_L
 #define SENSOR_PIN_R MOTOR_R
 
+// Where the IR sensors are on the robot, from the middle of the wheel axis, looking forward
+#define IR_SENSOR_FORWARD_MM 60.0
+#define IR_SENSOR_SIDE_MM 40.0
+// Nominal sampling period, the filter weights are per sample at this period, and recordings use it
+#define SENSOR_PERIOD_MS 10
+// for speed 80 -> 1v : 1.36s -> 68ms for round(1.36/20*1000), about linear below it
+#define SENSOR_EDGE_MS_AT_80 68.0
+// Range of the distance calibration table
+#define IR_MIN_RANGE_MM 100.0
+#define IR_MAX_RANGE_MM 500.0
+
 // You can also do enum EnumAlphabet {A, B, C}... but then you refer to it always as enum EnumAlphabet
 // Here we are declaring an anonymous enum, and setting Sensor as a global alias
 typedef enum {
@@ -19,14 +31,154 @@ typedef enum {
     MOTION_SENSOR_R = SENSOR_PIN_R
 } MotionSensor;
 
+/**
+ * Thresholds of the ADC filters. Compiled in defaults, each one can be overridden with
+ * the environment variable of the same name in upper case (e.g. SWITCH_POINT_L=400)
+ */
+typedef struct {
+    int switch_point_l; // where the encoder thresholds start, before the envelope is learnt
+    int switch_point_r;
+    double exp_avr_weight;
+    int encoder_hysteresis; // percent of the half swing, around the middle of the envelope
+    int encoder_min_band; // ADC units, smallest hysteresis so a stopped wheel does not count noise
+    int encoder_envelope_decay; // per mille per sample the envelope shrinks towards the signal
+    double motion_exp_avr_weight;
+    int obstacle_proximity_l;
+    int obstacle_proximity_r;
+    int ignore_proximity_l;
+    int ignore_proximity_r;
+    int noise_ignore_sigmas; // the IR thresholds are raised to the noise floor plus this many sigmas, 0 keeps them fixed
+    int noise_obstacle_sigmas;
+} SensorParams;
+
+/**
+ * Adaptive Schmitt trigger: the running min/max of the filtered signal sets the thresholds,
+ * so they follow ambient light, and the smaller swing at high slot rates.
+ * Zero initialised, starts at the first sample.
+ */
+typedef struct {
+    double moving_count;
+    bool is_high;
+    double envelope_min;
+    double envelope_max;
+    bool started;
+    int edges; // never reset
+    double phase; // fraction of a slot since the last edge, from the analog level
+    double slot_extreme; // highest (lowest in a dark slot) level since the last edge
+    bool leaving; // past the extreme, going towards the next edge
+} WheelFilter;
+
+/**
+ * Running mean and variance, Welford's method in fixed point (NOISE_FRACTION_BITS of fraction).
+ * The count stops growing at a window, so older samples fade out. n = 0 starts it again.
+ */
+typedef struct {
+    int n;
+    int64_t mean;
+    int64_t m2; // sum of squared deviations
+} Welford;
+
+/**
+ * IR readings with nothing in front: the level from the readings, the noise from the steps between them,
+ * so a slow change (the light, an object sweeping past) moves the level without looking like noise
+ */
+typedef struct {
+    Welford level;
+    Welford step;
+    int last;
+} NoiseFloor;
+
+typedef struct {
+    double moving_count;
+    bool nearby;
+    NoiseFloor noise;
+    int ignore; // thresholds in use, the configured ones raised above the noise floor
+    int obstacle;
+} ProximityFilter;
+
+extern SensorParams sensor_params;
+/**
+ * Odometry uses wheelCounterFine, FINE_ODOMETRY=0 goes back to whole slots
+ */
+extern bool fine_odometry;
+extern void load_sensor_params(SensorParams* params);
+
+/**
+ * One encoder sample through the filter, true when it counts as a slot edge
+ */
+extern bool should_sensor_count(WheelFilter* f, const SensorParams* p, int period_ms, double switch_point, int measure);
+extern void welford_update(Welford* w, int x);
+extern double welford_mean(const Welford* w);
+extern double welford_variance(const Welford* w);
+extern void noise_floor_update(NoiseFloor* nf, int measure);
+/**
+ * Estimate of the noise, false until there are enough samples (mean and sigma are still set)
+ */
+extern bool noise_floor_warm(const NoiseFloor* nf, double* mean, double* sigma);
+/**
+ * One IR sample through the filter, returns the filtered reading or 0 when ignored (f->nearby is kept).
+ * ignore and obstacle are the configured thresholds, the ones used are in f
+ */
+extern int filter_proximity(ProximityFilter* f, const SensorParams* p, int ignore, int obstacle, double weight, int measure);
+
 extern int wheelCounter(WheelSensor pin);
+/**
+ * Same count since reset_count, with the fraction of the slot the wheel is into.
+ * Only as good as the waveform is sine-like, on a flat top it stays around half a slot.
+ */
+extern double wheelCounterFine(WheelSensor pin);
 extern int reset_count(WheelSensor pin);
+/**
+ * reset_count returning wheelCounterFine instead, nothing is lost between the read and the reset
+ */
+extern double reset_count_fine(WheelSensor pin);
+/**
+ * Slots seen since start with the fraction of the current one, not affected by reset_count and never going down
+ */
+extern double wheelSlots(WheelSensor pin);
+/**
+ * Signed count of slots since start, not affected by reset_count
+ */
+extern int wheelOdometer(WheelSensor pin);
 
 extern int motion_sensor(MotionSensor pin);
 
+/**
+ * Filtered IR reading of one channel, the closer the object the higher the value
+ */
+extern int proximity_sensor(MotionSensor pin);
+/**
+ * Same reading scaled between 0 (ignored, far away) and 1 (obstacle distance or closer)
+ */
+extern double proximity_nearness(MotionSensor pin);
+/**
+ * Thresholds in use on one channel, at least the configured ones
+ */
+extern int ignore_threshold(MotionSensor pin);
+extern int obstacle_threshold(MotionSensor pin);
+/**
+ * How many noise sigmas the filtered reading is above the noise floor, 0 when ignored
+ */
+extern double proximity_snr(MotionSensor pin);
+/**
+ * Distance in mm to the object in front of the sensor, interpolated from the calibration table.
+ * Returns IR_MAX_RANGE_MM when nothing is in range, IR_MIN_RANGE_MM when it is closer than we can tell.
+ */
+extern double proximity_distance_mm(MotionSensor pin);
+extern double reading_to_distance_mm(MotionSensor pin, int reading);
+/**
+ * Inverse of reading_to_distance_mm, what the sensor would read at that distance
+ */
+extern int distance_to_reading(MotionSensor pin, double distance_mm);
+
 extern bool has_obstacle(int d_mm);
 
 extern int start_sensors(void);
+/**
+ * Current sampling period of the sensor thread, it follows the commanded speed
+ * between SENSOR_PERIOD_MIN_MS and SENSOR_PERIOD_MAX_MS
+ */
+extern int sensor_period_ms(void);
 /**
  * Ask stop requests the thread to stop
  * It is not guaranteed it will end, doing it correctly is hard.
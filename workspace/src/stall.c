@@ -0,0 +1,85 @@
+#include "stall.h"
+#include "helper.h"
+#include "sensors.h"
+#include <stdlib.h>
+
+void load_stall_params(StallParams* p)
+{
+    p->window_ms = get_default_var("STALL_WINDOW_MS", STALL_WINDOW_MS);
+    p->min_speed = get_default_var("STALL_MIN_SPEED", STALL_MIN_SPEED);
+    p->stall_ratio = get_default_var("STALL_RATIO", STALL_RATIO);
+    p->slip_ratio = get_default_var("SLIP_RATIO", SLIP_RATIO);
+}
+
+void stall_reset(StallWindow* w)
+{
+    w->head = 0;
+    w->n = 0;
+}
+
+double expected_slot_rate(int speed)
+{
+    return abs(speed) * 1000.0 / (SENSOR_EDGE_MS_AT_80 * 80.0);
+}
+
+WheelSample* stall_sample(StallWindow* w, int i)
+{
+    return &w->samples[(w->head + i) % STALL_SAMPLES];
+}
+
+WheelFault stall_update(StallWindow* w, const StallParams* p, unsigned int time_ms, double slots, int speed)
+{
+    if (abs(speed) < p->min_speed) {
+        stall_reset(w);
+        return WHEEL_OK;
+    }
+    // The command of the last sample is the one the wheel got until now
+    double expected = 0;
+    if (w->n > 0) {
+        const WheelSample* last = stall_sample(w, w->n - 1);
+        expected = last->expected + expected_slot_rate(last->speed) * (time_ms - last->time_ms) / 1000.0;
+    }
+    if (w->n == STALL_SAMPLES) {
+        w->head = (w->head + 1) % STALL_SAMPLES;
+        w->n--;
+    }
+    WheelSample* now = stall_sample(w, w->n);
+    now->time_ms = time_ms;
+    now->slots = slots;
+    now->expected = expected;
+    now->speed = speed;
+    w->n++;
+
+    // Keep the newest sample at least a window old as the start, a full buffer is as long as we can look back
+    while ((w->n > 1) && (time_ms - stall_sample(w, 1)->time_ms >= (unsigned int)p->window_ms)) {
+        w->head = (w->head + 1) % STALL_SAMPLES;
+        w->n--;
+    }
+    WheelSample* start = stall_sample(w, 0);
+    unsigned int span_ms = time_ms - start->time_ms;
+    if ((span_ms < (unsigned int)p->window_ms) && (w->n < STALL_SAMPLES)) {
+        return WHEEL_OK;
+    }
+
+    double measured = slots - start->slots;
+    expected -= start->expected;
+    if (measured * 100.0 < expected * p->stall_ratio) {
+        return WHEEL_STALLED;
+    }
+    if (measured * 100.0 > expected * p->slip_ratio) {
+        return WHEEL_SLIPPING;
+    }
+    return WHEEL_OK;
+}
+
+const char* wheel_fault_name(WheelFault fault)
+{
+    switch (fault) {
+    case WHEEL_STALLED:
+        return "stalled";
+    case WHEEL_SLIPPING:
+        return "slipping";
+    default:
+        return "ok";
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef STALL_H
+#define STALL_H
+
+/**
+ * Wheel stall and slip detection.
+ *
+ * Each control tick we get the commanded speed of a wheel and the slots its encoder has seen.
+ * The slots the commands should give (SENSOR_EDGE_MS_AT_80) are integrated tick by tick, so a
+ * command that changes every tick is judged as well as a steady one. Once the wheel has been
+ * commanded above min_speed for a whole window, the slots over the window are compared with the
+ * expected ones: far fewer is a blocked wheel, far more a wheel spinning free. Detection takes at
+ * most the window plus a control tick.
+ */
+
+#include <stdbool.h>
+
+// Window the rates are measured over, and how many control ticks it can hold
+#define STALL_WINDOW_MS 600
+#define STALL_SAMPLES 64
+// Below this the servo deadband decides whether the wheel turns, not the floor
+#define STALL_MIN_SPEED 20
+// Percent of the expected slots, under the first it is stalled, over the second slipping
+#define STALL_RATIO 30
+#define SLIP_RATIO 300
+
+typedef enum {
+    WHEEL_OK = 0,
+    WHEEL_STALLED = 1,
+    WHEEL_SLIPPING = 2,
+} WheelFault;
+
+typedef struct {
+    unsigned int time_ms;
+    double slots;
+    double expected; // slots the commands should have given since the window started
+    int speed; // command from this sample on
+} WheelSample;
+
+/**
+ * Samples since the wheel was last commanded below min_speed, oldest at head. Zero initialised is empty
+ */
+typedef struct {
+    WheelSample samples[STALL_SAMPLES];
+    int head;
+    int n;
+} StallWindow;
+
+typedef struct {
+    int window_ms;
+    int min_speed;
+    int stall_ratio;
+    int slip_ratio;
+} StallParams;
+
+/**
+ * Compiled in defaults, overridden by the environment variables of the same name
+ */
+extern void load_stall_params(StallParams* p);
+extern void stall_reset(StallWindow* w);
+
+/**
+ * Slots per second the commanded speed should give
+ */
+extern double expected_slot_rate(int speed);
+
+/**
+ * Adds one sample and judges the window, WHEEL_OK until the wheel has been commanded for window_ms
+ */
+extern WheelFault stall_update(StallWindow* w, const StallParams* p, unsigned int time_ms, double slots, int speed);
+
+extern const char* wheel_fault_name(WheelFault fault);
+
+#endif
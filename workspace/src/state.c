@@ -0,0 +1,219 @@
+// shm_open, ftruncate and mmap are POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
+
+#include "state.h"
+#include "control.h"
+#include "ekf.h"
+#include "helper.h"
+#include "motor.h"
+#include "sensors.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <unistd.h>
+#include <wiringPi.h>
+
+// Published by main once it is ready, the sensor thread is already running and checks it every sample
+StateSegment* _Atomic state_segment = NULL;
+// Only the writers take it, the sensor thread and main when it stops
+mtx_t state_lock;
+uint32_t state_samples = 0;
+unsigned int velocity_ms = 0;
+double velocity_slots_l = 0;
+double velocity_slots_r = 0;
+double velocity_l = 0;
+double velocity_r = 0;
+
+/**
+ * Seqlock write, called with state_lock held
+ */
+void state_write(const RobotState* state)
+{
+    uint32_t sequence = atomic_load_explicit(&state_segment->sequence, memory_order_relaxed);
+    atomic_store_explicit(&state_segment->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    state_segment->state = *state;
+    atomic_store_explicit(&state_segment->sequence, sequence + 2, memory_order_release);
+}
+
+int start_state_segment(void)
+{
+    if (get_default_var("STATE_SEGMENT", 1) == 0) {
+        return 0;
+    }
+    int fd = shm_open(STATE_SEGMENT_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[WARN] Could not open the state segment %s: %s\n", STATE_SEGMENT_NAME, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(StateSegment)) < 0) {
+        fprintf(stderr, "[WARN] Could not size the state segment %s: %s\n", STATE_SEGMENT_NAME, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    void* memory = mmap(NULL, sizeof(StateSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "[WARN] Could not map the state segment %s: %s\n", STATE_SEGMENT_NAME, strerror(errno));
+        return -1;
+    }
+    if (mtx_init(&state_lock, mtx_plain) != thrd_success) {
+        munmap(memory, sizeof(StateSegment));
+        return -1;
+    }
+    StateSegment* segment = memory;
+    // A run that died half way through a write leaves the sequence odd
+    uint32_t sequence = atomic_load(&segment->sequence);
+    atomic_store(&segment->sequence, (sequence | 1) + 2);
+    atomic_thread_fence(memory_order_release);
+    segment->version = STATE_VERSION;
+    segment->size = sizeof(RobotState);
+    memset(&segment->state, 0, sizeof(RobotState));
+    segment->magic = STATE_MAGIC;
+    atomic_store_explicit(&segment->sequence, (sequence | 1) + 3, memory_order_release);
+
+    velocity_ms = millis();
+    velocity_slots_l = wheelSlots(SENSOR_L);
+    velocity_slots_r = wheelSlots(SENSOR_R);
+    atomic_store_explicit(&state_segment, segment, memory_order_release);
+    fprintf(stderr, "Publishing the robot state on %s\n", STATE_SEGMENT_NAME);
+    return 0;
+}
+
+double wheel_velocity(WheelSensor pin, double slots, double last_slots, unsigned int dt_ms)
+{
+    double sign = get_speed(pin) >= 0 ? 1.0 : -1.0;
+    return sign * perimeter_wheel_mm * (slots - last_slots) / countsPerLap * 1000.0 / dt_ms;
+}
+
+/**
+ * Called with state_lock held
+ */
+void compose_state(RobotState* result, unsigned int loop_us, bool running)
+{
+    RobotState state;
+    state.time_ms = millis();
+    state.samples = ++state_samples;
+
+    PoseEstimate estimate;
+    pose_estimate(&estimate);
+    state.x = estimate.pose.x;
+    state.y = estimate.pose.y;
+    state.theta = estimate.pose.theta;
+    state.position_sigma_mm = position_sigma(&estimate);
+
+    state.odometer_l = wheelOdometer(SENSOR_L);
+    state.odometer_r = wheelOdometer(SENSOR_R);
+    state.slots_l = wheelSlots(SENSOR_L);
+    state.slots_r = wheelSlots(SENSOR_R);
+    unsigned int dt_ms = state.time_ms - velocity_ms;
+    if (dt_ms >= STATE_VELOCITY_MS) {
+        velocity_l = wheel_velocity(SENSOR_L, state.slots_l, velocity_slots_l, dt_ms);
+        velocity_r = wheel_velocity(SENSOR_R, state.slots_r, velocity_slots_r, dt_ms);
+        velocity_ms = state.time_ms;
+        velocity_slots_l = state.slots_l;
+        velocity_slots_r = state.slots_r;
+    }
+    state.velocity_l = velocity_l;
+    state.velocity_r = velocity_r;
+    state.command_l = get_speed(MOTOR_L);
+    state.command_r = get_speed(MOTOR_R);
+
+    state.proximity_l = proximity_sensor(MOTION_SENSOR_L);
+    state.proximity_r = proximity_sensor(MOTION_SENSOR_R);
+    state.obstacles = 0;
+    if (is_obstacle_interrupt()) {
+        state.obstacles |= STATE_OBSTACLE_INTERRUPT;
+    }
+    if (state.proximity_l >= obstacle_threshold(MOTION_SENSOR_L)) {
+        state.obstacles |= STATE_OBSTACLE_L;
+    }
+    if (state.proximity_r >= obstacle_threshold(MOTION_SENSOR_R)) {
+        state.obstacles |= STATE_OBSTACLE_R;
+    }
+    state.sensor_period_ms = sensor_period_ms();
+    state.loop_us = loop_us;
+    state.running = running;
+    *result = state;
+}
+
+void state_tick(unsigned int loop_us)
+{
+    if (atomic_load_explicit(&state_segment, memory_order_acquire) == NULL) {
+        return;
+    }
+    mtx_lock(&state_lock);
+    if (state_segment != NULL) {
+        RobotState state;
+        compose_state(&state, loop_us, true);
+        state_write(&state);
+    }
+    mtx_unlock(&state_lock);
+}
+
+void stop_state_segment(void)
+{
+    if (state_segment == NULL) {
+        return;
+    }
+    mtx_lock(&state_lock);
+    RobotState state;
+    compose_state(&state, state_segment->state.loop_us, false);
+    state_write(&state);
+    StateSegment* segment = state_segment;
+    state_segment = NULL;
+    mtx_unlock(&state_lock);
+    munmap(segment, sizeof(StateSegment));
+}
+
+int state_open(const char* name, const StateSegment** segment)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    if ((fstat(fd, &info) < 0) || ((size_t)info.st_size < sizeof(StateSegment))) {
+        close(fd);
+        return -2;
+    }
+    void* memory = mmap(NULL, sizeof(StateSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return -3;
+    }
+    const StateSegment* mapped = memory;
+    if ((mapped->magic != STATE_MAGIC) || (mapped->version != STATE_VERSION) || (mapped->size != sizeof(RobotState))) {
+        munmap(memory, sizeof(StateSegment));
+        return -4;
+    }
+    *segment = mapped;
+    return 0;
+}
+
+int state_read(const StateSegment* segment, RobotState* result)
+{
+    // The sequence is atomic, but the mapping is read only, so it is only ever loaded
+    _Atomic uint32_t* sequence = (_Atomic uint32_t*)&segment->sequence;
+    for (int i = 0; i < STATE_READ_TRIES; i++) {
+        uint32_t before = atomic_load_explicit(sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        *result = segment->state;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(sequence, memory_order_relaxed) == before) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void state_close(const StateSegment* segment)
+{
+    munmap((void*)segment, sizeof(StateSegment));
+}
@@ -0,0 +1,81 @@
+#ifndef STATE_H
+#define STATE_H
+
+/**
+ * Robot state published in POSIX shared memory for local clients (planner, plotter, health monitor).
+ *
+ * main writes it every sensor sample under a seqlock: the sequence is odd while the writer is
+ * in the middle of an update, and readers copy the state and try again if the sequence moved.
+ * Readers never block the writer. The layout is fixed width and packed the same on every
+ * platform we build on, planning/robot_state.py reads it too, so change both and STATE_VERSION together.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATE_SEGMENT_NAME "/robot-state"
+#define STATE_MAGIC 0x52424f54 // "RBOT"
+#define STATE_VERSION 1
+// Wheel velocities are measured over this long
+#define STATE_VELOCITY_MS 100
+// Attempts of state_read before giving up on a writer that keeps updating
+#define STATE_READ_TRIES 1000
+
+// Bits of RobotState.obstacles
+#define STATE_OBSTACLE_INTERRUPT 1 // what stops a move, see is_obstacle_interrupt
+#define STATE_OBSTACLE_L 2 // IR reading past the obstacle threshold in use
+#define STATE_OBSTACLE_R 4
+
+typedef struct {
+    uint32_t time_ms; // millis() of the sample
+    uint32_t samples; // since start
+    double x; // mm, pose estimate
+    double y;
+    double theta; // degrees
+    double position_sigma_mm;
+    int32_t odometer_l; // signed slots since start, see wheelOdometer
+    int32_t odometer_r;
+    double slots_l; // see wheelSlots
+    double slots_r;
+    double velocity_l; // mm/s, forward positive
+    double velocity_r;
+    int32_t command_l; // commanded speed, see get_speed
+    int32_t command_r;
+    int32_t proximity_l; // filtered IR readings
+    int32_t proximity_r;
+    uint32_t obstacles;
+    int32_t sensor_period_ms;
+    uint32_t loop_us; // time the sensor thread spent on the sample
+    uint32_t running; // 0 once main has stopped, the last state is left in place
+} RobotState;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint32_t sequence;
+    uint32_t size; // sizeof(RobotState)
+    RobotState state;
+} StateSegment;
+
+/**
+ * Writer, main only. STATE_SEGMENT=0 leaves it off
+ */
+extern int start_state_segment(void);
+/**
+ * Called every sample by the sensor thread, loop_us is how long the sample took
+ */
+extern void state_tick(unsigned int loop_us);
+extern void stop_state_segment(void);
+
+/**
+ * Reader. Maps the segment read only, negative when it is not there or from another version
+ */
+extern int state_open(const char* name, const StateSegment** segment);
+/**
+ * Consistent copy of the state, negative when the writer never let go for STATE_READ_TRIES attempts
+ */
+extern int state_read(const StateSegment* segment, RobotState* result);
+extern void state_close(const StateSegment* segment);
+
+#endif
@@ -0,0 +1,80 @@
+#include "sync.h"
+#include "helper.h"
+#include "motor.h"
+#include "sensors.h"
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <wiringPi.h>
+
+void sync_reset(SyncState* s)
+{
+    s->started = false;
+}
+
+/**
+ * Trim of one wheel for its share of the correction, never more than the limit or past stopping it
+ */
+int wheel_trim(int speed, double correction)
+{
+    double limit = abs(speed) * SYNC_MAX_TRIM_PERCENT / 100.0;
+    double trim = fmax(-limit, fmin(limit, correction));
+    return (int)round(speed > 0 ? trim : -trim);
+}
+
+SyncTrim sync_step(SyncState* s, unsigned int time_ms, double slots_l, double slots_r, int speed_l, int speed_r)
+{
+    SyncTrim trim = { 0, 0 };
+    if (!s->started || (s->speed_l != speed_l) || (s->speed_r != speed_r)) {
+        s->started = true;
+        s->speed_l = speed_l;
+        s->speed_r = speed_r;
+        s->base_l = slots_l;
+        s->base_r = slots_r;
+        s->integral = 0;
+        s->last_ms = time_ms;
+        return trim;
+    }
+    if ((speed_l == 0) || (speed_r == 0)) {
+        // Stopped, or pivoting on one wheel, nothing to keep in step
+        return trim;
+    }
+
+    double abs_l = abs(speed_l);
+    double abs_r = abs(speed_r);
+    double fastest = fmax(abs_l, abs_r);
+    // Positive when the left wheel is ahead of where the command says it should be
+    double error = ((slots_l - s->base_l) / abs_l - (slots_r - s->base_r) / abs_r) * fastest;
+    double dt_s = (time_ms - s->last_ms) / 1000.0;
+    s->last_ms = time_ms;
+
+    // Anti-windup, the integral alone can not ask for more than the largest trim
+    double integral_limit = fastest * SYNC_MAX_TRIM_PERCENT / 100.0 / SYNC_KI;
+    s->integral = fmax(-integral_limit, fmin(integral_limit, s->integral + error * dt_s));
+    double correction = SYNC_KP * error + SYNC_KI * s->integral;
+
+    // Half from each wheel, in proportion to its speed so a turn keeps its radius
+    trim.trim_l = wheel_trim(speed_l, -correction / 2.0 * abs_l / fastest);
+    trim.trim_r = wheel_trim(speed_r, correction / 2.0 * abs_r / fastest);
+    return trim;
+}
+
+// Set by the control thread once the sensor thread is running, sync_state is the sensor thread's after that
+atomic_bool sync_started = false;
+SyncState sync_state;
+
+void start_wheel_sync(void)
+{
+    sync_reset(&sync_state);
+    // Release, so the sensor thread sees the reset state along with the flag
+    atomic_store_explicit(&sync_started, get_default_var("SYNC", 1) != 0, memory_order_release);
+}
+
+void sync_tick(void)
+{
+    if (!atomic_load_explicit(&sync_started, memory_order_acquire)) {
+        return;
+    }
+    SyncTrim trim = sync_step(&sync_state, millis(), wheelSlots(SENSOR_L), wheelSlots(SENSOR_R), get_speed(MOTOR_L), get_speed(MOTOR_R));
+    set_speed_trim(trim.trim_l, trim.trim_r);
+}
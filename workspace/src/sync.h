@@ -0,0 +1,50 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+/**
+ * Cross-coupled synchronisation of the wheels.
+ *
+ * Each sample, the slots each wheel turned since the command was set are divided by its commanded speed.
+ * The difference between the two, in slots of the faster wheel, goes through a PI controller and
+ * is taken from the wheel that is ahead and given to the one behind. Going straight that drives
+ * counter_l - counter_r to zero, turning it holds the ratio of the command. The command itself is
+ * not changed, only trimmed, and a new command starts again from zero error.
+ */
+
+#include <stdbool.h>
+
+// Speed units per slot of difference, and per slot and second of accumulated difference
+#define SYNC_KP 6.0
+#define SYNC_KI 10.0
+// Largest trim, percent of the commanded speed of each wheel
+#define SYNC_MAX_TRIM_PERCENT 30
+
+typedef struct {
+    bool started;
+    int speed_l; // command the baseline belongs to
+    int speed_r;
+    double base_l; // slots at the start of the command
+    double base_r;
+    double integral; // slot seconds
+    unsigned int last_ms;
+} SyncState;
+
+typedef struct {
+    int trim_l;
+    int trim_r;
+} SyncTrim;
+
+extern void sync_reset(SyncState* s);
+
+/**
+ * slots_l, slots_r: see wheelSlots. speed_l, speed_r: see get_speed
+ */
+extern SyncTrim sync_step(SyncState* s, unsigned int time_ms, double slots_l, double slots_r, int speed_l, int speed_r);
+
+/**
+ * Global controller, sync_tick is called every sample by the sensor thread once started. SYNC=0 leaves it off
+ */
+extern void start_wheel_sync(void);
+extern void sync_tick(void);
+
+#endif
@@ -0,0 +1,110 @@
+// sockets are POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
+
+#include "telemetry.h"
+#include "ekf.h"
+#include "sensors.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <wiringPi.h>
+
+typedef struct __attribute__((packed)) {
+    TelemetryHeader header;
+    TelemetrySample samples[TELEMETRY_MAX_SAMPLES];
+} TelemetryDatagram;
+
+int telemetry_socket = -1;
+struct sockaddr_in telemetry_address;
+unsigned int telemetry_batch_ms = TELEMETRY_BATCH_MS;
+// Only the sensor thread touches the batch
+TelemetryDatagram telemetry_batch;
+unsigned int batch_start_ms = 0;
+
+int start_telemetry(const char* host, int port, int batch_ms)
+{
+    if (host == NULL) {
+        return 0;
+    }
+    memset(&telemetry_address, 0, sizeof(telemetry_address));
+    telemetry_address.sin_family = AF_INET;
+    telemetry_address.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &telemetry_address.sin_addr) != 1) {
+        fprintf(stderr, "[WARN] TELEMETRY_HOST %s is not an IPv4 address, no telemetry\n", host);
+        return -1;
+    }
+    telemetry_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (telemetry_socket < 0) {
+        fprintf(stderr, "[WARN] Could not open the telemetry socket: %s\n", strerror(errno));
+        return -1;
+    }
+    telemetry_batch_ms = (unsigned int)batch_ms;
+    memset(&telemetry_batch, 0, sizeof(telemetry_batch));
+    telemetry_batch.header.magic = TELEMETRY_MAGIC;
+    telemetry_batch.header.version = TELEMETRY_VERSION;
+    fprintf(stderr, "Telemetry to %s:%d every %u ms\n", host, ntohs(telemetry_address.sin_port), telemetry_batch_ms);
+    return 0;
+}
+
+void send_batch(void)
+{
+    TelemetryHeader* header = &telemetry_batch.header;
+    if (header->count == 0) {
+        return;
+    }
+    size_t size = sizeof(TelemetryHeader) + header->count * sizeof(TelemetrySample);
+    // Never wait for the network, a full socket buffer loses the batch and the receiver sees the gap
+    if (sendto(telemetry_socket, &telemetry_batch, size, MSG_DONTWAIT, (struct sockaddr*)&telemetry_address, sizeof(telemetry_address)) < 0) {
+        header->dropped += header->count;
+    }
+    header->sequence++;
+    header->count = 0;
+}
+
+void telemetry_sample(unsigned int time_us, int adc0, int adc1, int adc2, int adc3)
+{
+    if (telemetry_socket < 0) {
+        return;
+    }
+    unsigned int now = millis();
+    TelemetryHeader* header = &telemetry_batch.header;
+    if (header->count == 0) {
+        batch_start_ms = now;
+    }
+    TelemetrySample* sample = &telemetry_batch.samples[header->count];
+    sample->time_us = time_us;
+    sample->adc[0] = (uint16_t)adc0;
+    sample->adc[1] = (uint16_t)adc1;
+    sample->adc[2] = (uint16_t)adc2;
+    sample->adc[3] = (uint16_t)adc3;
+    sample->slots_l = (int32_t)lround(wheelSlots(SENSOR_L) * 1000.0);
+    sample->slots_r = (int32_t)lround(wheelSlots(SENSOR_R) * 1000.0);
+    PoseEstimate estimate;
+    pose_estimate(&estimate);
+    sample->x = (float)estimate.pose.x;
+    sample->y = (float)estimate.pose.y;
+    sample->theta = (float)estimate.pose.theta;
+    header->count++;
+
+    if ((header->count == TELEMETRY_MAX_SAMPLES) || (now - batch_start_ms >= telemetry_batch_ms)) {
+        send_batch();
+    }
+}
+
+void stop_telemetry(void)
+{
+    if (telemetry_socket < 0) {
+        return;
+    }
+    send_batch();
+    fprintf(stderr, "[DEBUG] Telemetry sent %u datagrams, %u samples dropped\n", telemetry_batch.header.sequence, telemetry_batch.header.dropped);
+    close(telemetry_socket);
+    telemetry_socket = -1;
+}
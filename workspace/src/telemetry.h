@@ -0,0 +1,50 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/**
+ * Sensor samples sent over UDP in binary, for scripts/real-time.py.
+ *
+ * The sensor thread adds every sample to a batch, and the batch goes out as one datagram
+ * every TELEMETRY_BATCH_MS or when it is full. Datagrams are numbered, so the receiver can
+ * tell how many got lost. Little endian, no padding: real-time.py unpacks the same layout,
+ * change both and TELEMETRY_VERSION together.
+ */
+
+#include <stdint.h>
+
+#define TELEMETRY_MAGIC 0x544c4d52 // "RMLT"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_PORT 5005
+#define TELEMETRY_BATCH_MS 50
+// Keeps a datagram under a 1500 byte MTU
+#define TELEMETRY_MAX_SAMPLES 40
+
+typedef struct __attribute__((packed)) {
+    uint32_t time_us; // micros() when the ADC was read
+    uint16_t adc[4]; // raw readings, channels 100 to 103
+    int32_t slots_l; // wheelSlots in thousandths
+    int32_t slots_r;
+    float x; // mm, pose estimate
+    float y;
+    float theta; // degrees
+} TelemetrySample;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count; // samples that follow
+    uint32_t sequence; // datagram number, since start
+    uint32_t dropped; // samples that could not be sent since start
+} TelemetryHeader;
+
+/**
+ * Sends to host (IPv4 address) on port, off when host is NULL. batch_ms is how long a batch waits
+ */
+extern int start_telemetry(const char* host, int port, int batch_ms);
+extern void telemetry_sample(unsigned int time_us, int adc0, int adc1, int adc2, int adc3);
+/**
+ * Sends what is left in the batch
+ */
+extern void stop_telemetry(void);
+
+#endif
@@ -0,0 +1,156 @@
+#include "trace.h"
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <wiringPi.h>
+
+bool trace_enabled = false;
+const char* trace_path = NULL;
+int trace_capacity = TRACE_EVENTS;
+_Atomic(TraceBuffer*) trace_buffers[TRACE_THREADS];
+atomic_int trace_buffer_count = 0;
+_Thread_local TraceBuffer* trace_buffer = NULL;
+_Thread_local bool trace_full = false; // no buffer left for this thread
+
+void start_trace(void)
+{
+    trace_path = getenv("TRACE_FILE");
+    trace_capacity = get_default_var("TRACE_EVENTS", TRACE_EVENTS);
+    trace_enabled = (trace_path != NULL) && (trace_capacity > 0);
+    if (trace_enabled) {
+        fprintf(stderr, "[DEBUG] Tracing up to %d events per thread into %s\n", trace_capacity, trace_path);
+    }
+}
+
+TraceBuffer* thread_buffer(void)
+{
+    if ((trace_buffer != NULL) || trace_full) {
+        return trace_buffer;
+    }
+    int tid = atomic_fetch_add(&trace_buffer_count, 1);
+    if (tid >= TRACE_THREADS) {
+        fprintf(stderr, "[WARN] More than %d threads traced, the rest is left out\n", TRACE_THREADS);
+        trace_full = true;
+        return NULL;
+    }
+    TraceBuffer* b = calloc(1, sizeof(TraceBuffer));
+    TraceEvent* events = malloc(sizeof(TraceEvent) * (size_t)trace_capacity);
+    if ((b == NULL) || (events == NULL)) {
+        fprintf(stderr, "[WARN] No memory for the trace of a thread\n");
+        free(b);
+        free(events);
+        trace_full = true;
+        return NULL;
+    }
+    b->tid = tid;
+    b->capacity = trace_capacity;
+    b->events = events;
+    trace_buffer = b;
+    atomic_store(&trace_buffers[tid], b);
+    return b;
+}
+
+void trace_record(const char* name, uint32_t start_us, uint32_t duration_us, int32_t arg)
+{
+    TraceBuffer* b = thread_buffer();
+    if (b == NULL) {
+        return;
+    }
+    int i = atomic_load_explicit(&b->count, memory_order_relaxed);
+    if (i >= b->capacity) {
+        atomic_fetch_add_explicit(&b->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    b->events[i] = (TraceEvent) { .name = name, .start_us = start_us, .duration_us = duration_us, .arg = arg };
+    atomic_store_explicit(&b->count, i + 1, memory_order_release);
+}
+
+void trace_thread(const char* name)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    TraceBuffer* b = thread_buffer();
+    if (b != NULL) {
+        b->thread_name = name;
+    }
+}
+
+TraceSpan trace_begin_arg(const char* name, int32_t arg)
+{
+    TraceSpan span = { .name = name, .start_us = 0, .arg = arg };
+    if (trace_enabled) {
+        span.start_us = micros();
+    }
+    return span;
+}
+
+TraceSpan trace_begin(const char* name)
+{
+    return trace_begin_arg(name, TRACE_NO_ARG);
+}
+
+void trace_end(TraceSpan span)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    trace_record(span.name, span.start_us, micros() - span.start_us, span.arg);
+}
+
+void trace_instant(const char* name, int32_t arg)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    trace_record(name, micros(), UINT32_MAX, arg);
+}
+
+void write_event(FILE* f, const TraceBuffer* b, const TraceEvent* e)
+{
+    if (e->duration_us == UINT32_MAX) {
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%u,\"pid\":1,\"tid\":%d", e->name, e->start_us, b->tid);
+    } else {
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,\"pid\":1,\"tid\":%d", e->name, e->start_us, e->duration_us, b->tid);
+    }
+    if (e->arg != TRACE_NO_ARG) {
+        fprintf(f, ",\"args\":{\"value\":%d}", e->arg);
+    }
+    fprintf(f, "}");
+}
+
+void stop_trace(void)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    trace_enabled = false;
+    FILE* f = fopen(trace_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "[WARN] Could not write the trace on %s\n", trace_path);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"main\"}}");
+    int n_buffers = atomic_load(&trace_buffer_count);
+    int events = 0;
+    unsigned int dropped = 0;
+    for (int t = 0; (t < n_buffers) && (t < TRACE_THREADS); t++) {
+        const TraceBuffer* b = atomic_load(&trace_buffers[t]);
+        if (b == NULL) {
+            continue;
+        }
+        if (b->thread_name != NULL) {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", b->tid, b->thread_name);
+        }
+        int count = atomic_load_explicit(&b->count, memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            write_event(f, b, &b->events[i]);
+        }
+        events += count;
+        dropped += atomic_load(&b->dropped);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    fprintf(stderr, "[DEBUG] Trace of %d events written on %s, %u dropped\n", events, trace_path, dropped);
+}
@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Timeline of what each thread spends its time on, written as Chrome trace JSON
+ * (chrome://tracing, https://ui.perfetto.dev) at shutdown.
+ *
+ * Every thread gets its own buffer on its first event, and is the only one writing it,
+ * so recording a span is two micros() and a store. A full buffer drops the new events.
+ * Off unless TRACE_FILE is set, then a span costs a branch.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_THREADS 8
+// Per thread, 24 bytes each. The sensor thread fills about 500 a second
+#define TRACE_EVENTS 200000
+#define TRACE_NO_ARG INT32_MIN
+
+typedef struct {
+    const char* name; // string literal, kept until the trace is written
+    uint32_t start_us; // micros()
+    uint32_t duration_us;
+    int32_t arg; // TRACE_NO_ARG when none
+} TraceEvent;
+
+typedef struct {
+    const char* thread_name;
+    int tid;
+    int capacity;
+    _Atomic int count; // events published, the writer stores it after the event
+    atomic_uint dropped;
+    TraceEvent* events;
+} TraceBuffer;
+
+/**
+ * Started span, pass it to trace_end
+ */
+typedef struct {
+    const char* name;
+    uint32_t start_us;
+    int32_t arg;
+} TraceSpan;
+
+extern bool trace_enabled;
+
+/**
+ * Reads TRACE_FILE and TRACE_EVENTS, before the threads start
+ */
+extern void start_trace(void);
+/**
+ * Writes the trace. The other threads should be done, events they add meanwhile may be left out
+ */
+extern void stop_trace(void);
+
+/**
+ * Name of the calling thread in the viewer
+ */
+extern void trace_thread(const char* name);
+extern TraceSpan trace_begin(const char* name);
+/**
+ * Same with a number shown next to the span (action index, wheel command...)
+ */
+extern TraceSpan trace_begin_arg(const char* name, int32_t arg);
+extern void trace_end(TraceSpan span);
+/**
+ * Zero length event
+ */
+extern void trace_instant(const char* name, int32_t arg);
+
+#endif
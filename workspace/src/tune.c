@@ -0,0 +1,385 @@
+/**
+ * Searches the sensor thresholds (SensorParams) over labelled ADC recordings, off the robot.
+ *
+ * Recordings are what the sensor thread prints with DEBUG_SENSORS=1 ("adc0, adc1, adc2, adc3" every 10ms).
+ * The labels file has one recording per line:
+ *
+ *     <recording> <distance_l_mm> <distance_r_mm> [<from_sample>:<to_sample> ...]
+ *
+ * the distance each wheel really travelled, and the samples in which an obstacle was in stopping range.
+ *
+ * Usage: ./tune labels.txt SWITCH_POINT_L=300:460:20 EXP_AVR_WEIGHT=2:6:1 ...
+ * Parameters not given keep their value (environment or default), see load_sensor_params.
+ */
+#include "control.h"
+#include "helper.h"
+#include "sensors.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#define TUNE_MAX_RECORDINGS 64
+#define TUNE_MAX_INTERVALS 32
+#define TUNE_MAX_THREADS 16
+#define TUNE_MAX_CONFIGURATIONS 1000000
+// A false stop costs as much as 10% of count error when ranking
+#define TUNE_STOP_WEIGHT 0.1
+
+typedef struct {
+    int from;
+    int to;
+} Interval;
+
+typedef struct {
+    int (*samples)[4];
+    int n;
+    double counts_l; // expected, from the distance travelled
+    double counts_r;
+    Interval obstacles[TUNE_MAX_INTERVALS];
+    int n_obstacles;
+} Recording;
+
+typedef struct {
+    const char* name;
+    size_t offset;
+    bool is_double;
+} ParamField;
+
+const ParamField param_fields[] = {
+    { "SWITCH_POINT_L", offsetof(SensorParams, switch_point_l), false },
+    { "SWITCH_POINT_R", offsetof(SensorParams, switch_point_r), false },
+    { "EXP_AVR_WEIGHT", offsetof(SensorParams, exp_avr_weight), true },
+    { "ENCODER_HYSTERESIS", offsetof(SensorParams, encoder_hysteresis), false },
+    { "ENCODER_MIN_BAND", offsetof(SensorParams, encoder_min_band), false },
+    { "ENCODER_ENVELOPE_DECAY", offsetof(SensorParams, encoder_envelope_decay), false },
+    { "MOTION_EXP_AVR_WEIGHT", offsetof(SensorParams, motion_exp_avr_weight), true },
+    { "OBSTACLE_PROXIMITY_L", offsetof(SensorParams, obstacle_proximity_l), false },
+    { "OBSTACLE_PROXIMITY_R", offsetof(SensorParams, obstacle_proximity_r), false },
+    { "IGNORE_PROXIMITY_L", offsetof(SensorParams, ignore_proximity_l), false },
+    { "IGNORE_PROXIMITY_R", offsetof(SensorParams, ignore_proximity_r), false },
+    { "NOISE_IGNORE_SIGMAS", offsetof(SensorParams, noise_ignore_sigmas), false },
+    { "NOISE_OBSTACLE_SIGMAS", offsetof(SensorParams, noise_obstacle_sigmas), false },
+};
+#define N_PARAM_FIELDS ((int)(sizeof(param_fields) / sizeof(param_fields[0])))
+
+typedef struct {
+    int field;
+    double from;
+    double step;
+    int n;
+} ParamRange;
+
+typedef struct {
+    SensorParams params;
+    double count_error; // relative to the expected counts
+    double false_stops; // per recording
+    double missed_stops; // per obstacle interval
+    double score;
+} Evaluation;
+
+Recording recordings[TUNE_MAX_RECORDINGS];
+int n_recordings = 0;
+ParamRange ranges[N_PARAM_FIELDS];
+int n_ranges = 0;
+SensorParams base_params;
+
+void set_param(SensorParams* p, int field, double value)
+{
+    char* at = (char*)p + param_fields[field].offset;
+    if (param_fields[field].is_double) {
+        *(double*)at = value;
+    } else {
+        *(int*)at = (int)lround(value);
+    }
+}
+
+double get_param(const SensorParams* p, int field)
+{
+    const char* at = (const char*)p + param_fields[field].offset;
+    return param_fields[field].is_double ? *(const double*)at : *(const int*)at;
+}
+
+int load_recording(Recording* r, const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] Cannot open recording %s\n", path);
+        return -1;
+    }
+    int capacity = 1024;
+    r->samples = malloc(sizeof(*r->samples) * (size_t)capacity);
+    r->n = 0;
+    char line[256];
+    while ((r->samples != NULL) && (fgets(line, sizeof(line), f) != NULL)) {
+        int adc[4];
+        // Anything else the firmware printed on stdout is skipped
+        if (sscanf(line, "%d, %d, %d, %d", &adc[0], &adc[1], &adc[2], &adc[3]) != 4) {
+            continue;
+        }
+        if (r->n == capacity) {
+            capacity *= 2;
+            void* bigger = realloc(r->samples, sizeof(*r->samples) * (size_t)capacity);
+            if (bigger == NULL) {
+                free(r->samples);
+                r->samples = NULL;
+                break;
+            }
+            r->samples = bigger;
+        }
+        memcpy(r->samples[r->n++], adc, sizeof(adc));
+    }
+    fclose(f);
+    if (r->samples == NULL) {
+        fprintf(stderr, "[ERROR] Out of memory reading %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int load_labels(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] Cannot open labels %s\n", path);
+        return -1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* token = strtok(line, " \t\n");
+        if ((token == NULL) || (token[0] == '#')) {
+            continue;
+        }
+        if (n_recordings == TUNE_MAX_RECORDINGS) {
+            fprintf(stderr, "[WARN] Only the first %d recordings are used\n", TUNE_MAX_RECORDINGS);
+            break;
+        }
+        Recording* r = &recordings[n_recordings];
+        if (load_recording(r, token) < 0) {
+            fclose(f);
+            return -1;
+        }
+        char* distance_l = strtok(NULL, " \t\n");
+        char* distance_r = strtok(NULL, " \t\n");
+        if ((distance_l == NULL) || (distance_r == NULL)) {
+            fprintf(stderr, "[ERROR] %s needs the distance travelled by each wheel\n", token);
+            fclose(f);
+            return -1;
+        }
+        r->counts_l = fabs(atof(distance_l)) / perimeter_wheel_mm * countsPerLap;
+        r->counts_r = fabs(atof(distance_r)) / perimeter_wheel_mm * countsPerLap;
+        r->n_obstacles = 0;
+        while (((token = strtok(NULL, " \t\n")) != NULL) && (r->n_obstacles < TUNE_MAX_INTERVALS)) {
+            Interval* in = &r->obstacles[r->n_obstacles];
+            if (sscanf(token, "%d:%d", &in->from, &in->to) == 2) {
+                r->n_obstacles++;
+            }
+        }
+        n_recordings++;
+    }
+    fclose(f);
+    return n_recordings > 0 ? 0 : -1;
+}
+
+int parse_range(const char* arg)
+{
+    for (int i = 0; i < N_PARAM_FIELDS; i++) {
+        size_t len = strlen(param_fields[i].name);
+        if ((strncmp(arg, param_fields[i].name, len) != 0) || (arg[len] != '=')) {
+            continue;
+        }
+        double from = 0;
+        double to = 0;
+        double step = 1;
+        int read = sscanf(arg + len + 1, "%lf:%lf:%lf", &from, &to, &step);
+        if (read < 1) {
+            break;
+        }
+        if (read == 1) {
+            to = from;
+        }
+        if ((step <= 0) || (to < from)) {
+            break;
+        }
+        ranges[n_ranges].field = i;
+        ranges[n_ranges].from = from;
+        ranges[n_ranges].step = step;
+        ranges[n_ranges].n = (int)floor((to - from) / step + 1e-9) + 1;
+        n_ranges++;
+        return 0;
+    }
+    fprintf(stderr, "[ERROR] Expected NAME=from:to:step, got %s\n", arg);
+    return -1;
+}
+
+bool in_obstacle(const Recording* r, int sample)
+{
+    for (int i = 0; i < r->n_obstacles; i++) {
+        if ((sample >= r->obstacles[i].from) && (sample <= r->obstacles[i].to)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Replays every recording through the same filters the sensor thread uses
+ */
+void evaluate(Evaluation* e)
+{
+    const SensorParams* p = &e->params;
+    double count_error = 0;
+    double expected = 0;
+    int false_stops = 0;
+    int missed = 0;
+    int intervals = 0;
+    for (int i = 0; i < n_recordings; i++) {
+        const Recording* r = &recordings[i];
+        WheelFilter wheel_l = { 0 };
+        WheelFilter wheel_r = { 0 };
+        ProximityFilter proximity_l = { 0 };
+        ProximityFilter proximity_r = { 0 };
+        int counts_l = 0;
+        int counts_r = 0;
+        bool was_stopped = false;
+        bool seen[TUNE_MAX_INTERVALS] = { false };
+        for (int s = 0; s < r->n; s++) {
+            filter_proximity(&proximity_l, p, p->ignore_proximity_l, p->obstacle_proximity_l, p->motion_exp_avr_weight, r->samples[s][0]);
+            filter_proximity(&proximity_r, p, p->ignore_proximity_r, p->obstacle_proximity_r, p->motion_exp_avr_weight, r->samples[s][1]);
+            counts_l += should_sensor_count(&wheel_l, p, SENSOR_PERIOD_MS, p->switch_point_l, r->samples[s][2]);
+            counts_r += should_sensor_count(&wheel_r, p, SENSOR_PERIOD_MS, p->switch_point_r, r->samples[s][3]);
+
+            bool stopped = proximity_l.nearby || proximity_r.nearby;
+            if (stopped && !was_stopped && !in_obstacle(r, s)) {
+                false_stops++;
+            }
+            for (int o = 0; stopped && (o < r->n_obstacles); o++) {
+                seen[o] = seen[o] || ((s >= r->obstacles[o].from) && (s <= r->obstacles[o].to));
+            }
+            was_stopped = stopped;
+        }
+        for (int o = 0; o < r->n_obstacles; o++) {
+            missed += !seen[o];
+        }
+        intervals += r->n_obstacles;
+        count_error += fabs(counts_l - r->counts_l) + fabs(counts_r - r->counts_r);
+        expected += r->counts_l + r->counts_r;
+    }
+    e->count_error = expected > 0 ? count_error / expected : 0;
+    e->false_stops = (double)false_stops / n_recordings;
+    e->missed_stops = intervals > 0 ? (double)missed / intervals : 0;
+    e->score = e->count_error + TUNE_STOP_WEIGHT * (e->false_stops + e->missed_stops);
+}
+
+typedef struct {
+    Evaluation* results;
+    int begin;
+    int end;
+} TuneWorker;
+
+void configuration(int index, SensorParams* p)
+{
+    *p = base_params;
+    for (int i = 0; i < n_ranges; i++) {
+        set_param(p, ranges[i].field, ranges[i].from + ranges[i].step * (index % ranges[i].n));
+        index /= ranges[i].n;
+    }
+}
+
+int tune_worker(void* arg)
+{
+    TuneWorker* w = (TuneWorker*)arg;
+    for (int i = w->begin; i < w->end; i++) {
+        configuration(i, &w->results[i].params);
+        evaluate(&w->results[i]);
+    }
+    return 0;
+}
+
+int compare_evaluations(const void* a, const void* b)
+{
+    double sa = ((const Evaluation*)a)->score;
+    double sb = ((const Evaluation*)b)->score;
+    return (sa > sb) - (sa < sb);
+}
+
+void print_evaluation(const Evaluation* e)
+{
+    for (int i = 0; i < N_PARAM_FIELDS; i++) {
+        printf("%g, ", get_param(&e->params, i));
+    }
+    printf("%.4f, %.3f, %.3f, %.4f\n", e->count_error, e->false_stops, e->missed_stops, e->score);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s labels.txt [NAME=from:to:step ...]\n", argv[0]);
+        return -1;
+    }
+    load_sensor_params(&base_params);
+    if (load_labels(argv[1]) < 0) {
+        return -2;
+    }
+    long n = 1;
+    for (int i = 2; i < argc; i++) {
+        if (parse_range(argv[i]) < 0) {
+            return -3;
+        }
+        n *= ranges[n_ranges - 1].n;
+        if (n > TUNE_MAX_CONFIGURATIONS) {
+            fprintf(stderr, "[ERROR] More than %d configurations, use bigger steps\n", TUNE_MAX_CONFIGURATIONS);
+            return -4;
+        }
+    }
+
+    Evaluation* results = calloc((size_t)n, sizeof(Evaluation));
+    if (results == NULL) {
+        return -5;
+    }
+    int threads = get_default_var("TUNE_THREADS", 4);
+    threads = threads < 1 ? 1 : (threads > TUNE_MAX_THREADS ? TUNE_MAX_THREADS : threads);
+    fprintf(stderr, "Evaluating %ld configurations over %d recordings with %d threads\n", n, n_recordings, threads);
+
+    TuneWorker workers[TUNE_MAX_THREADS];
+    thrd_t ids[TUNE_MAX_THREADS];
+    bool started[TUNE_MAX_THREADS] = { false };
+    for (int t = 0; t < threads; t++) {
+        workers[t].results = results;
+        workers[t].begin = (int)(n * t / threads);
+        workers[t].end = (int)(n * (t + 1) / threads);
+        started[t] = thrd_create(&ids[t], tune_worker, &workers[t]) == thrd_success;
+        if (!started[t]) {
+            tune_worker(&workers[t]);
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        if (started[t]) {
+            thrd_join(ids[t], NULL);
+        }
+    }
+
+    Evaluation current = { .params = base_params };
+    evaluate(&current);
+    qsort(results, (size_t)n, sizeof(Evaluation), compare_evaluations);
+
+    for (int i = 0; i < N_PARAM_FIELDS; i++) {
+        printf("%s, ", param_fields[i].name);
+    }
+    printf("count_error, false_stops, missed_stops, score\n");
+    print_evaluation(&current);
+    int top = get_default_var("TUNE_TOP", 10);
+    for (int i = 0; (i < top) && (i < n); i++) {
+        print_evaluation(&results[i]);
+    }
+
+    fprintf(stderr, "Best:");
+    for (int i = 0; i < N_PARAM_FIELDS; i++) {
+        fprintf(stderr, " %s=%g", param_fields[i].name, get_param(&results[0].params, i));
+    }
+    fprintf(stderr, "\n");
+    free(results);
+    return 0;
+}
@@ -41,6 +41,7 @@
 #define UNKNOWN_ERROR -255
 #define INTERRUPT -1
 #define RETRY -15
+#define STALL -20
 #define CONTROL_OK 0
 #define CONTROL_CONTINUE 1
 